@@ -2,13 +2,39 @@
  *  This program implements the following functionality:
  *  - Provide a prompt for running commands
  *  - Handle blank lines and comments, which are lines beginning with the # character
- *  - Provide expansion for the variable $$ with process ID
+ *  - Provide expansion for the variable $$ with process ID and for shell variables
  *  - Execute 3 commands "exit", "cd", and "status" via code built into the shell
  *  - Execute other commands by creating new processes using a function from the exec family of functions
- *  - Support input and output redirection
+ *  - Keep shell and environment variables, with per-command VAR=value overrides
+ *  - Expand *, ? and [...] filename patterns
+ *  - Substitute $(command) output, running echo, printf and pwd without forking
+ *  - Expand {a,b} and {1..N} braces lazily, launching huge expansions in ARG_MAX-sized chunks
+ *  - Support input and output redirection, including >>, <>, 2> and 2>&1, and fds kept open with exec 3>file
+ *  - Pass <<EOF here-documents and <<<word here-strings to commands as sealed in-memory files
+ *  - Substitute <(command) and >(command) with /dev/fd pipes, tracking background jobs in a job table
+ *  - Run cat and tee in the shell, moving data inside the kernel with copy_file_range, splice and tee
+ *  - Run wc in the shell, counting mapped or streamed input with SSE2/AVX2 kernels picked at runtime
+ *  - Sleep on a timerfd without forking, run sleep & as a virtual job, and wait for jobs through epoll
+ *  - Pin commands to CPUs and NUMA nodes with pin, and place background jobs on their own cores with set
+ *  - Start background jobs at a set nice level, I/O priority and scheduling policy, and renice them by %job
+ *  - Limit how fast background jobs launch with a token bucket, queueing the rest in the event loop
+ *  - Retry failed commands with exponential backoff and jitter, background retries waiting on the job timer
+ *  - Run a dependency graph of commands in parallel with dag, reporting its critical path
+ *  - Restore the output of cached commands from a content-addressed store instead of running them
+ *  - Skip tool < src > dst commands whose output is up to date under set incremental
+ *  - Rerun a command when watched files change, through inotify in the event loop
+ *  - Run commands periodically with every and once at a time of day with at, from a timer wheel
+ *  - Run command lists with ;, && and ||, pipelines with |, and { } groups
+ *  - Run for and while/until loops from the parsed tree, without re-reading the body
+ *  - Read lines for the prompt and the read builtin through a shell-owned read-ahead buffer per fd
+ *  - Run shell functions in-process with a local variable frame, and expand aliases at the prompt
  *  - Support running commands in foreground and background processes
  *  - Implement custom handlers for 2 signals, SIGINT and SIGTSTP
+ *  - Run script files, caching each parsed script as a relocatable image that is mmap'd on the next run
+ *  - Run -c strings, exec'ing the last command of a script or string in place of the shell
  */
+// memfd_create() and file sealing
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,7 +44,131 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #define MAX_PROCESSES 100
+#define MAX_ASSIGNS 64
+#define MAX_ARGS 512
+#define MAX_REDIRS 16
+#define MAX_SUBSTITUTIONS 64
+#define COPY_CHUNK 1048576
+// copyFD() and countFD() were stopped by SIGINT
+#define COPY_INTERRUPTED 1
+#define MAX_TEE_OUTPUTS 64
+#define COUNT_LINES 1
+#define COUNT_WORDS 2
+#define COUNT_BYTES 4
+#define MAX_EVENTS 16
+// waitEvents() could not watch one of its fds
+#define WAIT_ERROR -2
+#define NS_PER_SECOND 1000000000ULL
+// Above PID_MAX_LIMIT, so a virtual job's id never matches a process
+#define VIRTUAL_PID_BASE 4194304
+#define MAX_NODES 64
+// Longest command text kept for jobs and schedules, which only display it
+#define MAX_JOB_TEXT 4096
+// From <numaif.h>, which is not always installed
+#define MPOL_BIND 2
+#define PLACE_NONE 0
+#define PLACE_SPREAD 1
+#define PLACE_PACK 2
+#define PLACE_NUMA 3
+// jobnice is not set, so jobs keep the shell's nice level
+#define NICE_NONE 100
+// From <linux/ioprio.h>
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define LAUNCH_HISTORY 1024
+// States of a command in a dag
+#define DAG_WAITING 0
+#define DAG_RUNNING 1
+#define DAG_DONE 2
+#define DAG_FAILED 3
+#define DAG_CANCELLED 4
+// From <linux/fs.h>
+#define FICLONE _IOW(0x94, 9, int)
+#define SHA256_SIZE 32
+#define PATH_CACHE_SIZE 64
+// Timer wheel of every and at schedules: slots of a second, a lap of 256 seconds
+#define WHEEL_SLOTS 256
+#define WHEEL_TICK NS_PER_SECOND
+// What happens to a firing of a schedule missed during a suspend or a long foreground command
+#define MISFIRE_ONCE 0
+#define MISFIRE_SKIP 1
+// Changes that make watch run its command again
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define VAR_TABLE_SIZE 256
+#define ARENA_BLOCK_SIZE 65536
+#define MAX_GLOB_TOKENS 63
+#define BRACE_LITERAL 0
+#define BRACE_LIST 1
+#define BRACE_RANGE 2
+#define BRACE_MATCHES 3
+#define CAPTURE_CHUNK 4096
+#define TOKEN_END 0
+#define TOKEN_WORD 1
+#define TOKEN_NEWLINE 2
+#define TOKEN_SEMI 3
+#define TOKEN_AMP 4
+#define TOKEN_AND 5
+#define TOKEN_OR 6
+#define TOKEN_PIPE 7
+#define TOKEN_LESS 8
+#define TOKEN_GREAT 9
+#define TOKEN_DGREAT 10
+#define TOKEN_LESSGREAT 11
+#define TOKEN_DUP 12
+#define TOKEN_HERESTRING 13
+#define TOKEN_HEREDOC 14
+#define TOKEN_HEREDOC_QUOTED 15
+#define AST_SIMPLE 0
+#define AST_LIST 1
+#define AST_ANDOR 2
+#define AST_PIPELINE 3
+#define AST_GROUP 4
+#define AST_FOR 5
+#define AST_WHILE 6
+#define AST_FUNCTION 7
+#define IMAGE_MAGIC "SMSHAST1"
+#define IMAGE_VERSION 5
+#define MAX_READ_FDS 64
+#define READ_CHUNK_MIN 512
+#define READ_CHUNK_MAX 65536
+#define MAX_CALL_DEPTH 1000
+#define MAX_ALIAS_DEPTH 16
+
+extern char **environ;
+
+/*
+ *  struct for one redirection of a command or group, applied in the order written.
+ */
+struct redirection {
+    // fd being redirected
+    int fd;
+    // TOKEN_LESS, TOKEN_GREAT, TOKEN_DGREAT, TOKEN_LESSGREAT, TOKEN_DUP, TOKEN_HERESTRING,
+    // TOKEN_HEREDOC or TOKEN_HEREDOC_QUOTED
+    int op;
+    // Target file, fd number or "-" for TOKEN_DUP, or here-document text; raw in the syntax tree,
+    // expanded in a commandLine, where every here-document or here-string has become a
+    // TOKEN_HEREDOC whose word is the number of the in-memory file holding its text
+    char *word;
+};
 
 /*
  *  struct to hold command line arguments.
@@ -26,15 +176,458 @@
 struct commandLine {
     // Array of pointers for arguments
     // args[0] contains command, and the rest its arguments, terminated by NULL
-    char *args[512];
+    char *args[MAX_ARGS];
     // Number of actual arguments
     int argsNum;
-    // Input file path
-    char *inputFile;
-    // Output file path
-    char *outputFile;
+    // Redirections, with their targets expanded
+    struct redirection redirs[MAX_REDIRS];
+    int redirsNum;
     // Ampersand character
     bool background;
+    // Leading VAR=value words, applied only to this command's environment
+    char *assigns[MAX_ASSIGNS];
+    // Number of leading assignments
+    int assignsNum;
+    // Compiled brace expression for each arg, NULL for plain words
+    struct braceSeq *braces[MAX_ARGS];
+    // Whether any arg needs brace expansion at launch
+    bool hasBraces;
+    // Set when words did not fit in args, so the command fails with E2BIG instead of running
+    bool tooLong;
+};
+
+/*
+ *  struct for one part of a brace expression: literal text, {x,y,...} or {first..last..step},
+ *  or the matches of a pattern too many for the args of a command.
+ *  Parts keep their own position, so a whole expression works as an odometer that
+ *  yields one word at a time without building the full list.
+ */
+struct bracePart {
+    // BRACE_LITERAL, BRACE_LIST or BRACE_RANGE
+    int type;
+    // Literal text
+    const char *text;
+    size_t length;
+    // Alternatives of a list and the one currently selected
+    struct braceSeq **alts;
+    int altsNum;
+    int current;
+    // Range endpoints, step, zero-padding width and current position
+    long first;
+    long step;
+    long count;
+    long index;
+    int width;
+    bool isChar;
+    // File names of a pattern's matches, stepped through with count and index
+    char **matches;
+};
+
+/*
+ *  struct for a sequence of brace parts, concatenated to form one word.
+ */
+struct braceSeq {
+    struct bracePart *parts;
+    int partsNum;
+    // Words are file names that are not expanded again
+    bool expanded;
+};
+
+/*
+ *  struct to hold a shell variable.
+ *  The "NAME=value" entry is kept whole so the envp snapshot can point at it directly.
+ */
+struct shellVar {
+    // Variable name
+    char *name;
+    // Full "NAME=value" string
+    char *entry;
+    // Value part of entry
+    char *value;
+    // Whether the variable is passed to child processes
+    bool exported;
+    // Slot of entry in the current envp snapshot, -1 if not in it
+    int envIndex;
+    // Next variable in the same hash bucket
+    struct shellVar *next;
+};
+
+/*
+ *  struct for one block of the line arena.
+ */
+struct arenaBlock {
+    // Next (older) block
+    struct arenaBlock *next;
+    // Bytes handed out from data
+    size_t used;
+    // Capacity of data
+    size_t size;
+    char data[];
+};
+
+/*
+ *  struct to hold the entries of one directory, read once per command line.
+ */
+struct dirCacheEntry {
+    // Directory path as used in the pattern, "" for the working directory
+    char *path;
+    // Entry names, excluding "." and ".."
+    char **names;
+    // Entry types from getdents64 (DT_DIR, DT_UNKNOWN, ...)
+    unsigned char *types;
+    // Number of entries
+    int namesNum;
+    // Next cached directory
+    struct dirCacheEntry *next;
+};
+
+/*
+ *  Directory entry layout returned by the getdents64 system call.
+ */
+struct linuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+ *  struct to hold a glob pattern compiled to a bit-parallel automaton.
+ *  Bit i of a state set means the first i pattern tokens have been matched.
+ */
+struct globPattern {
+    // States that advance on each input byte
+    uint64_t accept[256];
+    // States that are '*' and loop on any byte
+    uint64_t star;
+    // Accepting state
+    uint64_t final;
+    // Pattern begins with a literal '.', so it may match hidden names
+    bool matchesDot;
+};
+
+/*
+ *  struct for the growable buffer that $(...) output is captured into.
+ */
+struct captureBuffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+/*
+ *  struct for where an expanded word splits into fields. The breaks are kept apart from the
+ *  text, so a field may hold any byte.
+ */
+struct fieldList {
+    // Offset in the expanded text where each field after the first begins
+    size_t *breaks;
+    int breaksNum;
+    int capacity;
+};
+
+/*
+ *  struct for one token produced by the lexer.
+ */
+struct lexToken {
+    // TOKEN_WORD, TOKEN_SEMI, ...
+    int type;
+    // Raw text of a word, in the arena
+    char *text;
+    // fd a redirection operator applies to, given or default
+    int fd;
+};
+
+/*
+ *  struct for the lexer's position in the text being parsed.
+ */
+struct lexer {
+    const char *cursor;
+    // Set when the text ends inside a construct that needs more input
+    bool incomplete;
+    // Set when a syntax error was reported
+    bool failed;
+    // Where lexing resumes after the current line, past the here-documents it started
+    const char *heredocNext;
+};
+
+/*
+ *  struct for one node of the syntax tree of a command line, allocated in the line arena.
+ *  A simple command keeps its words unexpanded; they are expanded each time it runs.
+ */
+struct astNode {
+    // AST_SIMPLE, AST_LIST, AST_ANDOR, AST_PIPELINE, AST_GROUP, AST_FOR, AST_WHILE or AST_FUNCTION
+    int type;
+    // Ended by '&'
+    bool background;
+    // Raw words of a simple command, the variable and word list of a for loop, or a function's name
+    char **words;
+    int wordsNum;
+    // For each word, 1 if it has nothing to expand and can be used as it is
+    char *literal;
+    // Redirections of a simple command or compound command
+    struct redirection *redirs;
+    int redirsNum;
+    // Items of a list, and-or chain or pipeline, or the body of a group
+    struct astNode **children;
+    int childrenNum;
+    // TOKEN_AND or TOKEN_OR before each child of an and-or chain
+    int *ops;
+    // An until loop, which runs while its condition fails
+    bool until;
+};
+
+/*
+ *  struct to save the arena position so everything allocated after it can be released.
+ */
+struct arenaMark {
+    struct arenaBlock *block;
+    size_t used;
+    struct dirCacheEntry *dirCache;
+};
+
+/*
+ *  Header of a compiled script image.
+ *  The rest of the image holds the script's nodes, arrays and strings, with every pointer
+ *  stored as an offset from the start of the image (0 for NULL).
+ */
+struct imageHeader {
+    char magic[8];
+    uint32_t version;
+    // sizeof(struct astNode) of the shell that wrote the image
+    uint32_t nodeSize;
+    // Identity of the script the image was compiled from
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    int64_t size;
+    uint64_t pathOffset;
+    // Offset of the root node
+    uint64_t rootOffset;
+    uint64_t imageSize;
+};
+
+/*
+ *  struct for the read-ahead buffer the shell keeps for an fd it reads lines from.
+ *  Seekable files are read in chunks and the unread rest is given back with lseek before
+ *  any other process can see the offset; other inputs are read one byte at a time so
+ *  nothing meant for a later command is consumed.
+ */
+struct readBuffer {
+    char *data;
+    // Unread bytes are data[start..end)
+    size_t start;
+    size_t end;
+    // Size of the next chunk read from a seekable file
+    size_t chunk;
+    // 1 if seekable, 0 if not, -1 if not checked since the fd last changed
+    int seekable;
+};
+
+/*
+ *  struct for a shell function. The body is copied out of the line it was defined on
+ *  into an image of its own, so calls run the parsed tree without parsing it again.
+ */
+struct shellFunction {
+    char *name;
+    // Image holding the body, and the body's root node inside it
+    char *image;
+    struct astNode *body;
+    // Calls of this function still running
+    int calls;
+    // Next function in the same hash bucket
+    struct shellFunction *next;
+};
+
+/*
+ *  struct for an alias.
+ */
+struct shellAlias {
+    char *name;
+    // Text that replaces the command word
+    char *value;
+    // Next alias in the same hash bucket
+    struct shellAlias *next;
+};
+
+/*
+ *  struct for a variable made local to a function call, with the value to restore on return.
+ */
+struct localVar {
+    char *name;
+    // Value before the call, NULL if it was not set
+    char *value;
+    bool exported;
+    struct localVar *next;
+};
+
+/*
+ *  struct for the positional parameters and local variables of a function call or script.
+ */
+struct callFrame {
+    // $0 is args[0], $1 is args[1], ...
+    char **args;
+    int argsNum;
+    // Variables to restore when the call returns
+    struct localVar *locals;
+    // Frame of the caller
+    struct callFrame *parent;
+};
+
+/*
+ *  struct for one entry of the job table: a background command or a process substitution.
+ *  Job n is jobTable[n - 1]; a slot is free when pid is 0.
+ */
+struct job {
+    pid_t pid;
+    // Command text shown by jobs
+    char *command;
+    // Set by the SIGCHLD handler, with the wait status, once the process has been collected
+    bool done;
+    int status;
+    // Started by <(...) or >(...), so its start and end are not announced
+    bool substitution;
+    // Run by the shell's event loop with no process behind it; pid is a synthetic id
+    bool virtual;
+    // CLOCK_MONOTONIC time in ns at which a virtual job's timer fires, 0 for none
+    uint64_t deadline;
+    // CPUs the job was pinned to, kept from other jobs while it runs
+    bool placed;
+    cpu_set_t cpus;
+    // Retry policy and attempt history of a job started by retry, NULL for others
+    struct retryState *retry;
+};
+
+/*
+ *  struct for a background launch held back by set launchrate until a token is free.
+ *  It keeps either an expanded simple command or a private copy of a group's tree.
+ */
+struct deferredLaunch {
+    // Expanded words, leading assignments and redirections of a simple command
+    char **args;
+    char **assigns;
+    int assignsNum;
+    struct redirection *redirs;
+    int redirsNum;
+    // Image holding the tree of a background group, pipeline or list, NULL for a simple command
+    char *image;
+    struct astNode *node;
+    struct deferredLaunch *next;
+};
+
+/*
+ *  struct for a background job started by retry. Between attempts the job is virtual, waiting
+ *  on the job timer for its backoff, and launch is run again when the timer fires.
+ */
+struct retryState {
+    struct deferredLaunch *launch;
+    // Slot of the job in the job table, -1 until the first attempt starts
+    int slot;
+    // Attempts allowed and the number of the current one, from 1
+    int attempts;
+    int attempt;
+    // Backoff before the next attempt, before jitter, and its growth and cap
+    uint64_t delay;
+    double factor;
+    uint64_t maxDelay;
+    // Wait status and run time of each finished attempt, and when the current one started
+    int *statuses;
+    uint64_t *durations;
+    uint64_t started;
+};
+
+/*
+ *  struct for a command in a dag file, a line of the form name: deps -> command.
+ */
+struct dagNode {
+    char *name;
+    struct astNode *command;
+    // Commands this one needs, and the ones that need it, as indexes into the dag
+    int *deps;
+    int depsNum;
+    int *dependents;
+    int dependentsNum;
+    // Dependencies not finished yet
+    int waiting;
+    // Most commands on a chain from here to the end of the dag, this one included
+    int height;
+    int state;
+    pid_t pid;
+    int pidFD;
+    int status;
+    // CLOCK_MONOTONIC times it started and ended
+    uint64_t start;
+    uint64_t end;
+    // Longest run time of a chain of commands ending here, and its previous command, or -1
+    uint64_t pathTime;
+    int critical;
+};
+
+/*
+ *  struct for a command run by every or at. It is launched as a background job when due and
+ *  holds no process in between.
+ */
+struct schedule {
+    int id;
+    // Text shown by jobs
+    char *command;
+    struct deferredLaunch *launch;
+    // Time between runs, 0 for at, which runs once
+    uint64_t period;
+    // CLOCK_BOOTTIME time in ns it is due, which goes on through a suspend
+    uint64_t due;
+    unsigned long runs;
+    unsigned long missed;
+    // Next schedule in the same slot of the timer wheel
+    struct schedule *next;
+};
+
+/*
+ *  struct for where a command name was found along PATH.
+ */
+struct cachedPath {
+    char *name;
+    char *path;
+};
+
+/*
+ *  struct for an output in the cached store, as eviction sees it.
+ */
+struct storedObject {
+    char *name;
+    uint64_t size;
+    // Modification time, which restoring the output sets to the time of use
+    struct timespec used;
+};
+
+/*
+ *  struct for a SHA-256 hash under way.
+ */
+struct sha256 {
+    uint32_t state[8];
+    uint8_t block[64];
+    uint64_t length;
+};
+
+/*
+ *  struct for where a command runs: the CPUs it may use, none meaning any, and the NUMA node
+ *  its memory is bound to, or -1.
+ */
+struct placement {
+    cpu_set_t cpus;
+    int node;
+};
+
+/*
+ *  struct for the totals the wc builtin counts.
+ *  inWord carries across blocks: the last byte that was a space or a printable character was
+ *  printable. Other bytes neither start nor end a word, as in wc's C locale.
+ */
+struct wordCount {
+    uint64_t lines;
+    uint64_t words;
+    uint64_t bytes;
+    bool inWord;
 };
 
 /*
@@ -42,16 +635,239 @@ struct commandLine {
  */
 void SIGTSTPHandler(int sig);
 void SIGCHLDHandler(int sig);
-void createInputFD();
-void createOutputFD();
-char *expandToken(char *inputToken);
-struct commandLine *printShell();
+int createRedirectFD(const struct redirection *redir);
+bool redirectsFD(const struct commandLine *command, int fd);
+char *expandToken(char *inputToken, struct fieldList *fields);
+void addFieldBreak(struct fieldList *fields, size_t offset);
+struct astNode *printShell();
+struct lexToken nextToken(struct lexer *lex);
+struct lexToken peekToken(struct lexer *lex);
+const char *lexRedirection(struct lexer *lex, const char *c, int fd, struct lexToken *token);
+const char *lexHeredoc(struct lexer *lex, const char *c, bool stripTabs, struct lexToken *token);
+struct astNode *parseText(const char *text, bool *incomplete);
+void syntaxError(struct lexer *lex, struct lexToken token);
+struct astNode *parseList(struct lexer *lex, bool inGroup);
+struct astNode *parseAndOr(struct lexer *lex);
+struct astNode *parsePipeline(struct lexer *lex);
+struct astNode *parseCommand(struct lexer *lex);
+bool isListEnd(struct lexToken token);
+bool expectWord(struct lexer *lex, const char *word);
+struct astNode *parseLoop(struct lexer *lex);
+int executeCompound(struct astNode *node);
+int runFor(struct astNode *node);
+int runForWord(struct astNode *node, char *word, int status);
+int runWhile(struct astNode *node);
+struct astNode *newNode(int type, struct astNode **children, int childrenNum);
+struct commandLine *expandCommand(struct astNode *node);
+int addArg(struct commandLine *command, int tokenNum, char *word);
+int executeNode(struct astNode *node);
+int runPipeline(struct astNode *node);
+int runGroup(struct astNode *node);
+bool isBuiltin(const char *name);
+int redirectShell(const struct redirection *redirs, int redirsNum, int saved[MAX_REDIRS]);
+void restoreShell(const struct redirection *redirs, int redirsNum, int saved[MAX_REDIRS]);
+int expandRedirections(const struct astNode *node, struct redirection *redirs);
+void freeRedirections(struct redirection *redirs, int redirsNum);
+int createMemoryFile(const char *data, size_t length);
+void runBackgroundNode(struct astNode *node);
+int statusCode(int status);
 void printExitStatus(int status);
 void printSignalStatus(int status);
 int changeWD();
 void freeCommandLine();
 void exitShell();
+void installSignalHandlers();
 void executeCommandLine();
+void runExternal(char **argv, char **envp);
+void initVariables();
+unsigned int hashName(const char *name, size_t nameLen);
+struct shellVar *lookupVar(const char *name, size_t nameLen);
+char *getVar(const char *name);
+void setVar(const char *name, size_t nameLen, const char *value, bool exported);
+void unsetVar(const char *name);
+bool isAssignment(const char *token);
+bool isName(const char *word);
+char **getEnvSnapshot();
+void applyEnvOverrides(char **envp);
+void exportVars();
+void unsetVars();
+struct readBuffer *getReadBuffer(int fd);
+int readLine(int fd, struct captureBuffer *line);
+void syncReadBuffer(int fd);
+void syncReadBuffers();
+void readVars();
+bool keepRunning();
+struct shellFunction *lookupFunction(const char *name);
+void defineFunction(const char *name, struct astNode *body);
+void undefineFunction(const char *name);
+void callFunction(struct shellFunction *function);
+void pushFrame(char **args, int argsNum);
+void popFrame();
+void saveLocal(const char *name, size_t nameLen);
+const char *getArg(int index);
+void localVars();
+void returnFunction(int status);
+struct shellAlias *lookupAlias(const char *name);
+void expandAlias(struct lexer *lex);
+void aliasNames();
+void unaliasNames();
+void *arenaAlloc(size_t size);
+char *arenaStrndup(const char *string, size_t length);
+void resetArena();
+struct arenaMark getArenaMark();
+void releaseArena(struct arenaMark mark);
+int runScript(const char *path);
+int runString(const char *text);
+struct astNode *findTail(struct astNode *node);
+bool hasBackgroundJobs();
+int addJob(pid_t pid, char *command, bool substitution);
+void listJobs();
+void printLaunchStats();
+char *joinArgs(char **args);
+char *describeNode(const struct astNode *node);
+void appendNodeText(struct captureBuffer *text, const struct astNode *node);
+sigset_t blockChildSignal();
+int substituteCommand(const char *text, size_t length, bool output);
+void closeSubstitutions(int mark);
+bool runsInShell(const struct commandLine *command);
+bool isFIFO(const char *path);
+bool isOption(const char *arg);
+void catFiles();
+void teeFiles();
+int copyFD(int in, int out, const char *name);
+int copyData(int in, int out, const char *name);
+void blockInterrupt(sigset_t *oldMask);
+bool waitInterrupted(int fd);
+void reportInterrupt();
+int movePipe(int pipeFD, int fd, size_t length);
+int writeAll(int fd, const char *data, size_t length);
+bool isSingleByteLocale();
+void countFiles();
+int countFD(int fd, int counts, struct wordCount *total);
+int countNumberWidth(int filesNum, int counts);
+void printCounts(const struct wordCount *total, int counts, int width, const char *name);
+void countBlock(const unsigned char *data, size_t length, struct wordCount *total);
+void countScalar(const unsigned char *data, size_t length, struct wordCount *total);
+#if defined(__x86_64__) || defined(__i386__)
+void countSSE2(const unsigned char *data, size_t length, struct wordCount *total);
+void countAVX2(const unsigned char *data, size_t length, struct wordCount *total);
+#endif
+uint64_t monotonicTime();
+int shellFD(int fd);
+int getEventLoop();
+void armJobTimer();
+void runJobTimers();
+int waitEvents(const int *fds, int fdsNum);
+bool takeInterrupt();
+bool parseDuration(char *const *args, int argsNum, uint64_t *duration);
+void sleepFor();
+void startSleepJob(uint64_t duration);
+int findJob(const char *spec);
+void waitJobs();
+bool parseCPUList(const char *text, cpu_set_t *cpus);
+void readTopology();
+bool choosePlacement(struct placement *placement, bool background);
+int applyPlacement(const struct placement *placement);
+void recordPlacement(int number, const struct placement *placement);
+void pinCommand();
+bool parseDelay(const char *text, uint64_t *delay);
+uint64_t jitterDelay(uint64_t delay);
+uint64_t nextDelay(uint64_t delay, double factor, uint64_t maxDelay);
+bool waitFor(uint64_t duration);
+void retryCommand();
+int addJobAttempt(pid_t pid, char **argv);
+bool scheduleRetry(struct job *job, int status);
+void restartRetryJob(int slot);
+bool hasRetryJobs();
+void clearJob(struct job *job);
+void runDag();
+struct dagNode *readDag(const char *path, int *nodesNum);
+int findDagNode(struct dagNode *nodes, int nodesNum, const char *name);
+int *sortDag(struct dagNode *nodes, int nodesNum);
+void startDagNode(struct dagNode *node, const sigset_t *childMask);
+void finishDagNode(struct dagNode *nodes, int index);
+void cancelDagNode(struct dagNode *nodes, int index, const char *failed);
+void printDagReport(struct dagNode *nodes, int nodesNum, const int *order, uint64_t start, int jobs);
+void freeDag(struct dagNode *nodes, int nodesNum);
+char *getCacheDir();
+void cachedCommand();
+bool hashCommand(uint8_t key[SHA256_SIZE], int *output);
+bool hashFD(struct sha256 *hash, int fd);
+char *findExecutable(const char *name);
+char *getOutputStore();
+bool restoreOutput(const char *store, const char *key, const char *outputPath);
+void storeOutput(const char *store, const char *key, const char *outputPath);
+void evictOutputs(const char *store);
+int compareObjectTimes(const void *a, const void *b);
+void printCacheStats();
+bool isUpToDate(char **argv);
+void watchCommand();
+void addWatches(int inotifyFD, const char *path, char ***watchPaths, int *watchPathsNum);
+pid_t startWatchRun(char **argv, const sigset_t *childMask);
+uint64_t bootTime();
+void everyCommand();
+void atCommand();
+void addSchedule(uint64_t period, uint64_t due, int first);
+void removeSchedules(int first);
+void insertSchedule(struct schedule *entry);
+uint64_t nextScheduleTime();
+void armScheduleTimer();
+void runSchedules();
+void fireSchedule(struct schedule *entry, uint64_t now);
+void listSchedules();
+void freeSchedule(struct schedule *entry);
+void clearSchedules();
+bool isNewer(const struct statx_timestamp *a, const struct statx_timestamp *b);
+void sha256Init(struct sha256 *hash);
+void sha256Update(struct sha256 *hash, const void *data, size_t length);
+void sha256Final(struct sha256 *hash, uint8_t digest[SHA256_SIZE]);
+void sha256Block(uint32_t state[8], const uint8_t *block);
+void hexDigest(const uint8_t digest[SHA256_SIZE], char hex[2 * SHA256_SIZE + 1]);
+void setOptions();
+bool setOption(const char *name, const char *value);
+void printOptions();
+int lookupName(const char *value, const char *names[], int namesNum);
+void openPrioritySync(int syncPipe[2]);
+void applyJobPriority(int syncPipe[2]);
+void waitPrioritySync(int syncPipe[2]);
+void reniceJobs();
+void refillLaunchTokens(uint64_t now);
+bool takeLaunchToken(bool mustLaunch);
+void recordLaunch();
+uint64_t nextLaunchTime();
+void deferLaunch(char **argv, const struct astNode *node);
+struct deferredLaunch *saveLaunch(char **argv, const struct astNode *node);
+void runLaunchQueue();
+void startDeferredLaunch(struct deferredLaunch *launch, bool tokenTaken);
+void freeDeferredLaunch(struct deferredLaunch *launch);
+void clearLaunchQueue();
+void drainLaunchQueue();
+char *copyNodeImage(const struct astNode *node, struct astNode **root);
+void execCommand();
+char *getImagePath(const char *scriptPath);
+struct astNode *loadImage(const char *imagePath, const char *scriptPath, const struct stat *scriptInfo);
+void saveImage(const char *imagePath, const char *scriptPath, const struct stat *scriptInfo, struct astNode *root);
+uint64_t serializeNode(struct captureBuffer *image, const struct astNode *node);
+uint64_t serializeBytes(struct captureBuffer *image, const void *data, size_t length);
+bool relocateNode(char *base, uint64_t size, struct astNode *node);
+bool inImage(uint64_t offset, uint64_t count, uint64_t length, uint64_t size);
+bool isImageString(const char *base, uint64_t offset, uint64_t size);
+bool hasGlobChars(const char *token);
+bool compileGlob(const char *pattern, size_t length, struct globPattern *compiled);
+bool matchGlob(const struct globPattern *compiled, const char *name);
+struct dirCacheEntry *readDirectory(const char *path);
+int compareNames(const void *a, const void *b);
+int expandGlob(const char *pattern, char ***matches);
+struct braceSeq *compileBraces(const char *word, size_t length);
+struct braceSeq *matchesBraceSeq(char **matches, int matchesNum);
+void resetBraceSeq(struct braceSeq *seq);
+bool advanceBraceSeq(struct braceSeq *seq);
+size_t renderBraceSeq(const struct braceSeq *seq, char *output);
+void runBraceChunks(char **envp);
+char *captureCommand(const char *text, size_t length, size_t *outputLength);
+void appendCapture(struct captureBuffer *buffer, const char *data, size_t length);
+bool captureBuiltin(struct commandLine *command, struct captureBuffer *buffer);
+char *formatConversion(const char **f, const char *value);
 
 /*
  *  Global variables.
@@ -59,12 +875,125 @@ void executeCommandLine();
 int runShell = 1;
 pid_t childPID;
 int childStatus = 0;
+// Set when set incremental skipped the last foreground command, whose status is then 0
+bool childSkipped = false;
+// A builtin was stopped by SIGINT, reported once its redirections are undone
+bool builtinInterrupted = false;
+// Exit code of the last command run, builtin or not, for && || and $?
+int lastStatus = 0;
 bool foregroundModeOnly = false;
-pid_t backgroundPIDs[MAX_PROCESSES] = {0};
+struct job jobTable[MAX_PROCESSES] = {{0}};
+void (*countKernel)(const unsigned char *data, size_t length, struct wordCount *total) = NULL;
 struct commandLine *inputCommand;
 struct sigaction SIGINTAction = {0};
 struct sigaction SIGTSTPAction = {0};
 struct sigaction SIGCHLDAction = {0};
+struct shellVar *varTable[VAR_TABLE_SIZE] = {NULL};
+// Number of exported variables
+int exportedNum = 0;
+// Bumped whenever the exported environment changes
+unsigned long envVersion = 1;
+// Version the envp snapshot was built from
+unsigned long snapshotVersion = 0;
+// envp array shared by every spawn until the next export
+char **envSnapshot = NULL;
+// Number of entries in envSnapshot, excluding the NULL terminator
+int envSnapshotNum = 0;
+// Arena for allocations that live until the current command line is done
+struct arenaBlock *lineArena = NULL;
+// Directories read while expanding the current command line
+struct dirCacheEntry *dirCache = NULL;
+// Open the output file for appending, so later chunks of one command do not truncate it
+bool appendOutput = false;
+// Exec external commands in this process instead of forking, for children that exist only to run one command
+bool execDirect = false;
+// Last command of a script or -c string, exec'd in place of the shell when nothing else is pending
+struct astNode *tailNode = NULL;
+// Shell ends of the pipes of <(...) and >(...), open until the command using them is done
+int substFDs[MAX_SUBSTITUTIONS];
+int substFDsNum = 0;
+// First entry of substFDs that belongs to the command being run, which its child keeps across exec
+int substBase = 0;
+// Read-ahead buffers by fd
+struct readBuffer *readBuffers[MAX_READ_FDS] = {NULL};
+struct shellFunction *functionTable[VAR_TABLE_SIZE] = {NULL};
+struct shellAlias *aliasTable[VAR_TABLE_SIZE] = {NULL};
+// Frame of the running function, or of the script, NULL at the prompt
+struct callFrame *currentFrame = NULL;
+// Depth of nested function calls
+int callDepth = 0;
+// Set by return until the running function has unwound
+bool returning = false;
+// Reading commands from the prompt, where aliases are expanded
+bool interactive = false;
+// Event loop: an epoll set holding a timerfd armed for the earliest virtual job timer
+int eventLoopFD = -1;
+int jobTimerFD = -1;
+// Process the event loop was made in; a forked child makes its own
+pid_t eventLoopPID = 0;
+// Earliest pending virtual job deadline in CLOCK_MONOTONIC ns, 0 when there is none
+uint64_t nextDeadline = 0;
+// signalfd for SIGINT, which builtins that wait block so it interrupts them instead of being ignored
+int interruptFD = -1;
+// Id for the next virtual job
+pid_t nextVirtualPID = VIRTUAL_PID_BASE;
+// How background jobs are placed on CPUs: set jobplacement=none|spread|pack|numa
+int jobPlacement = PLACE_NONE;
+const char *placementNames[] = {"none", "spread", "pack", "numa"};
+// Placement given by pin for the command it runs, NULL otherwise
+const struct placement *pinRequest = NULL;
+// Retry policy for the background command being launched, set by retry
+struct retryState *retryRequest = NULL;
+// Schedules of every and at, hashed by due time into the slots of a timer wheel
+struct schedule *wheel[WHEEL_SLOTS];
+int schedulesNum = 0;
+int nextScheduleID = 1;
+// Tick the wheel was last advanced to, and the time its timerfd is armed for, 0 for none
+uint64_t wheelTick = 0;
+uint64_t nextScheduleDue = 0;
+int scheduleTimerFD = -1;
+// set misfire=once|skip
+int misfirePolicy = MISFIRE_ONCE;
+const char *misfireNames[] = {"once", "skip"};
+// Skip commands whose output is newer than their input and executable: set incremental
+bool incremental = false;
+// Where commands were found along PATH, for the PATH in pathCacheKey
+struct cachedPath pathCache[PATH_CACHE_SIZE];
+char *pathCacheKey = NULL;
+// Size limit of the cached output store, set cachesize=n[KMG], and what it has done this session
+uint64_t cacheSize = 1ULL << 30;
+unsigned long cacheHits = 0;
+unsigned long cacheMisses = 0;
+unsigned long cacheSkips = 0;
+unsigned long cacheEvictions = 0;
+uint64_t cacheRestored = 0;
+// NUMA node of each CPU and the CPUs the shell may use, read on first use
+bool topologyRead = false;
+int cpuNodes[CPU_SETSIZE];
+cpu_set_t shellCPUs;
+// Priority background jobs start with: set jobnice=n jobioprio=class[:level] jobsched=policy
+int jobNice = NICE_NONE;
+// I/O class by its IOPRIO_CLASS_* number, 0 leaving I/O priority alone
+int jobIOClass = 0;
+int jobIOLevel = 4;
+const char *ioClassNames[] = {"none", "rt", "be", "idle"};
+int jobSched = 0;
+const char *schedNames[] = {"other", "batch", "idle"};
+const int schedPolicies[] = {SCHED_OTHER, SCHED_BATCH, SCHED_IDLE};
+// Token bucket for background launches: set launchrate=n/s burst=n, where a rate of 0 is no limit
+double launchRate = 0;
+int launchBurst = 1;
+double launchTokens = 1;
+uint64_t launchRefillTime = 0;
+// Background launches waiting for a token, oldest first
+struct deferredLaunch *launchQueue = NULL;
+struct deferredLaunch *launchQueueTail = NULL;
+int launchQueueNum = 0;
+// Set while a queued launch runs, its token already taken
+bool launchingDeferred = false;
+// Times of the latest launches, a ring indexed by launchesNum, for the rate jobs -s shows
+uint64_t launchTimes[LAUNCH_HISTORY];
+unsigned long launchesNum = 0;
 
 /*
  *  A small shell program for CS344 Assignment 3.
@@ -72,23 +1001,48 @@ struct sigaction SIGCHLDAction = {0};
  *  Run the program as follows: ./smallsh
  */
 
-int main() {
+int main(int argc, char *argv[]) {
+    installSignalHandlers();
+    // Import the inherited environment into the variable table
+    initVariables();
+    // Seed the jitter of retry backoffs
+    srandom(getpid() ^ monotonicTime());
+
+    // Run a -c string, with any further arguments as $0, $1, ...
+    if(argc > 2 && strcmp(argv[1], "-c") == 0) {
+        pushFrame(argc > 3 ? argv + 3 : argv, argc > 3 ? argc - 3 : 1);
+        int status = runString(argv[2]);
+        drainLaunchQueue();
+        return status;
+    }
+
+    // Run a script file instead of prompting, if one is given; its arguments are $1, $2, ...
+    if(argc > 1) {
+        pushFrame(argv + 1, argc - 1);
+        int status = runScript(argv[1]);
+        drainLaunchQueue();
+        return status;
+    }
+    interactive = true;
+
     // Print the shell prompt on a loop until runShell is set to 0
     // Intentional infinite loop since the program can be exited inside the shell with "exit" command
     do {
-        // Print the prompt and save command
-        inputCommand = printShell();
-        executeCommandLine();
-        freeCommandLine();
+        // Print the prompt, parse the line and run it
+        struct astNode *root = printShell();
+        if(root != NULL) {
+            executeNode(root);
+        }
+        resetArena();
     } while(runShell);
 
     return 0;
 }
 
 /*
- *  Execute the command based on command values
+ *  Install the shell's signal handlers, once, before the first command of any kind.
  */
-void executeCommandLine() {
+void installSignalHandlers() {
     // SIGINT signal handling
     SIGINTAction.sa_handler = SIG_IGN;
     sigfillset(&SIGINTAction.sa_mask);
@@ -106,412 +1060,7850 @@ void executeCommandLine() {
     sigfillset(&SIGCHLDAction.sa_mask);
     SIGCHLDAction.sa_flags = SA_RESTART;
     sigaction(SIGCHLD, &SIGCHLDAction, NULL);
+}
+
+/*
+ *  Execute the command based on command values
+ */
+void executeCommandLine() {
+    // Finish virtual jobs whose time is up, in case the shell has not waited since
+    if(nextDeadline != 0 && monotonicTime() >= nextDeadline) {
+        runJobTimers();
+    }
+    if(nextScheduleDue != 0 && bootTime() >= nextScheduleDue) {
+        runSchedules();
+    }
+
+    // Builtins succeed unless they say otherwise
+    int previousStatus = lastStatus;
+    lastStatus = 0;
+
+    // Words left out of a full args array fail the command rather than run it on part of them
+    if(inputCommand->tooLong) {
+        fprintf(stderr, "smallsh: %s: %s\n", inputCommand->args[0], strerror(E2BIG));
+        childStatus = 1 << 8;
+        childSkipped = false;
+        lastStatus = 1;
+        if(execDirect) {
+            exit(lastStatus);
+        }
+        return;
+    }
+
+    // Builtins run in the shell itself, so their redirections are applied around them here
+    int saved[MAX_REDIRS];
+    bool redirected = false;
+    struct shellFunction *function = inputCommand->args[0] != NULL ? lookupFunction(inputCommand->args[0]) : NULL;
+    bool inShell = inputCommand->args[0] != NULL && runsInShell(inputCommand);
+    // Under set incremental, cat, tee and wc in the shell are skipped like the tools they stand in
+    // for, before their redirections truncate the output; tee with files to write always runs
+    if(incremental && inShell && function == NULL
+       && (strcmp(inputCommand->args[0], "cat") == 0 || strcmp(inputCommand->args[0], "wc") == 0
+           || (strcmp(inputCommand->args[0], "tee") == 0 && inputCommand->argsNum == 1))
+       && isUpToDate(NULL)) {
+        childStatus = 0;
+        childSkipped = true;
+        return;
+    }
+    if(inputCommand->args[0] != NULL && (function != NULL || inShell || isBuiltin(inputCommand->args[0]))
+       && inputCommand->redirsNum > 0) {
+        if(redirectShell(inputCommand->redirs, inputCommand->redirsNum, saved) == -1) {
+            lastStatus = 1;
+            return;
+        }
+        redirected = true;
+    }
+
+    // A line with assignments only sets shell variables
+    if(inputCommand->args[0] == NULL) {
+        for(int i = 0; i < inputCommand->assignsNum; i++) {
+            char *equals = strchr(inputCommand->assigns[i], '=');
+            setVar(inputCommand->assigns[i], equals - inputCommand->assigns[i], equals + 1, false);
+        }
+    }
 
     // Execute command only there is one to execute
     if(inputCommand->args[0] != NULL && *inputCommand->args[0] != '\n') {
-        if(strncmp(inputCommand->args[0], "exit", 4) == 0) {
+        if(function != NULL) {
+            // Functions are found before builtins and before searching PATH
+            callFunction(function);
+        } else if(strncmp(inputCommand->args[0], "exit", 4) == 0) {
             // Execute built-in command "exit"
             exitShell();
         } else if(strncmp(inputCommand->args[0], "cd", 2) == 0) {
             // Execute built-in command "cd"
-            changeWD(inputCommand);
+            lastStatus = changeWD(inputCommand);
         } else if(strncmp(inputCommand->args[0], "status", 6) == 0) {
             // Execute built-in command "status"
-            if(WIFEXITED(childStatus)) {
+            if(childSkipped) {
+                printf("Exit status 0 (up to date, not run)\n");
+                fflush(stdout);
+            } else if(WIFEXITED(childStatus)) {
                 printExitStatus(childStatus);
             } else {
                 printSignalStatus(childStatus);
             }
+        } else if(strcmp(inputCommand->args[0], "true") == 0 || strcmp(inputCommand->args[0], ":") == 0) {
+            // Execute built-in commands "true" and ":"
+            lastStatus = 0;
+        } else if(strcmp(inputCommand->args[0], "false") == 0) {
+            // Execute built-in command "false"
+            lastStatus = 1;
+        } else if(strcmp(inputCommand->args[0], "read") == 0) {
+            // Execute built-in command "read"
+            readVars();
+        } else if(strcmp(inputCommand->args[0], "export") == 0) {
+            // Execute built-in command "export"
+            exportVars();
+        } else if(strcmp(inputCommand->args[0], "unset") == 0) {
+            // Execute built-in command "unset"
+            unsetVars();
+        } else if(inShell && strcmp(inputCommand->args[0], "cat") == 0) {
+            // Execute built-in command "cat"
+            catFiles();
+        } else if(inShell && strcmp(inputCommand->args[0], "tee") == 0) {
+            // Execute built-in command "tee"
+            teeFiles();
+        } else if(inShell && strcmp(inputCommand->args[0], "wc") == 0) {
+            // Execute built-in command "wc"
+            countFiles();
+        } else if(inShell && strcmp(inputCommand->args[0], "renice") == 0) {
+            // Execute built-in command "renice"
+            reniceJobs();
+        } else if(inShell) {
+            // Execute built-in command "sleep"
+            sleepFor();
+        } else if(strcmp(inputCommand->args[0], "wait") == 0) {
+            // Execute built-in command "wait"
+            waitJobs();
+        } else if(strcmp(inputCommand->args[0], "jobs") == 0) {
+            // Execute built-in command "jobs"
+            if(inputCommand->argsNum > 1 && strcmp(inputCommand->args[1], "-s") == 0) {
+                printLaunchStats();
+            } else {
+                listJobs();
+            }
+        } else if(strcmp(inputCommand->args[0], "pin") == 0) {
+            // Execute built-in command "pin"
+            pinCommand();
+        } else if(strcmp(inputCommand->args[0], "retry") == 0) {
+            // Execute built-in command "retry"
+            retryCommand();
+        } else if(strcmp(inputCommand->args[0], "dag") == 0) {
+            // Execute built-in command "dag"
+            runDag();
+        } else if(strcmp(inputCommand->args[0], "cached") == 0) {
+            // Execute built-in command "cached"
+            cachedCommand();
+        } else if(strcmp(inputCommand->args[0], "watch") == 0) {
+            // Execute built-in command "watch"
+            watchCommand();
+        } else if(strcmp(inputCommand->args[0], "every") == 0) {
+            // Execute built-in command "every"
+            everyCommand();
+        } else if(strcmp(inputCommand->args[0], "at") == 0) {
+            // Execute built-in command "at"
+            atCommand();
+        } else if(strcmp(inputCommand->args[0], "set") == 0) {
+            // Execute built-in command "set"
+            setOptions();
+        } else if(strcmp(inputCommand->args[0], "exec") == 0) {
+            // Execute built-in command "exec"
+            execCommand();
+        } else if(strcmp(inputCommand->args[0], "local") == 0) {
+            // Execute built-in command "local"
+            localVars();
+        } else if(strcmp(inputCommand->args[0], "return") == 0) {
+            // Execute built-in command "return"
+            returnFunction(previousStatus);
+        } else if(strcmp(inputCommand->args[0], "alias") == 0) {
+            // Execute built-in command "alias"
+            aliasNames();
+        } else if(strcmp(inputCommand->args[0], "unalias") == 0) {
+            // Execute built-in command "unalias"
+            unaliasNames();
         } else {
-            // Fork child process to run non-builtin command
-            childPID = fork();
-            switch(childPID) {
-                case -1:
-                    perror("fork() failed\n");
-                    fflush(stdout);
-                    break;
-                case 0:
-                    // Child to execute code below
-                    // If user doesn't redirect the standard input
-                    if(inputCommand->background) {
-                        if(inputCommand->inputFile != NULL) {
-                            inputCommand->inputFile = "/dev/null";
-                            createInputFD(inputCommand);
-                        }
-                        // If user doesn't redirect the standard output
-                        if(inputCommand->outputFile != NULL) {
-                            inputCommand->outputFile = "/dev/null";
-                            createOutputFD(inputCommand);
-                        }
-                    }
-
-                    // Set signal handlers
-                    if(inputCommand->background == false) {
-                        // Foreground process must terminate via the handler for SIGINT
-                        SIGINTAction.sa_handler = SIG_DFL;
-                        sigaction(SIGINT, &SIGINTAction, NULL);
-
-                        // Foreground process must ignore SIGTSTP
-                        SIGTSTPAction.sa_handler = SIG_IGN;
-                        sigaction(SIGTSTP, &SIGTSTPAction, NULL);
-                    } else if(inputCommand->background == true) {
-                        // Background process must ignore SIGINT
-                        SIGINTAction.sa_handler = SIG_IGN;
-                        sigaction(SIGINT, &SIGINTAction, NULL);
-
-                        // Background process must ignore SIGTSTP
-                        SIGTSTPAction.sa_handler = SIG_IGN;
-                        sigaction(SIGTSTP, &SIGTSTPAction, NULL);
-                    }
-
-                    // Process input file, if any
-                    if(inputCommand->inputFile != NULL) {
-                        createInputFD(inputCommand);
-                    }
-                    // Process output file, if any
-                    if(inputCommand->outputFile != NULL) {
-                        createOutputFD(inputCommand);
-                    }
+            // Rebuild the envp snapshot in the parent only if an export happened since the last spawn
+            char **envp = getEnvSnapshot();
 
-                    // Save child's PID
-                    childPID = getpid();
-
-                    // Look for command in PATH variable
-                    execvp(inputCommand->args[0], inputCommand->args);
-                    perror("execvp() failed, command could not be executed\n");
-                    fflush(stdout);
-
-                    // If command fails, print error message and set exit(1)
-                    exit(1);
-                default:
-                    // Save background child's process ID
-                    // Parent to execute code here
-                    // If foreground mode only is on, then all processes run in the foreground
-                    if(foregroundModeOnly == true) {
-                        // Run as a foreground process, i.e., wait for it to finish
-                        waitpid(childPID, &childStatus, 0);
-                        // If it's been killed by a signal, print the signal number
-                        if(WIFSIGNALED(childStatus)){
-                            printSignalStatus(childStatus);
-                        }
-                    } else {
-                        // If background mode with '&' is respected, then check for that property
-                        // If not a background process
-                        if(inputCommand->background == false) {
-                            // Run as a foreground process, i.e., wait for it to finish
-                            waitpid(childPID, &childStatus, 0);
-                            // If it's been killed by a signal, print the signal number
-                            if(WIFSIGNALED(childStatus)){
-                                printSignalStatus(childStatus);
-                            }
-                        } else {
-                            // Run as a background process
-                            // Save PID of background processes in array
-                            for(int i = 0; i < MAX_PROCESSES; i++) {
-                                if(backgroundPIDs[i] == 0) {
-                                    backgroundPIDs[i] = childPID;
-                                    break;
-                                }
-                            }
-
-                            // Must print out background child process ID
-                            printf("Background child PID %d is starting\n", childPID);
-                            fflush(stdout);
-                        }
-                    }
+            if(inputCommand->hasBraces) {
+                // Stream brace expansions into ARG_MAX-sized launches
+                runBraceChunks(envp);
+            } else {
+                runExternal(inputCommand->args, envp);
             }
         }
     }
+
+    if(redirected) {
+        restoreShell(inputCommand->redirs, inputCommand->redirsNum, saved);
+    }
+    if(builtinInterrupted) {
+        builtinInterrupted = false;
+        printSignalStatus(childStatus);
+    }
 }
 
 /*
- *  Print the shell prompt and parse user command.
+ *  Fork and exec one external command with the given argv and envp, then wait for it
+ *  or record it as a background process.
  */
-struct commandLine *printShell() {
-    char *line = NULL;
-    size_t len = 0;
-    char *saveptr;
-    char *token = NULL;
+void runExternal(char **argv, char **envp) {
+    // Under set incremental, a tool < src > dst whose dst is newer than src and tool is skipped
+    if(incremental && isUpToDate(argv)) {
+        // A process that would have been replaced ends as the command would have
+        if(execDirect) {
+            fflush(stdout);
+            exit(0);
+        }
+        if(!inputCommand->background || foregroundModeOnly) {
+            childStatus = 0;
+            childSkipped = true;
+        }
+        lastStatus = 0;
+        return;
+    }
 
-    // Set up command struct
-    struct commandLine *command = malloc(sizeof(struct commandLine));
-    command->inputFile = NULL;
-    command->outputFile = NULL;
-    command->background = false;
-    int tokenNum = 0;
+    // Background launches beyond set launchrate wait in the queue; ones using <(...) pipes or
+    // started by retry cannot wait, so they launch now and take a token in advance
+    bool mustLaunch = substFDsNum > substBase || retryRequest != NULL;
+    if(inputCommand->background && !foregroundModeOnly && !execDirect && !takeLaunchToken(mustLaunch)) {
+        deferLaunch(argv, NULL);
+        return;
+    }
 
-    // Clear any existing errors from previous run
-    clearerr(stdin);
-    // Print shell prompt
-    write(STDOUT_FILENO, ": ", 2);
-    fflush(stdout);
-    // Get command line
-    getline(&line, &len, stdin);
-
-    line[strlen(line)-1] = '\0';
-
-    // Get the first token if command is not empty
-    if(strlen(line) != 0) {
-        token = strtok_r(line, " ", &saveptr);
-    }
-
-    // Skip comment and empty line
-    if(token != NULL && *token != '#') {
-        // Save token to appropriate command value
-        while(token != NULL) {
-            switch(*token) {
-                // Process input file
-                case '<':
-                    // Skip "<" to next token
-                    token = strtok_r(NULL, " ", &saveptr);
-                    token = expandToken(token);
-                    // Save token
-                    command->inputFile = calloc(strlen(token) + 1, sizeof(char));
-                    strcpy(command->inputFile, token);
-                    break;
-                    // Process output file
-                case '>':
-                    // Skip ">" to next token
-                    token = strtok_r(NULL, " ", &saveptr);
-                    token = expandToken(token);
-                    // Save token
-                    command->outputFile = calloc(strlen(token) + 1, sizeof(char));
-                    strcpy(command->outputFile, token);
-                    break;
-                    // Process background indicator
-                case '&':
-                    // Set flag based on token value
-                    command->background = true;
-                    break;
-                default:
-                    token = expandToken(token);
-                    // Save token to command args array
-                    command->args[tokenNum] = calloc(strlen(token) + 1, sizeof(char));
-                    strcpy(command->args[tokenNum], token);
-                    tokenNum++;
+    // Give back read-ahead input before another process can see the offset
+    syncReadBuffers();
+
+    // Hold SIGCHLD until a background child is in the job table
+    sigset_t oldMask = blockChildSignal();
+
+    // Choose the child's CPUs while SIGCHLD holds the job table still
+    struct placement placement;
+    bool placed = choosePlacement(&placement, inputCommand->background && !foregroundModeOnly);
+    int syncPipe[2] = {-1, -1};
+    if(inputCommand->background && !foregroundModeOnly) {
+        openPrioritySync(syncPipe);
+    }
+
+    // Fork child process to run non-builtin command, unless this process is already that child
+    childPID = execDirect ? 0 : fork();
+    switch(childPID) {
+        case -1:
+            perror("fork() failed\n");
+            waitPrioritySync(syncPipe);
+            fflush(stdout);
+            break;
+        case 0:
+            // Child to execute code below
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+            // Background commands use /dev/null for whichever of stdin and stdout the user doesn't redirect
+            if(inputCommand->background && !foregroundModeOnly) {
+                struct redirection nullInput = {STDIN_FILENO, TOKEN_LESS, "/dev/null"};
+                struct redirection nullOutput = {STDOUT_FILENO, TOKEN_GREAT, "/dev/null"};
+                if(!redirectsFD(inputCommand, STDIN_FILENO) && createRedirectFD(&nullInput) == -1) {
+                    exit(1);
+                }
+                if(!redirectsFD(inputCommand, STDOUT_FILENO) && createRedirectFD(&nullOutput) == -1) {
+                    exit(1);
+                }
+            }
+
+            // Set signal handlers
+            if(inputCommand->background == false) {
+                // Foreground process must terminate via the handler for SIGINT
+                SIGINTAction.sa_handler = SIG_DFL;
+                sigaction(SIGINT, &SIGINTAction, NULL);
+
+                // Foreground process must ignore SIGTSTP
+                SIGTSTPAction.sa_handler = SIG_IGN;
+                sigaction(SIGTSTP, &SIGTSTPAction, NULL);
+            } else if(inputCommand->background == true) {
+                // Background process must ignore SIGINT
+                SIGINTAction.sa_handler = SIG_IGN;
+                sigaction(SIGINT, &SIGINTAction, NULL);
+
+                // Background process must ignore SIGTSTP
+                SIGTSTPAction.sa_handler = SIG_IGN;
+                sigaction(SIGTSTP, &SIGTSTPAction, NULL);
             }
-            if(token != NULL) {
-                if(token[0] != '&') {
-                    free(token);
+
+            // Apply redirections in the order they were written
+            for(int i = 0; i < inputCommand->redirsNum; i++) {
+                if(createRedirectFD(&inputCommand->redirs[i]) == -1) {
+                    fflush(stdout);
+                    exit(1);
                 }
             }
-            // Get next token
-            token = strtok_r(NULL, " ", &saveptr);
-        }
-        // Set last arg to NULL to signal end of args array
-        command->args[tokenNum] = NULL;
-        // Save number of actual arguments
-        command->argsNum = tokenNum;
-    } else {
-        // If command is # or blank
-        command->args[0] = NULL;
-    }
 
-    // Free memory
-    if(line != NULL) {
-        free(line);
+            // Move to the chosen CPUs and memory node; only a placement asked for with pin is fatal
+            if(placed && applyPlacement(&placement) == -1 && pinRequest != NULL) {
+                perror("pin");
+                exit(1);
+            }
+            if(inputCommand->background && !foregroundModeOnly) {
+                applyJobPriority(syncPipe);
+            }
+
+            // Save child's PID
+            childPID = getpid();
+
+            // Keep this command's <(...) and >(...) pipes open across exec
+            for(int i = substBase; i < substFDsNum; i++) {
+                fcntl(substFDs[i], F_SETFD, 0);
+            }
+
+            // Layer VAR=value overrides onto the child's copy of the snapshot
+            applyEnvOverrides(envp);
+            environ = envp;
+
+            // Look for command in PATH variable
+            execvp(argv[0], argv);
+            perror("execvp() failed, command could not be executed\n");
+            fflush(stdout);
+
+            // If command fails, print error message and set exit(1)
+            exit(1);
+        default:
+            // Save background child's process ID
+            // Parent to execute code here
+            // If foreground mode only is on, then all processes run in the foreground
+            if(foregroundModeOnly == true) {
+                // Run as a foreground process, i.e., wait for it to finish
+                waitpid(childPID, &childStatus, 0);
+                childSkipped = false;
+                lastStatus = statusCode(childStatus);
+                // If it's been killed by a signal, print the signal number
+                if(WIFSIGNALED(childStatus)){
+                    printSignalStatus(childStatus);
+                }
+            } else {
+                // If background mode with '&' is respected, then check for that property
+                // If not a background process
+                if(inputCommand->background == false) {
+                    // Run as a foreground process, i.e., wait for it to finish
+                    waitpid(childPID, &childStatus, 0);
+                    childSkipped = false;
+                    lastStatus = statusCode(childStatus);
+                    // If it's been killed by a signal, print the signal number
+                    if(WIFSIGNALED(childStatus)){
+                        printSignalStatus(childStatus);
+                    }
+                } else {
+                    // Run as a background process
+                    // Save PID of background processes in the job table
+                    waitPrioritySync(syncPipe);
+                    recordPlacement(addJobAttempt(childPID, argv), placed ? &placement : NULL);
+
+                    // Must print out background child process ID
+                    printf("Background child PID %d is starting\n", childPID);
+                    fflush(stdout);
+                }
+            }
     }
-    return command;
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
 }
 
 /*
- *  Expand token and replace variable '$$' with process ID
+ *  Print the shell prompt, read a command line and parse it.
+ *  Lines are read until the command is complete, e.g. until a { group is closed.
+ *  Returns NULL for blank lines, comments and syntax errors.
  */
-char *expandToken(char *inputToken) {
-    // Set output token size to be 4x len because pid_max is 7 digits
-    // So, theoretically $$ could expand to ########
-    char *outputToken = calloc(4 * strlen(inputToken), sizeof(char));
+struct astNode *printShell() {
+    struct captureBuffer line = {malloc(CAPTURE_CHUNK), 0, CAPTURE_CHUNK};
+    char *text = NULL;
+    size_t textLength = 0;
+    bool incomplete = false;
+    struct astNode *root = NULL;
 
-    // Build output token
-    int i = 0, j = 0;
-    while(inputToken[i] != '\0') {
-        if(inputToken[i] == '$' && inputToken[i+1] == '$') {
-            // Get process ID
-            int pid = getpid();
-            // Convert process ID to string
-            char pidString[8] = {'\0'};
-            sprintf(pidString, "%d", pid);
-            // Concatenate process ID string to output token
-            strcat(outputToken, pidString);
-            // Advance pointers
-            i += 2;
-            j += (int)strlen(pidString);
-        } else {
-            outputToken[j] = inputToken[i];
-            i++;
-            j++;
+    do {
+        // Print shell prompt, or the continuation prompt inside a construct
+        write(STDOUT_FILENO, incomplete ? "> " : ": ", 2);
+        fflush(stdout);
+        // Get command line through the stdin read-ahead buffer; end of input exits the shell
+        line.length = 0;
+        if(readLine(STDIN_FILENO, &line) == -1) {
+            exitShell();
+            break;
         }
-    }
 
-    // Free passed in input token
-    if(inputToken[i] != '\0') {
-        free(inputToken);
-    }
+        text = realloc(text, textLength + line.length + 2);
+        memcpy(text + textLength, line.data, line.length);
+        textLength += line.length;
+        text[textLength++] = '\n';
+        text[textLength] = '\0';
+        root = parseText(text, &incomplete);
+    } while(incomplete);
 
-    return outputToken;
+    // Free memory
+    free(line.data);
+    free(text);
+    return root;
 }
 
 /*
- *  Print exit status or terminating signal of last foreground process.
+ *  Return the next token and advance past it.
+ *  Words run until a blank or operator character, keeping $(...) and ${...} in one piece.
  */
-void printExitStatus(int status) {
-    // Print status if exited normally
-    if(WIFEXITED(status)) {
-        printf("Exit status %d\n", WEXITSTATUS(status));
-        fflush(stdout);
+struct lexToken nextToken(struct lexer *lex) {
+    struct lexToken token = {.type = TOKEN_END, .text = NULL};
+    const char *c = lex->cursor;
+
+    // Skip blanks, and comments that start a word
+    while(*c == ' ' || *c == '\t' || *c == '\r') {
+        c++;
+    }
+    if(*c == '#') {
+        while(*c != '\0' && *c != '\n') {
+            c++;
+        }
     }
-}
 
-/*
- *  Print terminating signal of last foreground process.
- */
-void printSignalStatus(int status) {
-    // Print status if terminated by signal
-    if(WIFSIGNALED(status)) {
-        printf("Terminated by signal %d\n", WTERMSIG(status));
-        fflush(stdout);
+    switch(*c) {
+        case '\0':
+            token.type = TOKEN_END;
+            break;
+        case '\n':
+            token.type = TOKEN_NEWLINE;
+            c++;
+            // Skip the bodies of here-documents started on this line
+            if(lex->heredocNext != NULL) {
+                c = lex->heredocNext;
+                lex->heredocNext = NULL;
+            }
+            break;
+        case ';':
+            token.type = TOKEN_SEMI;
+            c++;
+            break;
+        case '|':
+            token.type = c[1] == '|' ? TOKEN_OR : TOKEN_PIPE;
+            c += c[1] == '|' ? 2 : 1;
+            break;
+        case '<':
+        case '>':
+            // <(command) and >(command) are words; anything else is a redirection
+            if(c[1] != '(') {
+                c = lexRedirection(lex, c, -1, &token);
+                break;
+            }
+            // Fall through
+        case '&':
+            // '&' glued to following text, as in "&)", is part of a word
+            if(*c == '&' && (c[1] == '&' || c[1] == '\0' || strchr(" \t\r\n;|<>", c[1]) != NULL)) {
+                token.type = c[1] == '&' ? TOKEN_AND : TOKEN_AMP;
+                c += c[1] == '&' ? 2 : 1;
+                break;
+            }
+            // Fall through
+        default: {
+            // Digits right before '<' or '>' are the fd the redirection applies to
+            const char *digits = c;
+            while(*digits >= '0' && *digits <= '9') {
+                digits++;
+            }
+            if(digits > c && (*digits == '<' || *digits == '>')) {
+                c = lexRedirection(lex, digits, atoi(c), &token);
+                break;
+            }
+
+            const char *start = c;
+            int depth = 0;
+            while(*c != '\0' && (depth > 0 || c == start || strchr(" \t\r\n;&|<>", *c) == NULL
+                                  || ((*c == '<' || *c == '>') && c[1] == '('))) {
+                if((*c == '$' && (c[1] == '(' || c[1] == '{')) || ((*c == '<' || *c == '>') && c[1] == '(')) {
+                    depth++;
+                    c++;
+                } else if((*c == ')' || *c == '}') && depth > 0) {
+                    depth--;
+                }
+                c++;
+            }
+            token.type = TOKEN_WORD;
+            token.text = arenaStrndup(start, c - start);
+        }
     }
+
+    lex->cursor = c;
+    return token;
 }
 
 /*
- *  SIGTSTP handler for foreground mode
+ *  Lex the redirection operator at c: <, >, >>, <>, <&, >&, <<<, or << and <<- with the
+ *  here-document they start. fd is the number written before it, or -1 for the operator's default.
+ *  Returns the position after the operator.
  */
-void SIGTSTPHandler(int sig) {
-    if(foregroundModeOnly == false) {
-        char* foregroundModeMessage = "Entering foreground-only mode (& is now ignored)\n";
-        write(STDOUT_FILENO, foregroundModeMessage, 49);
-        fflush(stdout);
-        foregroundModeOnly = true;
+const char *lexRedirection(struct lexer *lex, const char *c, int fd, struct lexToken *token) {
+    bool input = *c == '<';
+    c++;
+    if(input && *c == '<' && c[1] == '<') {
+        token->type = TOKEN_HERESTRING;
+        c += 2;
+    } else if(input && *c == '<') {
+        c++;
+        bool stripTabs = *c == '-';
+        c = lexHeredoc(lex, stripTabs ? c + 1 : c, stripTabs, token);
+    } else if(*c == '&') {
+        token->type = TOKEN_DUP;
+        c++;
+    } else if(!input && *c == '>') {
+        token->type = TOKEN_DGREAT;
+        c++;
+    } else if(input && *c == '>') {
+        token->type = TOKEN_LESSGREAT;
+        c++;
     } else {
-        char* foregroundExitMessage = "Exiting foreground-only mode\n";
-        write(STDOUT_FILENO, foregroundExitMessage, 29);
-        fflush(stdout);
-        foregroundModeOnly = false;
+        token->type = input ? TOKEN_LESS : TOKEN_GREAT;
     }
+    token->fd = fd >= 0 ? fd : input ? STDIN_FILENO : STDOUT_FILENO;
+    return c;
 }
 
 /*
- *  SIGCHLD handler
+ *  Lex the delimiter of a here-document and find its body: the lines after the current one,
+ *  or after the previous here-document on it, up to a line holding only the delimiter.
+ *  With <<- leading tabs are removed; a quoted delimiter turns off expansion of the body.
+ *  The body is returned as the token's text, NULL if the delimiter line has not been read yet.
+ *  Returns the position after the delimiter.
  */
-void SIGCHLDHandler(int sig) {
-    pid_t collectedPID = waitpid(-1, &childStatus, WNOHANG);
+const char *lexHeredoc(struct lexer *lex, const char *c, bool stripTabs, struct lexToken *token) {
+    token->type = TOKEN_HEREDOC;
+    token->text = NULL;
+    while(*c == ' ' || *c == '\t') {
+        c++;
+    }
+    const char *delimiter = c;
+    while(*c != '\0' && strchr(" \t\r\n;&|<>", *c) == NULL) {
+        c++;
+    }
+    size_t delimiterLen = c - delimiter;
+    if(delimiterLen >= 2 && (*delimiter == '\'' || *delimiter == '"') && delimiter[delimiterLen - 1] == *delimiter) {
+        token->type = TOKEN_HEREDOC_QUOTED;
+        delimiter++;
+        delimiterLen -= 2;
+    }
+    if(delimiterLen == 0) {
+        syntaxError(lex, *token);
+        return c;
+    }
 
-    // Check to see if PID is of a background child process
-    for(int i = 0; i < MAX_PROCESSES; i++) {
-        if(backgroundPIDs[i] == collectedPID && collectedPID > 0) {
-            if(WIFEXITED(childStatus)){
-                printf("Background child PID %d is done with exit status %d\n", collectedPID, WEXITSTATUS(childStatus));
-                fflush(stdout);
-            } else if(WIFSIGNALED(childStatus)) {
-                printf("Background child PID %d is terminated by signal %d\n", collectedPID, WTERMSIG(childStatus));
-                fflush(stdout);
+    const char *body = lex->heredocNext;
+    if(body == NULL) {
+        body = strchr(c, '\n');
+        body = body != NULL ? body + 1 : c + strlen(c);
+    }
+
+    // Find the delimiter line
+    const char *line = body;
+    const char *lineEnd = NULL;
+    while(*line != '\0') {
+        const char *text = line;
+        while(stripTabs && *text == '\t') {
+            text++;
+        }
+        lineEnd = strchr(text, '\n');
+        if(lineEnd == NULL) {
+            lineEnd = text + strlen(text);
+        }
+        if((size_t)(lineEnd - text) == delimiterLen && strncmp(text, delimiter, delimiterLen) == 0) {
+            break;
+        }
+        line = *lineEnd != '\0' ? lineEnd + 1 : lineEnd;
+    }
+    if(*line == '\0') {
+        lex->incomplete = true;
+        return c;
+    }
+
+    // Copy the lines before it, less their leading tabs for <<-
+    char *text = arenaAlloc(line - body + 1);
+    size_t length = 0;
+    bool lineStart = true;
+    for(const char *b = body; b < line; b++) {
+        if(!(stripTabs && lineStart && *b == '\t')) {
+            text[length++] = *b;
+            lineStart = *b == '\n';
+        }
+    }
+    text[length] = '\0';
+    token->text = text;
+    lex->heredocNext = *lineEnd != '\0' ? lineEnd + 1 : lineEnd;
+    return c;
+}
+
+/*
+ *  Return the next token without advancing past it.
+ */
+struct lexToken peekToken(struct lexer *lex) {
+    struct lexer copy = *lex;
+    return nextToken(&copy);
+}
+
+/*
+ *  Parse text into a syntax tree in the arena.
+ *  Sets incomplete if the text ends inside a construct; returns NULL if there is nothing to run.
+ */
+struct astNode *parseText(const char *text, bool *incomplete) {
+    struct lexer lex = {.cursor = text, .incomplete = false, .failed = false, .heredocNext = NULL};
+    struct astNode *root = parseList(&lex, false);
+    *incomplete = lex.incomplete && !lex.failed;
+    if(lex.failed || lex.incomplete) {
+        return NULL;
+    }
+    if(peekToken(&lex).type != TOKEN_END) {
+        fprintf(stderr, "smallsh: syntax error: unexpected '%s'\n", peekToken(&lex).text);
+        lastStatus = 2;
+        return NULL;
+    }
+    return root;
+}
+
+/*
+ *  Report a syntax error at the current token, unless the text just ended too early.
+ */
+void syntaxError(struct lexer *lex, struct lexToken token) {
+    if(token.type == TOKEN_END) {
+        lex->incomplete = true;
+    } else if(!lex->failed) {
+        fprintf(stderr, "smallsh: syntax error near unexpected token\n");
+        lastStatus = 2;
+        lex->failed = true;
+    }
+}
+
+/*
+ *  Allocate a node with a copy of the given children.
+ */
+struct astNode *newNode(int type, struct astNode **children, int childrenNum) {
+    struct astNode *node = arenaAlloc(sizeof(struct astNode));
+    memset(node, 0, sizeof(struct astNode));
+    node->type = type;
+    node->childrenNum = childrenNum;
+    if(childrenNum > 0) {
+        node->children = arenaAlloc(childrenNum * sizeof(struct astNode *));
+        memcpy(node->children, children, childrenNum * sizeof(struct astNode *));
+    }
+    return node;
+}
+
+/*
+ *  Check whether a token is a word that closes a list: '}', do or done.
+ */
+bool isListEnd(struct lexToken token) {
+    return token.type == TOKEN_WORD
+           && (strcmp(token.text, "}") == 0 || strcmp(token.text, "do") == 0 || strcmp(token.text, "done") == 0);
+}
+
+/*
+ *  Parse and-or chains separated by ';', '&' or newlines.
+ *  Stops at the end of the text, or at a word that closes a list.
+ */
+struct astNode *parseList(struct lexer *lex, bool inGroup) {
+    int capacity = 8;
+    int itemsNum = 0;
+    struct astNode **items = malloc(capacity * sizeof(struct astNode *));
+
+    while(!lex->failed && !lex->incomplete) {
+        struct lexToken token = peekToken(lex);
+        // Skip empty items
+        if(token.type == TOKEN_NEWLINE || token.type == TOKEN_SEMI) {
+            nextToken(lex);
+            continue;
+        }
+        if(token.type == TOKEN_END || isListEnd(token)) {
+            break;
+        }
+
+        struct astNode *item = parseAndOr(lex);
+        if(item == NULL) {
+            break;
+        }
+        if(peekToken(lex).type == TOKEN_AMP) {
+            nextToken(lex);
+            item->background = true;
+        }
+        if(itemsNum == capacity) {
+            capacity *= 2;
+            items = realloc(items, capacity * sizeof(struct astNode *));
+        }
+        items[itemsNum++] = item;
+    }
+
+    if(inGroup && peekToken(lex).type == TOKEN_END) {
+        lex->incomplete = true;
+    }
+    struct astNode *list = NULL;
+    if(itemsNum == 1 && !lex->failed) {
+        list = items[0];
+    } else if(itemsNum > 1 && !lex->failed) {
+        list = newNode(AST_LIST, items, itemsNum);
+    }
+    free(items);
+    return list;
+}
+
+/*
+ *  Parse pipelines joined by && and ||.
+ */
+struct astNode *parseAndOr(struct lexer *lex) {
+    struct astNode *items[MAX_ARGS];
+    int ops[MAX_ARGS];
+    int itemsNum = 0;
+
+    items[itemsNum] = parsePipeline(lex);
+    if(items[itemsNum] == NULL) {
+        return NULL;
+    }
+    itemsNum++;
+    struct lexToken token = peekToken(lex);
+    while((token.type == TOKEN_AND || token.type == TOKEN_OR) && itemsNum < MAX_ARGS) {
+        nextToken(lex);
+        // The next pipeline may start on a following line
+        while(peekToken(lex).type == TOKEN_NEWLINE) {
+            nextToken(lex);
+        }
+        ops[itemsNum] = token.type;
+        items[itemsNum] = parsePipeline(lex);
+        if(items[itemsNum] == NULL) {
+            return NULL;
+        }
+        itemsNum++;
+        token = peekToken(lex);
+    }
+
+    if(itemsNum == 1) {
+        return items[0];
+    }
+    struct astNode *node = newNode(AST_ANDOR, items, itemsNum);
+    node->ops = arenaAlloc(itemsNum * sizeof(int));
+    memcpy(node->ops, ops, itemsNum * sizeof(int));
+    return node;
+}
+
+/*
+ *  Parse commands joined by '|'.
+ */
+struct astNode *parsePipeline(struct lexer *lex) {
+    struct astNode *items[MAX_ARGS];
+    int itemsNum = 0;
+
+    items[itemsNum] = parseCommand(lex);
+    if(items[itemsNum] == NULL) {
+        return NULL;
+    }
+    itemsNum++;
+    while(peekToken(lex).type == TOKEN_PIPE && itemsNum < MAX_ARGS) {
+        nextToken(lex);
+        while(peekToken(lex).type == TOKEN_NEWLINE) {
+            nextToken(lex);
+        }
+        items[itemsNum] = parseCommand(lex);
+        if(items[itemsNum] == NULL) {
+            return NULL;
+        }
+        itemsNum++;
+    }
+
+    return itemsNum == 1 ? items[0] : newNode(AST_PIPELINE, items, itemsNum);
+}
+
+/*
+ *  Parse a { } group or a simple command, with its redirections.
+ */
+struct astNode *parseCommand(struct lexer *lex) {
+    expandAlias(lex);
+    struct lexToken token = peekToken(lex);
+    struct astNode *node;
+
+    // Function definition: "name() body" or "name () body"
+    if(token.type == TOKEN_WORD) {
+        struct lexer after = *lex;
+        nextToken(&after);
+        size_t length = strlen(token.text);
+        char *name = NULL;
+        if(length > 2 && strcmp(token.text + length - 2, "()") == 0) {
+            name = arenaStrndup(token.text, length - 2);
+        } else if(peekToken(&after).type == TOKEN_WORD && strcmp(peekToken(&after).text, "()") == 0) {
+            nextToken(&after);
+            name = token.text;
+        }
+        if(name != NULL && isName(name)) {
+            *lex = after;
+            // The body may start on a following line
+            while(peekToken(lex).type == TOKEN_NEWLINE) {
+                nextToken(lex);
             }
-            backgroundPIDs[i] = 0;
+            token = peekToken(lex);
+            if(token.type != TOKEN_WORD || strcmp(token.text, "{") != 0) {
+                syntaxError(lex, token);
+                return NULL;
+            }
+            struct astNode *body = parseCommand(lex);
+            if(body == NULL) {
+                return NULL;
+            }
+            node = newNode(AST_FUNCTION, &body, 1);
+            node->words = arenaAlloc(2 * sizeof(char *));
+            node->words[0] = name;
+            node->words[1] = NULL;
+            node->wordsNum = 1;
+            return node;
         }
     }
 
-    // Remove value from background PIDs array
-    for(int i = 0; i < MAX_PROCESSES; i++) {
-        if(backgroundPIDs[i] == collectedPID) {
-            backgroundPIDs[i] = 0;
+    if(token.type == TOKEN_WORD && strcmp(token.text, "{") == 0) {
+        // Group: the body runs in this shell, redirections apply to the whole group
+        nextToken(lex);
+        struct astNode *body = parseList(lex, true);
+        if(lex->failed || lex->incomplete) {
+            return NULL;
+        }
+        token = nextToken(lex);
+        if(token.type != TOKEN_WORD || strcmp(token.text, "}") != 0 || body == NULL) {
+            syntaxError(lex, token);
+            return NULL;
+        }
+        node = newNode(AST_GROUP, &body, 1);
+    } else if(token.type == TOKEN_WORD
+              && (strcmp(token.text, "for") == 0 || strcmp(token.text, "while") == 0 || strcmp(token.text, "until") == 0)) {
+        node = parseLoop(lex);
+        if(node == NULL) {
+            return NULL;
+        }
+    } else {
+        node = newNode(AST_SIMPLE, NULL, 0);
+    }
+
+    // Collect words and redirections
+    int capacity = 8;
+    char **words = malloc(capacity * sizeof(char *));
+    struct redirection redirs[MAX_REDIRS];
+    while(true) {
+        token = peekToken(lex);
+        // Redirection operators followed by a target word are numbered TOKEN_LESS to TOKEN_HERESTRING
+        if(token.type >= TOKEN_LESS && token.type <= TOKEN_HERESTRING) {
+            nextToken(lex);
+            struct lexToken target = nextToken(lex);
+            if(target.type != TOKEN_WORD || node->redirsNum == MAX_REDIRS) {
+                syntaxError(lex, target);
+                free(words);
+                return NULL;
+            }
+            redirs[node->redirsNum].fd = token.fd;
+            redirs[node->redirsNum].op = token.type;
+            redirs[node->redirsNum].word = target.text;
+            node->redirsNum++;
+        } else if(token.type == TOKEN_HEREDOC || token.type == TOKEN_HEREDOC_QUOTED) {
+            // The lexer has already collected the body, unless it is not all there yet
+            token = nextToken(lex);
+            if(token.text != NULL && node->redirsNum == MAX_REDIRS) {
+                syntaxError(lex, token);
+            }
+            if(token.text == NULL || node->redirsNum == MAX_REDIRS) {
+                free(words);
+                return NULL;
+            }
+            redirs[node->redirsNum].fd = token.fd;
+            redirs[node->redirsNum].op = token.type;
+            redirs[node->redirsNum].word = token.text;
+            node->redirsNum++;
+        } else if(token.type == TOKEN_WORD && node->type == AST_SIMPLE) {
+            nextToken(lex);
+            if(node->wordsNum + 1 >= capacity) {
+                capacity *= 2;
+                words = realloc(words, capacity * sizeof(char *));
+            }
+            words[node->wordsNum++] = token.text;
+        } else if(token.type == TOKEN_AMP && node->type == AST_SIMPLE && node->wordsNum > 0) {
+            // As in the original assignment, '&' only means background at the end of a
+            // command, which includes one closing a list; followed by more words it is ordinary text
+            struct lexer after = *lex;
+            nextToken(&after);
+            if(peekToken(&after).type != TOKEN_WORD || isListEnd(peekToken(&after))) {
+                break;
+            }
+            nextToken(lex);
+            if(node->wordsNum + 1 >= capacity) {
+                capacity *= 2;
+                words = realloc(words, capacity * sizeof(char *));
+            }
+            words[node->wordsNum++] = "&";
+        } else {
             break;
         }
     }
+
+    if(node->redirsNum > 0) {
+        node->redirs = arenaAlloc(node->redirsNum * sizeof(struct redirection));
+        memcpy(node->redirs, redirs, node->redirsNum * sizeof(struct redirection));
+    }
+    if(node->type == AST_SIMPLE) {
+        if(node->wordsNum == 0 && node->redirsNum == 0) {
+            syntaxError(lex, token);
+            free(words);
+            return NULL;
+        }
+        node->words = arenaAlloc((node->wordsNum + 1) * sizeof(char *));
+        memcpy(node->words, words, node->wordsNum * sizeof(char *));
+        node->words[node->wordsNum] = NULL;
+        // Words with nothing to expand are used as they are each time the command runs
+        node->literal = arenaAlloc(node->wordsNum + 1);
+        for(int i = 0; i < node->wordsNum; i++) {
+            node->literal[i] = strpbrk(words[i], "$*?[{<>") == NULL;
+        }
+    }
+    free(words);
+    return node;
 }
 
 /*
- *  Free memory allocated to the commandLine struct.
+ *  Consume the given reserved word, skipping separators before it.
+ *  Returns false, after reporting the error, if something else comes next.
  */
-void freeCommandLine() {
-    int i = 0;
-    // Free each pointer in the args array
-    while(inputCommand->args[i] != NULL) {
-        free(inputCommand->args[i]);
-        i++;
+bool expectWord(struct lexer *lex, const char *word) {
+    struct lexToken token = nextToken(lex);
+    while(token.type == TOKEN_SEMI || token.type == TOKEN_NEWLINE) {
+        token = nextToken(lex);
     }
+    if(token.type != TOKEN_WORD || strcmp(token.text, word) != 0) {
+        syntaxError(lex, token);
+        return false;
+    }
+    return true;
+}
 
-    // Free pointer to the args array itself
-    free(inputCommand->args);
+/*
+ *  Parse "for NAME [in words]; do list; done" or "while|until list; do list; done".
+ */
+struct astNode *parseLoop(struct lexer *lex) {
+    struct lexToken keyword = nextToken(lex);
+    struct astNode *node;
+
+    if(strcmp(keyword.text, "for") == 0) {
+        // The variable is kept as words[0], followed by the unexpanded word list
+        struct lexToken name = nextToken(lex);
+        if(name.type != TOKEN_WORD || !isName(name.text)) {
+            syntaxError(lex, name);
+            return NULL;
+        }
+        int capacity = 8;
+        int wordsNum = 1;
+        char **words = malloc(capacity * sizeof(char *));
+        words[0] = name.text;
+        struct lexToken token = peekToken(lex);
+        if(token.type != TOKEN_WORD || strcmp(token.text, "in") != 0) {
+            // Without "in" the loop runs over the positional parameters
+            words[wordsNum++] = "$@";
+        } else {
+            nextToken(lex);
+            while((token = peekToken(lex)).type == TOKEN_WORD) {
+                nextToken(lex);
+                if(wordsNum + 1 >= capacity) {
+                    capacity *= 2;
+                    words = realloc(words, capacity * sizeof(char *));
+                }
+                words[wordsNum++] = token.text;
+            }
+        }
+        node = newNode(AST_FOR, NULL, 0);
+        node->wordsNum = wordsNum;
+        node->words = arenaAlloc((wordsNum + 1) * sizeof(char *));
+        memcpy(node->words, words, wordsNum * sizeof(char *));
+        node->words[wordsNum] = NULL;
+        free(words);
+    } else {
+        // Condition list, ended by do
+        struct astNode *condition = parseList(lex, true);
+        if(lex->failed || lex->incomplete) {
+            return NULL;
+        }
+        if(condition == NULL) {
+            syntaxError(lex, peekToken(lex));
+            return NULL;
+        }
+        node = newNode(AST_WHILE, &condition, 1);
+        node->until = strcmp(keyword.text, "until") == 0;
+    }
 
-    // Free input and output file pointers
-    if (inputCommand->inputFile != NULL) {
-        free(inputCommand->inputFile);
-    } else if (inputCommand->outputFile != NULL) {
-        free(inputCommand->outputFile);
+    if(!expectWord(lex, "do")) {
+        return NULL;
     }
+    struct astNode *body = parseList(lex, true);
+    if(lex->failed || lex->incomplete) {
+        return NULL;
+    }
+    if(body == NULL || !expectWord(lex, "done")) {
+        syntaxError(lex, peekToken(lex));
+        return NULL;
+    }
+
+    // The body is the last child
+    struct astNode *children[2] = {node->childrenNum > 0 ? node->children[0] : body, body};
+    int childrenNum = node->type == AST_WHILE ? 2 : 1;
+    node->children = arenaAlloc(childrenNum * sizeof(struct astNode *));
+    memcpy(node->children, children, childrenNum * sizeof(struct astNode *));
+    node->childrenNum = childrenNum;
+    return node;
 }
 
 /*
- *  Change the working directory of smallsh.
+ *  Append one expanded word to the args, replacing a pattern by the file names it matches.
+ *  Matches too many for the args take one slot as a brace sequence; a word with no room left
+ *  sets tooLong. Returns the new number of args.
  */
-int changeWD() {
-    char *homeDir = NULL;
-    char *pwd = NULL;
-    // If command only
-    if(inputCommand->argsNum == 1) {
-        homeDir = getenv("HOME");
-        chdir(homeDir);
-    } else { // If there is an argument
-        chdir(inputCommand->args[1]);
+int addArg(struct commandLine *command, int tokenNum, char *word) {
+    // Replace a pattern by the sorted file names it matches, if any
+    if(hasGlobChars(word)) {
+        char **matches = NULL;
+        int matchesNum = expandGlob(word, &matches);
+        // Matches that do not all fit are launched in ARG_MAX-sized chunks, like brace words
+        if(tokenNum > 0 && tokenNum < MAX_ARGS - 1 && tokenNum + matchesNum > MAX_ARGS - 1) {
+            command->braces[tokenNum] = matchesBraceSeq(matches, matchesNum);
+            command->args[tokenNum] = calloc(strlen(word) + 1, sizeof(char));
+            strcpy(command->args[tokenNum], word);
+            command->hasBraces = true;
+            return tokenNum + 1;
+        }
+        command->tooLong = command->tooLong || tokenNum + matchesNum > MAX_ARGS - 1;
+        for(int i = 0; i < matchesNum && tokenNum < MAX_ARGS - 1; i++) {
+            command->args[tokenNum] = calloc(strlen(matches[i]) + 1, sizeof(char));
+            strcpy(command->args[tokenNum], matches[i]);
+            tokenNum++;
+        }
+        if(matchesNum > 0) {
+            return tokenNum;
+        }
     }
-    return 0;
+    if(tokenNum >= MAX_ARGS - 1) {
+        command->tooLong = true;
+        return tokenNum;
+    }
+    // Save token to command args array
+    command->args[tokenNum] = calloc(strlen(word) + 1, sizeof(char));
+    strcpy(command->args[tokenNum], word);
+    return tokenNum + 1;
 }
 
 /*
- *  Check command for input file and open a file descriptor
- *  Source: adapted from example code in Module 5 - Exploration: Processes and I/O
+ *  Expand the words of a simple command node into a commandLine struct, ready to run.
+ */
+struct commandLine *expandCommand(struct astNode *node) {
+    char *token = NULL;
+
+    // Set up command struct
+    struct commandLine *command = malloc(sizeof(struct commandLine));
+    command->background = node->background;
+    command->assignsNum = 0;
+    command->hasBraces = false;
+    command->tooLong = false;
+    memset(command->braces, 0, sizeof(command->braces));
+    int tokenNum = 0;
+
+    // Expand redirection targets
+    command->redirsNum = expandRedirections(node, command->redirs);
+
+    // Save each word to the appropriate command value
+    for(int i = 0; i < node->wordsNum; i++) {
+        token = node->words[i];
+        // Brace words are kept raw and expanded one word at a time at launch
+        if(tokenNum > 0 && tokenNum < MAX_ARGS - 1 && strchr(token, '{') != NULL) {
+            command->braces[tokenNum] = compileBraces(token, strlen(token));
+            if(command->braces[tokenNum] != NULL) {
+                command->args[tokenNum] = calloc(strlen(token) + 1, sizeof(char));
+                strcpy(command->args[tokenNum], token);
+                command->hasBraces = true;
+                tokenNum++;
+                continue;
+            }
+        }
+        // Leading VAR=value words are assignments, not arguments, and are not split
+        if(tokenNum == 0 && command->assignsNum < MAX_ASSIGNS && isAssignment(token)) {
+            command->assigns[command->assignsNum] = expandToken(token, NULL);
+            command->assignsNum++;
+            continue;
+        }
+        // Literal words skip expansion entirely
+        if(node->literal != NULL && node->literal[i]) {
+            tokenNum = addArg(command, tokenNum, token);
+            continue;
+        }
+        struct fieldList fields = {NULL, 0, 0};
+        token = expandToken(token, &fields);
+        // Output of $(...) and $@ was split into fields; each field becomes an arg
+        size_t length = strlen(token);
+        for(int k = 0; k <= fields.breaksNum; k++) {
+            size_t start = k > 0 ? fields.breaks[k - 1] : 0;
+            size_t end = k < fields.breaksNum ? fields.breaks[k] : length;
+            if(end > start) {
+                tokenNum = addArg(command, tokenNum, fields.breaksNum > 0 ? arenaStrndup(token + start, end - start) : token);
+            }
+        }
+        free(fields.breaks);
+        free(token);
+    }
+    // Set last arg to NULL to signal end of args array
+    command->args[tokenNum] = NULL;
+    // Save number of actual arguments
+    command->argsNum = tokenNum;
+
+    return command;
+}
+
+/*
+ *  Run a syntax tree node and return its exit code.
  */
-void createInputFD() {
-    // Process input file, if any
-    int sourceFile = open(inputCommand->inputFile, O_RDONLY);
-    if(sourceFile == -1) {
-        perror("Cannot open input file\n");
-        exit(1);
+int executeNode(struct astNode *node) {
+    // Anything but a simple command runs in the background as a child copy of the shell
+    if(node->background && node->type != AST_SIMPLE && !foregroundModeOnly) {
+        runBackgroundNode(node);
+        return lastStatus;
+    }
+
+    // Pipes of <(...) and >(...) opened while expanding this node are closed when it is done
+    int substMark = substFDsNum;
+    int callerSubstBase = substBase;
+    substBase = substMark;
+
+    switch(node->type) {
+        case AST_SIMPLE: {
+            // The last command of a script replaces the shell unless a background job needs it
+            if(node == tailNode && !hasBackgroundJobs()) {
+                fflush(stdout);
+                execDirect = true;
+            }
+            // Scratch memory used by the expansion is released once the command is done
+            struct arenaMark mark = getArenaMark();
+            inputCommand = expandCommand(node);
+            executeCommandLine();
+            freeCommandLine();
+            releaseArena(mark);
+            break;
+        }
+        case AST_LIST:
+            // Run each item in turn, stopping if one of them exits the shell or returns
+            for(int i = 0; i < node->childrenNum && keepRunning(); i++) {
+                executeNode(node->children[i]);
+            }
+            break;
+        case AST_ANDOR:
+            // Each later pipeline runs only if the status so far allows it
+            executeNode(node->children[0]);
+            for(int i = 1; i < node->childrenNum && keepRunning(); i++) {
+                if((node->ops[i] == TOKEN_AND) == (lastStatus == 0)) {
+                    executeNode(node->children[i]);
+                }
+            }
+            break;
+        case AST_PIPELINE:
+            lastStatus = runPipeline(node);
+            break;
+        case AST_GROUP:
+        case AST_FOR:
+        case AST_WHILE:
+            // Compound commands apply their redirections once around the whole body
+            if(node->redirsNum > 0) {
+                lastStatus = runGroup(node);
+            } else {
+                lastStatus = executeCompound(node);
+            }
+            break;
+        case AST_FUNCTION:
+            defineFunction(node->words[0], node->children[0]);
+            lastStatus = 0;
+            break;
     }
 
-    // Redirect from sourceFile to stdin
-    int result = dup2(sourceFile, 0);
-    if(result == -1) {
-        perror("Cannot redirect from source file");
-        exit(2);
+    closeSubstitutions(substMark);
+    substBase = callerSubstBase;
+    return lastStatus;
+}
+
+/*
+ *  Run the body of a group or loop.
+ */
+int executeCompound(struct astNode *node) {
+    switch(node->type) {
+        case AST_FOR:
+            return runFor(node);
+        case AST_WHILE:
+            return runWhile(node);
+        default:
+            return executeNode(node->children[0]);
     }
 }
 
 /*
- *  Check command for output file and open a file descriptor
- *  Source: adapted from example code in Module 5 - Exploration: Processes and I/O
+ *  Run a for loop. The word list is expanded once, with brace ranges generated lazily;
+ *  each iteration only sets the variable and runs the already parsed body.
  */
-void createOutputFD() {
-    // Process output file, if any
-    int targetFile = open(inputCommand->outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if(targetFile == -1) {
-        perror("Cannot open output file\n");
-        fflush(stdout);
-        exit(1);
+int runFor(struct astNode *node) {
+    // words[0] is the variable, so the list expands like the args of a command
+    struct commandLine *list = expandCommand(node);
+    const char *name = node->words[0];
+    size_t nameLen = strlen(name);
+    int status = 0;
+    if(list->tooLong) {
+        fprintf(stderr, "smallsh: for: %s\n", strerror(E2BIG));
+        status = 1;
     }
 
-    // Redirect from stdout to targetFile
-    int result = dup2(targetFile, 1);
-    if(result == -1) {
-        perror("Cannot redirect to output file\n");
-        fflush(stdout);
-        exit(2);
+    for(int i = 1; i < list->argsNum && keepRunning() && !list->tooLong; i++) {
+        struct braceSeq *seq = list->braces[i];
+        bool more = true;
+        if(seq != NULL) {
+            resetBraceSeq(seq);
+        }
+        while(more && keepRunning()) {
+            if(seq != NULL) {
+                size_t length = renderBraceSeq(seq, NULL);
+                char *word = malloc(length + 1);
+                renderBraceSeq(seq, word);
+                word[length] = '\0';
+                if(seq->expanded) {
+                    setVar(name, nameLen, word, false);
+                    status = executeNode(node->children[0]);
+                } else {
+                    status = runForWord(node, word, status);
+                }
+                free(word);
+                more = advanceBraceSeq(seq);
+            } else {
+                setVar(name, nameLen, list->args[i], false);
+                status = executeNode(node->children[0]);
+                more = false;
+            }
+        }
     }
+
+    struct commandLine *savedCommand = inputCommand;
+    inputCommand = list;
+    freeCommandLine();
+    inputCommand = savedCommand;
+    lastStatus = status;
+    return status;
 }
 
+/*
+ *  Expand one word made by a brace expression in a for list like any other word, and run
+ *  the body once for each field and file name it gives. Returns the status of the last run.
+ */
+int runForWord(struct astNode *node, char *word, int status) {
+    const char *name = node->words[0];
+    size_t nameLen = strlen(name);
+    // Glob matches are only needed for this word
+    struct arenaMark mark = getArenaMark();
+    struct fieldList fields = {NULL, 0, 0};
+    char *token = expandToken(word, &fields);
+    size_t length = strlen(token);
+    for(int k = 0; k <= fields.breaksNum && keepRunning(); k++) {
+        size_t start = k > 0 ? fields.breaks[k - 1] : 0;
+        size_t end = k < fields.breaksNum ? fields.breaks[k] : length;
+        if(end > start) {
+            char *field = fields.breaksNum > 0 ? arenaStrndup(token + start, end - start) : token;
+            char **matches = NULL;
+            int matchesNum = hasGlobChars(field) ? expandGlob(field, &matches) : 0;
+            for(int i = 0; i < matchesNum && keepRunning(); i++) {
+                setVar(name, nameLen, matches[i], false);
+                status = executeNode(node->children[0]);
+            }
+            if(matchesNum == 0) {
+                setVar(name, nameLen, field, false);
+                status = executeNode(node->children[0]);
+            }
+        }
+    }
+    free(fields.breaks);
+    free(token);
+    releaseArena(mark);
+    return status;
+}
 
 /*
- *  Exit shell after killing any other processes or jobs.
+ *  Run a while or until loop.
  */
-void exitShell() {
-    // Free command struct
-//    freeCommandLine();
-    // Set shell loop to stop running
-    runShell = 0;
-    // Terminate all background processes
-    for(int i = 0; i < MAX_PROCESSES; i++) {
-        if(backgroundPIDs[i] > 0) {
-            kill(backgroundPIDs[i], SIGTERM);
+int runWhile(struct astNode *node) {
+    int status = 0;
+    while(keepRunning()) {
+        int condition = executeNode(node->children[0]);
+        if((condition == 0) == node->until || !keepRunning()) {
+            break;
         }
+        status = executeNode(node->children[1]);
     }
-}
\ No newline at end of file
+    lastStatus = status;
+    return status;
+}
+
+/*
+ *  Run every command of a pipeline in its own child, connected by pipes.
+ *  Returns the exit code of the last command.
+ */
+int runPipeline(struct astNode *node) {
+    pid_t *pids = calloc(node->childrenNum, sizeof(pid_t));
+    int previousRead = -1;
+    syncReadBuffers();
+
+    // Hold SIGCHLD while the pipeline's children are started
+    sigset_t oldMask = blockChildSignal();
+
+    for(int i = 0; i < node->childrenNum; i++) {
+        int pipeFDs[2] = {-1, -1};
+        if(i < node->childrenNum - 1 && pipe(pipeFDs) == -1) {
+            perror("pipe() failed\n");
+            break;
+        }
+        pids[i] = fork();
+        if(pids[i] == -1) {
+            perror("fork() failed\n");
+            fflush(stdout);
+            break;
+        } else if(pids[i] == 0) {
+            // Child reads from the previous pipe and writes to the next one
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+            if(previousRead != -1) {
+                dup2(previousRead, STDIN_FILENO);
+                close(previousRead);
+            }
+            if(pipeFDs[1] != -1) {
+                dup2(pipeFDs[1], STDOUT_FILENO);
+                close(pipeFDs[0]);
+                close(pipeFDs[1]);
+            }
+            // A simple command is exec'd in this child rather than forked again
+            struct astNode *item = node->children[i];
+            item->background = false;
+            execDirect = item->type == AST_SIMPLE;
+            executeNode(item);
+            fflush(stdout);
+            exit(lastStatus);
+        }
+        if(previousRead != -1) {
+            close(previousRead);
+        }
+        if(pipeFDs[1] != -1) {
+            close(pipeFDs[1]);
+        }
+        previousRead = pipeFDs[0];
+    }
+    if(previousRead != -1) {
+        close(previousRead);
+    }
+
+    // Wait for every command; the pipeline's status is the last one's
+    int status = 0;
+    for(int i = 0; i < node->childrenNum; i++) {
+        if(pids[i] > 0) {
+            waitpid(pids[i], &childStatus, 0);
+            childSkipped = false;
+            status = statusCode(childStatus);
+        }
+    }
+    if(WIFSIGNALED(childStatus)) {
+        printSignalStatus(childStatus);
+    }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    free(pids);
+    return status;
+}
+
+/*
+ *  Run a { } group or loop, applying its redirections once around the whole body.
+ */
+int runGroup(struct astNode *node) {
+    struct redirection redirs[MAX_REDIRS] = {{0}};
+    int redirsNum = expandRedirections(node, redirs);
+    int saved[MAX_REDIRS];
+    int status = 1;
+
+    if(redirectShell(redirs, redirsNum, saved) == 0) {
+        status = executeCompound(node);
+        restoreShell(redirs, redirsNum, saved);
+    }
+    freeRedirections(redirs, redirsNum);
+    return status;
+}
+
+/*
+ *  Expand the redirection targets of a node into redirs and return how many there are.
+ *  The text of each here-document or here-string is put in an in-memory file here, in the
+ *  shell, and the command only dups it.
+ */
+int expandRedirections(const struct astNode *node, struct redirection *redirs) {
+    for(int i = 0; i < node->redirsNum; i++) {
+        redirs[i] = node->redirs[i];
+        int op = node->redirs[i].op;
+        if(op != TOKEN_HEREDOC && op != TOKEN_HEREDOC_QUOTED && op != TOKEN_HERESTRING) {
+            redirs[i].word = expandToken(node->redirs[i].word, NULL);
+            continue;
+        }
+
+        // A body with nothing to expand is written straight from the syntax tree
+        const char *text = node->redirs[i].word;
+        char *expanded = NULL;
+        if(op == TOKEN_HERESTRING || (op == TOKEN_HEREDOC && strchr(text, '$') != NULL)) {
+            expanded = expandToken(node->redirs[i].word, NULL);
+            text = expanded;
+        }
+        size_t length = strlen(text);
+        if(op == TOKEN_HERESTRING) {
+            // A here-string ends with a newline
+            expanded = realloc(expanded, length + 2);
+            expanded[length++] = '\n';
+            expanded[length] = '\0';
+            text = expanded;
+        }
+        int memoryFile = createMemoryFile(text, length);
+        free(expanded);
+        redirs[i].op = TOKEN_HEREDOC;
+        redirs[i].word = malloc(16);
+        sprintf(redirs[i].word, "%d", memoryFile);
+    }
+    return node->redirsNum;
+}
+
+/*
+ *  Free expanded redirections, closing the in-memory files of here-documents.
+ */
+void freeRedirections(struct redirection *redirs, int redirsNum) {
+    for(int i = 0; i < redirsNum; i++) {
+        if(redirs[i].op == TOKEN_HEREDOC && atoi(redirs[i].word) != -1) {
+            close(atoi(redirs[i].word));
+        }
+        free(redirs[i].word);
+    }
+}
+
+/*
+ *  Put text in a sealed in-memory file, rewound to its start, and return its fd or -1.
+ *  Nothing is written to disk and no process has to feed the text through a pipe.
+ */
+int createMemoryFile(const char *data, size_t length) {
+    int memoryFile = memfd_create("smallsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(memoryFile == -1) {
+        perror("memfd_create() failed\n");
+        return -1;
+    }
+    size_t written = 0;
+    while(written < length) {
+        ssize_t result = write(memoryFile, data + written, length - written);
+        if(result == -1 && errno != EINTR) {
+            perror("Cannot write here-document\n");
+            close(memoryFile);
+            return -1;
+        }
+        written += result > 0 ? result : 0;
+    }
+    // Nobody can change the text once it is sealed
+    fcntl(memoryFile, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(memoryFile, 0, SEEK_SET);
+    return memoryFile;
+}
+
+/*
+ *  Check whether a command name is run by the shell itself.
+ */
+bool isBuiltin(const char *name) {
+    static const char *builtins[] = {"true", ":", "false", "read", "export", "unset", "local", "return",
+                                     "alias", "unalias", "jobs", "wait", "set", "dag", "watch", NULL};
+    if(strncmp(name, "exit", 4) == 0 || strncmp(name, "cd", 2) == 0 || strncmp(name, "status", 6) == 0) {
+        return true;
+    }
+    for(int i = 0; builtins[i] != NULL; i++) {
+        if(strcmp(name, builtins[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ *  Apply redirections to the shell itself, saving a copy of each fd they replace in saved.
+ *  Returns -1, with nothing changed, if one of them fails.
+ */
+int redirectShell(const struct redirection *redirs, int redirsNum, int saved[MAX_REDIRS]) {
+    for(int i = 0; i < redirsNum; i++) {
+        int fd = redirs[i].fd;
+        // Give read-ahead input back, and write out buffered output, before the fd changes
+        if(fd < MAX_READ_FDS) {
+            syncReadBuffer(fd);
+        }
+        if(fd == STDOUT_FILENO) {
+            fflush(stdout);
+        }
+        // -1 if the fd was not open, so it is closed again afterwards
+        saved[i] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        if(createRedirectFD(&redirs[i]) == -1) {
+            restoreShell(redirs, i + 1, saved);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Put back the fds saved by redirectShell(), undoing the redirections in reverse order.
+ */
+void restoreShell(const struct redirection *redirs, int redirsNum, int saved[MAX_REDIRS]) {
+    for(int i = redirsNum - 1; i >= 0; i--) {
+        int fd = redirs[i].fd;
+        if(fd < MAX_READ_FDS) {
+            syncReadBuffer(fd);
+        }
+        if(fd == STDOUT_FILENO) {
+            fflush(stdout);
+        }
+        if(saved[i] != -1) {
+            dup2(saved[i], fd);
+            close(saved[i]);
+        } else {
+            close(fd);
+        }
+    }
+}
+
+/*
+ *  Run a pipeline, group or and-or chain in the background, in a child copy of the shell.
+ */
+void runBackgroundNode(struct astNode *node) {
+    if(!takeLaunchToken(false)) {
+        deferLaunch(NULL, node);
+        lastStatus = 0;
+        return;
+    }
+    fflush(stdout);
+    syncReadBuffers();
+    sigset_t oldMask = blockChildSignal();
+    struct placement placement;
+    bool placed = choosePlacement(&placement, true);
+    int syncPipe[2];
+    openPrioritySync(syncPipe);
+    pid_t backgroundPID = fork();
+    switch(backgroundPID) {
+        case -1:
+            perror("fork() failed\n");
+            waitPrioritySync(syncPipe);
+            fflush(stdout);
+            break;
+        case 0:
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+            // Background commands must ignore SIGINT
+            SIGINTAction.sa_handler = SIG_IGN;
+            sigaction(SIGINT, &SIGINTAction, NULL);
+            // Everything the job starts stays on its CPUs and at its priority
+            if(placed) {
+                applyPlacement(&placement);
+            }
+            applyJobPriority(syncPipe);
+            node->background = false;
+            executeNode(node);
+            fflush(stdout);
+            exit(lastStatus);
+        default:
+            waitPrioritySync(syncPipe);
+            recordPlacement(addJob(backgroundPID, describeNode(node), false), placed ? &placement : NULL);
+            printf("Background child PID %d is starting\n", backgroundPID);
+            fflush(stdout);
+            lastStatus = 0;
+    }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+}
+
+/*
+ *  Convert a wait status into a shell exit code, 128 + signal for killed processes.
+ */
+int statusCode(int status) {
+    if(WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 1;
+}
+
+/*
+ *  Expand token and replace variable '$$' with process ID, $NAME or ${NAME} with its value,
+ *  and $(command) with the command's output.
+ *  If fields is not NULL, whitespace in command output and the gaps between positional
+ *  parameters from $@ are recorded there as field breaks, so the caller can split the result
+ *  into separate args.
+ */
+char *expandToken(char *inputToken, struct fieldList *fields) {
+    bool split = fields != NULL;
+    // Output grows as variables are substituted
+    size_t size = strlen(inputToken) + 1;
+    char *outputToken = calloc(size, sizeof(char));
+
+    // Build output token
+    size_t i = 0, j = 0;
+    while(inputToken[i] != '\0') {
+        char pidString[16] = {'\0'};
+        const char *value = NULL;
+        char *joined = NULL;
+        size_t skip = 1;
+
+        if(inputToken[i] == '$' && inputToken[i+1] == '(') {
+            // Find the matching ')' and capture the command's output
+            size_t close = i + 2;
+            int depth = 1;
+            while(inputToken[close] != '\0') {
+                if(inputToken[close] == '(') {
+                    depth++;
+                } else if(inputToken[close] == ')' && --depth == 0) {
+                    break;
+                }
+                close++;
+            }
+            size_t outputLength = 0;
+            char *output = captureCommand(inputToken + i + 2, close - i - 2, &outputLength);
+
+            // Strip trailing newlines and split into fields in a single pass over the output
+            size = size + outputLength + 1;
+            outputToken = realloc(outputToken, size);
+            size_t keep = j;
+            bool pendingSeparator = false;
+            bool pendingBlank = false;
+            for(size_t k = 0; k < outputLength; k++) {
+                char c = output[k];
+                if(split && (c == ' ' || c == '\t' || c == '\n')) {
+                    // A run of whitespace becomes one separator once more output follows it
+                    pendingSeparator = true;
+                    pendingBlank = pendingBlank || c != '\n';
+                    continue;
+                }
+                if(pendingSeparator) {
+                    addFieldBreak(fields, j);
+                    pendingSeparator = false;
+                    pendingBlank = false;
+                }
+                outputToken[j++] = c;
+                if(c != '\n') {
+                    keep = j;
+                }
+            }
+            if(!split) {
+                j = keep;
+            } else if(pendingBlank) {
+                // Trailing newlines are dropped, but trailing blanks still end the field
+                addFieldBreak(fields, j);
+            }
+            free(output);
+            i = inputToken[close] != '\0' ? close + 1 : close;
+            continue;
+        } else if((inputToken[i] == '<' || inputToken[i] == '>') && inputToken[i+1] == '(') {
+            // Process substitution becomes the /dev/fd path of a pipe to or from the command
+            size_t close = i + 2;
+            int depth = 1;
+            while(inputToken[close] != '\0') {
+                if(inputToken[close] == '(') {
+                    depth++;
+                } else if(inputToken[close] == ')' && --depth == 0) {
+                    break;
+                }
+                close++;
+            }
+            int substFD = substituteCommand(inputToken + i + 2, close - i - 2, inputToken[i] == '>');
+            joined = malloc(32);
+            if(substFD != -1) {
+                sprintf(joined, "/dev/fd/%d", substFD);
+            } else {
+                strcpy(joined, "/dev/null");
+            }
+            value = joined;
+            skip = (inputToken[close] != '\0' ? close + 1 : close) - i;
+        } else if(inputToken[i] == '$' && inputToken[i+1] == '$') {
+            // Convert process ID to string
+            sprintf(pidString, "%d", getpid());
+            value = pidString;
+            skip = 2;
+        } else if(inputToken[i] == '$' && inputToken[i+1] == '?') {
+            // Exit code of the last command
+            sprintf(pidString, "%d", lastStatus);
+            value = pidString;
+            skip = 2;
+        } else if(inputToken[i] == '$' && inputToken[i+1] == '#') {
+            // Number of positional parameters
+            sprintf(pidString, "%d", currentFrame != NULL ? currentFrame->argsNum - 1 : 0);
+            value = pidString;
+            skip = 2;
+        } else if(inputToken[i] == '$' && (inputToken[i+1] == '@' || inputToken[i+1] == '*')) {
+            // All positional parameters, as separate fields when splitting
+            size_t joinedLen = 0;
+            for(int k = 1; currentFrame != NULL && k < currentFrame->argsNum; k++) {
+                joinedLen += strlen(currentFrame->args[k]) + 1;
+            }
+            size = size + joinedLen;
+            outputToken = realloc(outputToken, size);
+            for(int k = 1; currentFrame != NULL && k < currentFrame->argsNum; k++) {
+                if(k > 1 && split) {
+                    addFieldBreak(fields, j);
+                } else if(k > 1) {
+                    outputToken[j++] = ' ';
+                }
+                size_t argLen = strlen(currentFrame->args[k]);
+                memcpy(outputToken + j, currentFrame->args[k], argLen);
+                j += argLen;
+            }
+            i += 2;
+            continue;
+        } else if(inputToken[i] == '$' && inputToken[i+1] >= '0' && inputToken[i+1] <= '9') {
+            // Single-digit positional parameter
+            value = getArg(inputToken[i+1] - '0');
+            skip = 2;
+        } else if(inputToken[i] == '$' && inputToken[i+1] == '{' && strchr(inputToken + i, '}') != NULL) {
+            // Braced variable name, or positional parameter number
+            size_t nameLen = strchr(inputToken + i, '}') - (inputToken + i + 2);
+            if(inputToken[i+2] >= '0' && inputToken[i+2] <= '9') {
+                value = getArg(atoi(inputToken + i + 2));
+            } else {
+                struct shellVar *var = lookupVar(inputToken + i + 2, nameLen);
+                value = var != NULL ? var->value : "";
+            }
+            skip = nameLen + 3;
+        } else if(inputToken[i] == '$' && (inputToken[i+1] == '_' || (inputToken[i+1] >= 'A' && inputToken[i+1] <= 'Z') || (inputToken[i+1] >= 'a' && inputToken[i+1] <= 'z'))) {
+            // Bare variable name runs while characters are valid in a name
+            size_t nameLen = 1;
+            while(inputToken[i+1+nameLen] == '_' || (inputToken[i+1+nameLen] >= 'A' && inputToken[i+1+nameLen] <= 'Z')
+                  || (inputToken[i+1+nameLen] >= 'a' && inputToken[i+1+nameLen] <= 'z')
+                  || (inputToken[i+1+nameLen] >= '0' && inputToken[i+1+nameLen] <= '9')) {
+                nameLen++;
+            }
+            struct shellVar *var = lookupVar(inputToken + i + 1, nameLen);
+            value = var != NULL ? var->value : "";
+            skip = nameLen + 1;
+        }
+
+        if(value != NULL) {
+            // Concatenate value to output token
+            size_t valueLen = strlen(value);
+            size = size + valueLen;
+            outputToken = realloc(outputToken, size);
+            memcpy(outputToken + j, value, valueLen);
+            j += valueLen;
+            i += skip;
+            free(joined);
+        } else {
+            outputToken[j] = inputToken[i];
+            i++;
+            j++;
+        }
+    }
+    outputToken[j] = '\0';
+
+    return outputToken;
+}
+
+/*
+ *  Record that a new field begins at offset in the expanded text.
+ */
+void addFieldBreak(struct fieldList *fields, size_t offset) {
+    if(fields->breaksNum == fields->capacity) {
+        fields->capacity = fields->capacity > 0 ? fields->capacity * 2 : 8;
+        fields->breaks = realloc(fields->breaks, fields->capacity * sizeof(size_t));
+    }
+    fields->breaks[fields->breaksNum++] = offset;
+}
+
+/*
+ *  Print exit status or terminating signal of last foreground process.
+ */
+void printExitStatus(int status) {
+    // Print status if exited normally
+    if(WIFEXITED(status)) {
+        printf("Exit status %d\n", WEXITSTATUS(status));
+        fflush(stdout);
+    }
+}
+
+/*
+ *  Print terminating signal of last foreground process.
+ */
+void printSignalStatus(int status) {
+    // Print status if terminated by signal
+    if(WIFSIGNALED(status)) {
+        printf("Terminated by signal %d\n", WTERMSIG(status));
+        fflush(stdout);
+    }
+}
+
+/*
+ *  SIGTSTP handler for foreground mode
+ */
+void SIGTSTPHandler(int sig) {
+    if(foregroundModeOnly == false) {
+        char* foregroundModeMessage = "Entering foreground-only mode (& is now ignored)\n";
+        write(STDOUT_FILENO, foregroundModeMessage, 49);
+        fflush(stdout);
+        foregroundModeOnly = true;
+    } else {
+        char* foregroundExitMessage = "Exiting foreground-only mode\n";
+        write(STDOUT_FILENO, foregroundExitMessage, 29);
+        fflush(stdout);
+        foregroundModeOnly = false;
+    }
+}
+
+/*
+ *  SIGCHLD handler
+ */
+void SIGCHLDHandler(int sig) {
+    // Collect only jobs, so a foreground child is left for its own waitpid(); one signal
+    // may stand for several children
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        struct job *job = &jobTable[i];
+        int status;
+        if(job->pid == 0 || job->virtual || job->done || waitpid(job->pid, &status, WNOHANG) != job->pid) {
+            continue;
+        }
+        if(job->retry != NULL && scheduleRetry(job, status)) {
+            continue;
+        }
+        job->status = status;
+        job->done = true;
+        if(job->substitution) {
+            continue;
+        }
+        // childStatus is left to the foreground command, whose wait may be under way
+        if(WIFEXITED(status)){
+            printf("Background child PID %d is done with exit status %d\n", job->pid, WEXITSTATUS(status));
+            fflush(stdout);
+        } else if(WIFSIGNALED(status)) {
+            printf("Background child PID %d is terminated by signal %d\n", job->pid, WTERMSIG(status));
+            fflush(stdout);
+        }
+    }
+}
+
+/*
+ *  Free memory allocated to the commandLine struct.
+ */
+void freeCommandLine() {
+    int i = 0;
+    // Free each pointer in the args array
+    while(inputCommand->args[i] != NULL) {
+        free(inputCommand->args[i]);
+        i++;
+    }
+
+    // Free each leading assignment
+    for(i = 0; i < inputCommand->assignsNum; i++) {
+        free(inputCommand->assigns[i]);
+    }
+
+    // Free redirection targets
+    freeRedirections(inputCommand->redirs, inputCommand->redirsNum);
+
+    // Free pointer to the args array itself
+    free(inputCommand->args);
+}
+
+/*
+ *  Change the working directory of smallsh.
+ */
+int changeWD() {
+    char *homeDir = NULL;
+    char *pwd = NULL;
+    // If command only
+    if(inputCommand->argsNum == 1) {
+        homeDir = getVar("HOME");
+        if(homeDir == NULL || chdir(homeDir) == -1) {
+            return 1;
+        }
+    } else { // If there is an argument
+        if(chdir(inputCommand->args[1]) == -1) {
+            perror("cd");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Open the target of a redirection and put it on the redirected fd, or duplicate or close an fd.
+ *  Files are opened with O_CLOEXEC so only the fd they are moved to stays open across exec.
+ *  Returns -1 after printing an error if the file cannot be opened.
+ *  Source: adapted from example code in Module 5 - Exploration: Processes and I/O
+ */
+int createRedirectFD(const struct redirection *redir) {
+    int targetFile;
+    if(redir->op == TOKEN_HEREDOC) {
+        // The text was put in an in-memory file when the redirection was expanded
+        targetFile = atoi(redir->word);
+        if(targetFile == -1 || dup2(targetFile, redir->fd) == -1) {
+            perror("Cannot redirect from here-document\n");
+            return -1;
+        }
+        return 0;
+    }
+    if(redir->op == TOKEN_DUP) {
+        // N>&- closes N; N>&M makes N a copy of M
+        if(strcmp(redir->word, "-") == 0) {
+            close(redir->fd);
+            return 0;
+        }
+        char *end;
+        targetFile = (int)strtol(redir->word, &end, 10);
+        if(*redir->word == '\0' || *end != '\0' || fcntl(targetFile, F_GETFD) == -1) {
+            fprintf(stderr, "smallsh: %s: bad file descriptor\n", redir->word);
+            return -1;
+        }
+        if(targetFile != redir->fd && dup2(targetFile, redir->fd) == -1) {
+            perror("Cannot duplicate file descriptor\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    int flags = O_RDONLY;
+    if(redir->op == TOKEN_GREAT) {
+        // Later chunks of one brace-expanded command append to what the first one wrote
+        flags = O_WRONLY | O_CREAT | (appendOutput ? O_APPEND : O_TRUNC);
+    } else if(redir->op == TOKEN_DGREAT) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else if(redir->op == TOKEN_LESSGREAT) {
+        flags = O_RDWR | O_CREAT;
+    }
+    targetFile = open(redir->word, flags | O_CLOEXEC, 0644);
+    if(targetFile == -1) {
+        perror(redir->op == TOKEN_LESS ? "Cannot open input file\n" : "Cannot open output file\n");
+        fflush(stdout);
+        return -1;
+    }
+
+    // Move the file to the redirected fd, where it stays open across exec
+    if(targetFile != redir->fd) {
+        int result = dup2(targetFile, redir->fd);
+        close(targetFile);
+        if(result == -1) {
+            perror("Cannot redirect file descriptor\n");
+            return -1;
+        }
+    } else {
+        fcntl(targetFile, F_SETFD, 0);
+    }
+    return 0;
+}
+
+/*
+ *  Check whether a command redirects the given fd.
+ */
+bool redirectsFD(const struct commandLine *command, int fd) {
+    for(int i = 0; i < command->redirsNum; i++) {
+        if(command->redirs[i].fd == fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ *  Exit shell after killing any other processes or jobs.
+ */
+void exitShell() {
+    // Free command struct
+//    freeCommandLine();
+    // Set shell loop to stop running
+    runShell = 0;
+    // Launches still queued never start
+    clearLaunchQueue();
+    // Terminate all background processes
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        if(jobTable[i].pid > 0 && !jobTable[i].virtual && !jobTable[i].done) {
+            kill(jobTable[i].pid, SIGTERM);
+        }
+    }
+}
+/*
+ *  Import the inherited environment as exported shell variables.
+ */
+void initVariables() {
+    for(int i = 0; environ[i] != NULL; i++) {
+        char *equals = strchr(environ[i], '=');
+        if(equals != NULL) {
+            setVar(environ[i], equals - environ[i], equals + 1, true);
+        }
+    }
+}
+
+/*
+ *  Hash a variable name of the given length.
+ */
+unsigned int hashName(const char *name, size_t nameLen) {
+    unsigned int hash = 5381;
+    for(size_t i = 0; i < nameLen; i++) {
+        hash = hash * 33 + (unsigned char)name[i];
+    }
+    return hash % VAR_TABLE_SIZE;
+}
+
+/*
+ *  Find a variable by name, which need not be NUL-terminated.
+ */
+struct shellVar *lookupVar(const char *name, size_t nameLen) {
+    struct shellVar *var = varTable[hashName(name, nameLen)];
+    while(var != NULL) {
+        if(strlen(var->name) == nameLen && strncmp(var->name, name, nameLen) == 0) {
+            return var;
+        }
+        var = var->next;
+    }
+    return NULL;
+}
+
+/*
+ *  Return the value of a variable, or NULL if it is not set.
+ */
+char *getVar(const char *name) {
+    struct shellVar *var = lookupVar(name, strlen(name));
+    return var != NULL ? var->value : NULL;
+}
+
+/*
+ *  Set a variable, creating it if needed.
+ *  An existing variable keeps its exported flag unless exported is true.
+ */
+void setVar(const char *name, size_t nameLen, const char *value, bool exported) {
+    struct shellVar *var = lookupVar(name, nameLen);
+    if(var == NULL) {
+        unsigned int bucket = hashName(name, nameLen);
+        var = calloc(1, sizeof(struct shellVar));
+        var->name = calloc(nameLen + 1, sizeof(char));
+        strncpy(var->name, name, nameLen);
+        var->envIndex = -1;
+        var->next = varTable[bucket];
+        varTable[bucket] = var;
+    }
+
+    // Build the new "NAME=value" entry
+    size_t valueLen = strlen(value);
+    char *entry = calloc(nameLen + valueLen + 2, sizeof(char));
+    memcpy(entry, name, nameLen);
+    entry[nameLen] = '=';
+    memcpy(entry + nameLen + 1, value, valueLen);
+
+    // The snapshot may still point at the old entry, freed below; bumping the version for an
+    // exported variable makes getEnvSnapshot rebuild it before anything reads it again
+    if(var->exported || exported) {
+        if(!var->exported) {
+            exportedNum++;
+        }
+        var->exported = true;
+        envVersion++;
+    }
+    free(var->entry);
+    var->entry = entry;
+    var->value = entry + nameLen + 1;
+}
+
+/*
+ *  Remove a variable.
+ */
+void unsetVar(const char *name) {
+    unsigned int bucket = hashName(name, strlen(name));
+    struct shellVar **link = &varTable[bucket];
+    while(*link != NULL) {
+        struct shellVar *var = *link;
+        if(strcmp(var->name, name) == 0) {
+            if(var->exported) {
+                exportedNum--;
+                envVersion++;
+            }
+            *link = var->next;
+            free(var->name);
+            free(var->entry);
+            free(var);
+            return;
+        }
+        link = &var->next;
+    }
+}
+
+/*
+ *  Check whether a word is a valid variable name.
+ */
+bool isName(const char *word) {
+    size_t length = strlen(word);
+    char *assignment = malloc(length + 2);
+    memcpy(assignment, word, length);
+    strcpy(assignment + length, "=");
+    bool valid = isAssignment(assignment) && strchr(word, '=') == NULL;
+    free(assignment);
+    return valid;
+}
+
+/*
+ *  Check whether a token has the form NAME=value.
+ */
+bool isAssignment(const char *token) {
+    if(!(*token == '_' || (*token >= 'A' && *token <= 'Z') || (*token >= 'a' && *token <= 'z'))) {
+        return false;
+    }
+    const char *c = token + 1;
+    while(*c == '_' || (*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9')) {
+        c++;
+    }
+    return *c == '=';
+}
+
+/*
+ *  Return the envp array for spawned commands.
+ *  The array is rebuilt only when the exported environment changed since the last call,
+ *  and it has MAX_ASSIGNS spare slots for applyEnvOverrides() to use in the child.
+ */
+char **getEnvSnapshot() {
+    if(snapshotVersion == envVersion) {
+        return envSnapshot;
+    }
+
+    free(envSnapshot);
+    envSnapshot = calloc(exportedNum + MAX_ASSIGNS + 1, sizeof(char *));
+    envSnapshotNum = 0;
+    for(int i = 0; i < VAR_TABLE_SIZE; i++) {
+        for(struct shellVar *var = varTable[i]; var != NULL; var = var->next) {
+            if(var->exported) {
+                var->envIndex = envSnapshotNum;
+                envSnapshot[envSnapshotNum++] = var->entry;
+            } else {
+                var->envIndex = -1;
+            }
+        }
+    }
+    snapshotVersion = envVersion;
+    return envSnapshot;
+}
+
+/*
+ *  Apply the command's VAR=value overrides to envp.
+ *  Only called in the child, so the parent's snapshot is untouched.
+ */
+void applyEnvOverrides(char **envp) {
+    int envNum = envSnapshotNum;
+    for(int i = 0; i < inputCommand->assignsNum; i++) {
+        char *equals = strchr(inputCommand->assigns[i], '=');
+        size_t nameLen = equals - inputCommand->assigns[i] + 1;
+        struct shellVar *var = lookupVar(inputCommand->assigns[i], nameLen - 1);
+        if(var != NULL && var->envIndex >= 0) {
+            // Replace the inherited entry in place
+            envp[var->envIndex] = inputCommand->assigns[i];
+            continue;
+        }
+        // A name already appended by an earlier override keeps its slot
+        int slot = envSnapshotNum;
+        while(slot < envNum && strncmp(envp[slot], inputCommand->assigns[i], nameLen) != 0) {
+            slot++;
+        }
+        // Otherwise append into one of the spare slots
+        envp[slot] = inputCommand->assigns[i];
+        if(slot == envNum) {
+            envNum++;
+        }
+    }
+    envp[envNum] = NULL;
+}
+
+/*
+ *  Export variables given as NAME or NAME=value.
+ */
+void exportVars() {
+    // With no arguments, list the exported variables
+    if(inputCommand->argsNum == 1) {
+        for(int i = 0; i < VAR_TABLE_SIZE; i++) {
+            for(struct shellVar *var = varTable[i]; var != NULL; var = var->next) {
+                if(var->exported) {
+                    printf("export %s\n", var->entry);
+                }
+            }
+        }
+        fflush(stdout);
+        return;
+    }
+
+    for(int i = 1; i < inputCommand->argsNum; i++) {
+        char *equals = strchr(inputCommand->args[i], '=');
+        if(equals != NULL) {
+            setVar(inputCommand->args[i], equals - inputCommand->args[i], equals + 1, true);
+        } else {
+            struct shellVar *var = lookupVar(inputCommand->args[i], strlen(inputCommand->args[i]));
+            setVar(inputCommand->args[i], strlen(inputCommand->args[i]), var != NULL ? var->value : "", true);
+        }
+    }
+}
+
+/*
+ *  Unset each variable named in the arguments, or each function with -f.
+ */
+void unsetVars() {
+    // unset -f removes functions instead
+    bool functions = inputCommand->argsNum > 1 && strcmp(inputCommand->args[1], "-f") == 0;
+    for(int i = functions ? 2 : 1; i < inputCommand->argsNum; i++) {
+        if(functions) {
+            undefineFunction(inputCommand->args[i]);
+        } else {
+            unsetVar(inputCommand->args[i]);
+        }
+    }
+}
+
+/*
+ *  Allocate memory that lives until resetArena() is called after the command line.
+ */
+void *arenaAlloc(size_t size) {
+    // Keep every allocation pointer-aligned
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if(lineArena == NULL || lineArena->size - lineArena->used < size) {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        struct arenaBlock *block = malloc(sizeof(struct arenaBlock) + blockSize);
+        block->next = lineArena;
+        block->used = 0;
+        block->size = blockSize;
+        lineArena = block;
+    }
+    void *memory = lineArena->data + lineArena->used;
+    lineArena->used += size;
+    return memory;
+}
+
+/*
+ *  Copy length bytes of a string into the arena and NUL-terminate it.
+ */
+char *arenaStrndup(const char *string, size_t length) {
+    char *copy = arenaAlloc(length + 1);
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+/*
+ *  Release everything allocated for the last command line.
+ *  The newest block is kept so the next line usually does not call malloc.
+ */
+void resetArena() {
+    if(lineArena != NULL) {
+        struct arenaBlock *block = lineArena->next;
+        while(block != NULL) {
+            struct arenaBlock *next = block->next;
+            free(block);
+            block = next;
+        }
+        lineArena->next = NULL;
+        lineArena->used = 0;
+    }
+    dirCache = NULL;
+}
+
+/*
+ *  Return the current arena position.
+ */
+struct arenaMark getArenaMark() {
+    struct arenaMark mark = {lineArena, lineArena != NULL ? lineArena->used : 0, dirCache};
+    return mark;
+}
+
+/*
+ *  Release everything allocated since the mark was taken.
+ */
+void releaseArena(struct arenaMark mark) {
+    while(lineArena != mark.block) {
+        struct arenaBlock *next = lineArena->next;
+        free(lineArena);
+        lineArena = next;
+    }
+    if(lineArena != NULL) {
+        lineArena->used = mark.used;
+    }
+    dirCache = mark.dirCache;
+}
+
+/*
+ *  Check whether a token contains a pattern character.
+ */
+bool hasGlobChars(const char *token) {
+    return strpbrk(token, "*?[") != NULL;
+}
+
+/*
+ *  Compile a pattern component of the given length.
+ *  Returns false if the pattern has more tokens than fit in the state set.
+ */
+bool compileGlob(const char *pattern, size_t length, struct globPattern *compiled) {
+    memset(compiled, 0, sizeof(struct globPattern));
+    compiled->matchesDot = length > 0 && pattern[0] == '.';
+
+    int state = 0;
+    size_t i = 0;
+    while(i < length) {
+        if(state >= MAX_GLOB_TOKENS) {
+            return false;
+        }
+        uint64_t bit = (uint64_t)1 << state;
+        if(pattern[i] == '*') {
+            // Collapse runs of '*' into one looping state
+            while(i < length && pattern[i] == '*') {
+                i++;
+            }
+            compiled->star |= bit;
+            state++;
+            continue;
+        } else if(pattern[i] == '?') {
+            for(int c = 1; c < 256; c++) {
+                compiled->accept[c] |= bit;
+            }
+        } else if(pattern[i] == '[') {
+            // Find the closing bracket; a ']' right after '[' or '[!' is literal
+            size_t j = i + 1;
+            bool negate = j < length && (pattern[j] == '!' || pattern[j] == '^');
+            if(negate) {
+                j++;
+            }
+            size_t classStart = j;
+            if(j < length && pattern[j] == ']') {
+                j++;
+            }
+            while(j < length && pattern[j] != ']') {
+                j++;
+            }
+            if(j >= length) {
+                // Unterminated class matches a literal '['
+                compiled->accept['['] |= bit;
+            } else {
+                bool members[256] = {false};
+                for(size_t k = classStart; k < j; k++) {
+                    if(k + 2 < j && pattern[k+1] == '-') {
+                        for(int c = (unsigned char)pattern[k]; c <= (unsigned char)pattern[k+2]; c++) {
+                            members[c] = true;
+                        }
+                        k += 2;
+                    } else {
+                        members[(unsigned char)pattern[k]] = true;
+                    }
+                }
+                for(int c = 1; c < 256; c++) {
+                    if(members[c] != negate) {
+                        compiled->accept[c] |= bit;
+                    }
+                }
+                i = j;
+            }
+        } else {
+            compiled->accept[(unsigned char)pattern[i]] |= bit;
+        }
+        i++;
+        state++;
+    }
+    compiled->final = (uint64_t)1 << state;
+    return true;
+}
+
+/*
+ *  Run a name through a compiled pattern, one byte at a time with no backtracking.
+ */
+bool matchGlob(const struct globPattern *compiled, const char *name) {
+    // Hidden names only match patterns that start with a literal '.'
+    if(name[0] == '.' && !compiled->matchesDot) {
+        return false;
+    }
+
+    // A '*' state can be left without consuming anything
+    uint64_t states = 1;
+    states |= (states & compiled->star) << 1;
+    for(const unsigned char *c = (const unsigned char *)name; *c != '\0' && states != 0; c++) {
+        states = ((states & compiled->accept[*c]) << 1) | (states & compiled->star);
+        states |= (states & compiled->star) << 1;
+    }
+    return (states & compiled->final) != 0;
+}
+
+/*
+ *  Return the entries of a directory, reading it with getdents64 the first time it is
+ *  used on this command line.
+ */
+struct dirCacheEntry *readDirectory(const char *path) {
+    for(struct dirCacheEntry *entry = dirCache; entry != NULL; entry = entry->next) {
+        if(strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+
+    struct dirCacheEntry *entry = arenaAlloc(sizeof(struct dirCacheEntry));
+    entry->path = arenaStrndup(path, strlen(path));
+    entry->names = NULL;
+    entry->types = NULL;
+    entry->namesNum = 0;
+    entry->next = dirCache;
+    dirCache = entry;
+
+    int dirFD = open(*path == '\0' ? "." : path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirFD == -1) {
+        return entry;
+    }
+
+    // Collect names in a growable array, then move it into the arena
+    int capacity = 64;
+    char **names = malloc(capacity * sizeof(char *));
+    unsigned char *types = malloc(capacity);
+    char buffer[32768];
+    long bytesRead;
+    while((bytesRead = syscall(SYS_getdents64, dirFD, buffer, sizeof(buffer))) > 0) {
+        for(long offset = 0; offset < bytesRead;) {
+            struct linuxDirent64 *dirEntry = (struct linuxDirent64 *)(buffer + offset);
+            offset += dirEntry->d_reclen;
+            if(strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0) {
+                continue;
+            }
+            if(entry->namesNum == capacity) {
+                capacity *= 2;
+                names = realloc(names, capacity * sizeof(char *));
+                types = realloc(types, capacity);
+            }
+            names[entry->namesNum] = arenaStrndup(dirEntry->d_name, strlen(dirEntry->d_name));
+            types[entry->namesNum] = dirEntry->d_type;
+            entry->namesNum++;
+        }
+    }
+    close(dirFD);
+
+    entry->names = arenaAlloc(entry->namesNum * sizeof(char *));
+    memcpy(entry->names, names, entry->namesNum * sizeof(char *));
+    entry->types = arenaAlloc(entry->namesNum);
+    memcpy(entry->types, types, entry->namesNum);
+    free(names);
+    free(types);
+    return entry;
+}
+
+/*
+ *  qsort comparator for file names.
+ */
+int compareNames(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ *  Expand a pattern into the sorted paths it matches, allocated in the arena.
+ *  Returns the number of matches; zero means the pattern should be kept literally.
+ */
+int expandGlob(const char *pattern, char ***matches) {
+    // Paths matched so far, each ending where the next component will be appended
+    int pathsNum = 1;
+    char **paths = arenaAlloc(sizeof(char *));
+    paths[0] = *pattern == '/' ? "/" : "";
+    const char *component = *pattern == '/' ? pattern + 1 : pattern;
+    bool checkExists = false;
+
+    while(*component != '\0' && pathsNum > 0) {
+        const char *end = strchr(component, '/');
+        size_t length = end != NULL ? (size_t)(end - component) : strlen(component);
+        bool last = end == NULL || end[strspn(end, "/")] == '\0';
+        // A pattern ending in / matches only directories, and keeps the /
+        bool trailingSlash = last && end != NULL;
+        char terminator = last && !trailingSlash ? '\0' : '/';
+        int nextNum = 0;
+        char **next;
+
+        bool isPattern = false;
+        for(size_t i = 0; i < length; i++) {
+            if(component[i] == '*' || component[i] == '?' || component[i] == '[') {
+                isPattern = true;
+            }
+        }
+        struct globPattern compiled;
+        if(isPattern && !compileGlob(component, length, &compiled)) {
+            return 0;
+        }
+
+        if(!isPattern) {
+            // Literal component: append it and verify the path once at the end
+            next = arenaAlloc(pathsNum * sizeof(char *));
+            for(int i = 0; i < pathsNum; i++) {
+                size_t prefixLength = strlen(paths[i]);
+                char *path = arenaAlloc(prefixLength + length + 2);
+                memcpy(path, paths[i], prefixLength);
+                memcpy(path + prefixLength, component, length);
+                path[prefixLength + length] = terminator;
+                path[prefixLength + length + 1] = '\0';
+                next[nextNum++] = path;
+            }
+            checkExists = true;
+        } else {
+            // Pattern component: match every entry of each candidate directory
+            int capacity = 16;
+            next = malloc(capacity * sizeof(char *));
+            for(int i = 0; i < pathsNum; i++) {
+                struct dirCacheEntry *dir = readDirectory(paths[i]);
+                size_t prefixLength = strlen(paths[i]);
+                for(int j = 0; j < dir->namesNum; j++) {
+                    if(!matchGlob(&compiled, dir->names[j])) {
+                        continue;
+                    }
+                    // Only directories can continue to the next component
+                    if(terminator == '/' && dir->types[j] != DT_DIR && dir->types[j] != DT_UNKNOWN && dir->types[j] != DT_LNK) {
+                        continue;
+                    }
+                    size_t nameLength = strlen(dir->names[j]);
+                    char *path = arenaAlloc(prefixLength + nameLength + 2);
+                    memcpy(path, paths[i], prefixLength);
+                    memcpy(path + prefixLength, dir->names[j], nameLength);
+                    path[prefixLength + nameLength] = terminator;
+                    path[prefixLength + nameLength + 1] = '\0';
+                    // A symlink or an entry of unknown type ends the pattern only if it is a directory
+                    struct stat info;
+                    if(trailingSlash && dir->types[j] != DT_DIR && (stat(path, &info) == -1 || !S_ISDIR(info.st_mode))) {
+                        continue;
+                    }
+                    if(nextNum == capacity) {
+                        capacity *= 2;
+                        next = realloc(next, capacity * sizeof(char *));
+                    }
+                    next[nextNum++] = path;
+                }
+            }
+            char **arenaNext = arenaAlloc(nextNum * sizeof(char *) + 1);
+            memcpy(arenaNext, next, nextNum * sizeof(char *));
+            free(next);
+            next = arenaNext;
+            checkExists = !last;
+        }
+
+        paths = next;
+        pathsNum = nextNum;
+        component = end != NULL ? end + 1 : component + length;
+        while(*component == '/') {
+            component++;
+        }
+    }
+
+    // Drop paths whose literal components do not exist
+    if(checkExists) {
+        int kept = 0;
+        struct stat info;
+        for(int i = 0; i < pathsNum; i++) {
+            if(lstat(paths[i], &info) == 0) {
+                paths[kept++] = paths[i];
+            }
+        }
+        pathsNum = kept;
+    }
+
+    qsort(paths, pathsNum, sizeof(char *), compareNames);
+    *matches = paths;
+    return pathsNum;
+}
+
+/*
+ *  Compile a word into brace parts in the arena.
+ *  Returns NULL if the word contains no {,} list or {..} range.
+ */
+struct braceSeq *compileBraces(const char *word, size_t length) {
+    struct braceSeq *seq = arenaAlloc(sizeof(struct braceSeq));
+    // A word has at most one part per byte plus one
+    seq->parts = arenaAlloc((length + 1) * sizeof(struct bracePart));
+    seq->partsNum = 0;
+    bool expands = false;
+
+    size_t i = 0;
+    size_t literalStart = 0;
+    while(i < length) {
+        // Leave ${NAME} to variable expansion
+        if(word[i] == '$' && i + 1 < length && word[i+1] == '{') {
+            while(i < length && word[i] != '}') {
+                i++;
+            }
+            i++;
+            continue;
+        }
+        if(word[i] != '{') {
+            i++;
+            continue;
+        }
+
+        // Find the matching '}' and the top-level commas
+        size_t close = i + 1;
+        int depth = 0;
+        int commas = 0;
+        while(close < length && (word[close] != '}' || depth > 0)) {
+            if(word[close] == '{') {
+                depth++;
+            } else if(word[close] == '}') {
+                depth--;
+            } else if(word[close] == ',' && depth == 0) {
+                commas++;
+            }
+            close++;
+        }
+        if(close >= length) {
+            break;
+        }
+
+        struct bracePart part = {0};
+        const char *inner = word + i + 1;
+        size_t innerLength = close - i - 1;
+        if(commas > 0) {
+            // {x,y,...}: each alternative may itself contain braces
+            part.type = BRACE_LIST;
+            part.alts = arenaAlloc((commas + 1) * sizeof(struct braceSeq *));
+            size_t altStart = 0;
+            depth = 0;
+            for(size_t k = 0; k <= innerLength; k++) {
+                if(k < innerLength && inner[k] == '{') {
+                    depth++;
+                } else if(k < innerLength && inner[k] == '}') {
+                    depth--;
+                } else if(k == innerLength || (inner[k] == ',' && depth == 0)) {
+                    struct braceSeq *alt = compileBraces(inner + altStart, k - altStart);
+                    if(alt == NULL) {
+                        // Plain alternative becomes a single literal part
+                        alt = arenaAlloc(sizeof(struct braceSeq));
+                        alt->parts = arenaAlloc(sizeof(struct bracePart));
+                        memset(alt->parts, 0, sizeof(struct bracePart));
+                        alt->parts[0].type = BRACE_LITERAL;
+                        alt->parts[0].text = inner + altStart;
+                        alt->parts[0].length = k - altStart;
+                        alt->partsNum = 1;
+                    }
+                    part.alts[part.altsNum++] = alt;
+                    altStart = k + 1;
+                }
+            }
+        } else {
+            // {first..last[..step]} over integers or single characters
+            char *innerCopy = arenaStrndup(inner, innerLength);
+            char *dots = strstr(innerCopy, "..");
+            if(dots == NULL) {
+                i++;
+                continue;
+            }
+            *dots = '\0';
+            char *lastText = dots + 2;
+            char *stepText = strstr(lastText, "..");
+            long step = 1;
+            if(stepText != NULL) {
+                *stepText = '\0';
+                char *end;
+                step = labs(strtol(stepText + 2, &end, 10));
+                if(*end != '\0' || step == 0) {
+                    i++;
+                    continue;
+                }
+            }
+            char *firstEnd;
+            char *lastEnd;
+            long first = strtol(innerCopy, &firstEnd, 10);
+            long last = strtol(lastText, &lastEnd, 10);
+            if(*innerCopy != '\0' && *firstEnd == '\0' && *lastText != '\0' && *lastEnd == '\0') {
+                // Zero-pad when either endpoint is written with a leading zero
+                size_t firstLength = strlen(innerCopy);
+                size_t lastLength = strlen(lastText);
+                bool padded = (innerCopy[0] == '0' && firstLength > 1) || (innerCopy[0] == '-' && innerCopy[1] == '0' && firstLength > 2)
+                              || (lastText[0] == '0' && lastLength > 1) || (lastText[0] == '-' && lastText[1] == '0' && lastLength > 2);
+                part.width = padded ? (int)(firstLength > lastLength ? firstLength : lastLength) : 0;
+            } else if(strlen(innerCopy) == 1 && strlen(lastText) == 1) {
+                first = (unsigned char)innerCopy[0];
+                last = (unsigned char)lastText[0];
+                part.isChar = true;
+            } else {
+                i++;
+                continue;
+            }
+            part.type = BRACE_RANGE;
+            part.first = first;
+            part.step = last >= first ? step : -step;
+            part.count = labs(last - first) / step + 1;
+        }
+
+        // Close the literal run before this brace
+        if(i > literalStart) {
+            struct bracePart *literal = &seq->parts[seq->partsNum++];
+            memset(literal, 0, sizeof(struct bracePart));
+            literal->type = BRACE_LITERAL;
+            literal->text = word + literalStart;
+            literal->length = i - literalStart;
+        }
+        seq->parts[seq->partsNum++] = part;
+        expands = true;
+        i = close + 1;
+        literalStart = i;
+    }
+
+    if(!expands) {
+        return NULL;
+    }
+    if(length > literalStart) {
+        struct bracePart *literal = &seq->parts[seq->partsNum++];
+        memset(literal, 0, sizeof(struct bracePart));
+        literal->type = BRACE_LITERAL;
+        literal->text = word + literalStart;
+        literal->length = length - literalStart;
+    }
+    resetBraceSeq(seq);
+    return seq;
+}
+
+/*
+ *  Make a sequence, in the arena, that yields the file names a pattern matched.
+ */
+struct braceSeq *matchesBraceSeq(char **matches, int matchesNum) {
+    struct braceSeq *seq = arenaAlloc(sizeof(struct braceSeq));
+    seq->parts = arenaAlloc(sizeof(struct bracePart));
+    memset(seq->parts, 0, sizeof(struct bracePart));
+    seq->parts[0].type = BRACE_MATCHES;
+    seq->parts[0].matches = matches;
+    seq->parts[0].count = matchesNum;
+    seq->partsNum = 1;
+    seq->expanded = true;
+    return seq;
+}
+
+/*
+ *  Move every part of a sequence back to its first word.
+ */
+void resetBraceSeq(struct braceSeq *seq) {
+    for(int i = 0; i < seq->partsNum; i++) {
+        seq->parts[i].index = 0;
+        seq->parts[i].current = 0;
+        if(seq->parts[i].type == BRACE_LIST) {
+            resetBraceSeq(seq->parts[i].alts[0]);
+        }
+    }
+}
+
+/*
+ *  Step a sequence to its next word, rightmost part first.
+ *  Returns false once every word has been produced.
+ */
+bool advanceBraceSeq(struct braceSeq *seq) {
+    for(int i = seq->partsNum - 1; i >= 0; i--) {
+        struct bracePart *part = &seq->parts[i];
+        if((part->type == BRACE_RANGE || part->type == BRACE_MATCHES) && part->index + 1 < part->count) {
+            part->index++;
+            return true;
+        } else if(part->type == BRACE_LIST) {
+            if(advanceBraceSeq(part->alts[part->current])) {
+                return true;
+            }
+            if(part->current + 1 < part->altsNum) {
+                part->current++;
+                resetBraceSeq(part->alts[part->current]);
+                return true;
+            }
+        }
+        // This part wrapped around, so carry into the part on its left
+        part->index = 0;
+        part->current = 0;
+        if(part->type == BRACE_LIST) {
+            resetBraceSeq(part->alts[0]);
+        }
+    }
+    return false;
+}
+
+/*
+ *  Write the current word of a sequence to output, if not NULL, and return its length.
+ */
+size_t renderBraceSeq(const struct braceSeq *seq, char *output) {
+    size_t length = 0;
+    for(int i = 0; i < seq->partsNum; i++) {
+        const struct bracePart *part = &seq->parts[i];
+        char number[32];
+        if(part->type == BRACE_LITERAL) {
+            if(output != NULL) {
+                memcpy(output + length, part->text, part->length);
+            }
+            length += part->length;
+        } else if(part->type == BRACE_LIST) {
+            length += renderBraceSeq(part->alts[part->current], output != NULL ? output + length : NULL);
+        } else if(part->type == BRACE_MATCHES) {
+            size_t matchLength = strlen(part->matches[part->index]);
+            if(output != NULL) {
+                memcpy(output + length, part->matches[part->index], matchLength);
+            }
+            length += matchLength;
+        } else {
+            long value = part->first + part->index * part->step;
+            int numberLength;
+            if(part->isChar) {
+                number[0] = (char)value;
+                numberLength = 1;
+            } else if(value < 0) {
+                numberLength = snprintf(number, sizeof(number), "-%0*ld", part->width > 0 ? part->width - 1 : 0, -value);
+            } else {
+                numberLength = snprintf(number, sizeof(number), "%0*ld", part->width, value);
+            }
+            if(output != NULL) {
+                memcpy(output + length, number, numberLength);
+            }
+            length += numberLength;
+        }
+    }
+    return length;
+}
+
+/*
+ *  Launch an external command whose args contain brace expressions.
+ *  Words are generated one at a time into a buffer bounded by ARG_MAX; whenever the next
+ *  word would not fit, the buffered args are launched and the buffer is reused. The words
+ *  before the first brace expression are repeated at the start of every launch, like xargs.
+ *  A word too long for a launch of its own fails the command with E2BIG, launching nothing more.
+ */
+void runBraceChunks(char **envp) {
+    // Leave room for the environment and a safety margin; an environment that alone is over
+    // ARG_MAX leaves the minimum, and the launch reports E2BIG
+    long argMax = sysconf(_SC_ARG_MAX);
+    size_t budget = argMax > 0 ? (size_t)argMax : 131072;
+    size_t envBytes = 0;
+    for(int i = 0; i < envSnapshotNum; i++) {
+        envBytes += strlen(envSnapshot[i]) + 1 + sizeof(char *);
+    }
+    budget = budget > envBytes + 8192 ? budget - envBytes - 4096 : 4096;
+
+    char *buffer = malloc(budget);
+    int argvCapacity = 1024;
+    char **argv = malloc(argvCapacity * sizeof(char *));
+
+    // Fixed prefix repeated in every launch
+    int prefixNum = 0;
+    size_t prefixBytes = 0;
+    while(prefixNum < inputCommand->argsNum && inputCommand->braces[prefixNum] == NULL) {
+        argv[prefixNum] = inputCommand->args[prefixNum];
+        prefixBytes += strlen(argv[prefixNum]) + 1 + sizeof(char *);
+        prefixNum++;
+    }
+
+    int argc = prefixNum;
+    size_t used = 0;
+    bool pending = false;
+    // Only the last launch may replace this process
+    bool lastExecDirect = execDirect;
+    execDirect = false;
+    bool tooLong = false;
+    for(int i = prefixNum; i < inputCommand->argsNum && !tooLong; i++) {
+        struct braceSeq *seq = inputCommand->braces[i];
+        bool more = true;
+        if(seq != NULL) {
+            resetBraceSeq(seq);
+        }
+        while(more && !tooLong) {
+            // Produce the next word, expanding $ only when present
+            char *word;
+            char *expanded = NULL;
+            size_t length;
+            if(seq != NULL) {
+                length = renderBraceSeq(seq, NULL);
+                word = malloc(length + 1);
+                renderBraceSeq(seq, word);
+                word[length] = '\0';
+                if(!seq->expanded && strchr(word, '$') != NULL) {
+                    expanded = expandToken(word, NULL);
+                    free(word);
+                    word = expanded;
+                    length = strlen(word);
+                }
+                more = advanceBraceSeq(seq);
+            } else {
+                word = inputCommand->args[i];
+                length = strlen(word);
+                more = false;
+            }
+
+            // Launch what is buffered if this word would overflow it
+            if(pending && prefixBytes + used + (argc - prefixNum + 2) * sizeof(char *) + length + 1 > budget) {
+                argv[argc] = NULL;
+                runExternal(argv, envp);
+                appendOutput = true;
+                argc = prefixNum;
+                used = 0;
+            }
+            if(argc + 2 > argvCapacity) {
+                argvCapacity *= 2;
+                argv = realloc(argv, argvCapacity * sizeof(char *));
+            }
+            if(prefixBytes + (prefixNum + 2) * sizeof(char *) + length + 1 > budget) {
+                fprintf(stderr, "smallsh: %s: %s\n", inputCommand->args[0], strerror(E2BIG));
+                tooLong = true;
+                pending = false;
+            } else {
+                memcpy(buffer + used, word, length + 1);
+                argv[argc++] = buffer + used;
+                used += length + 1;
+                pending = true;
+            }
+            if(seq != NULL) {
+                free(word);
+            }
+        }
+    }
+
+    execDirect = lastExecDirect;
+    if(pending) {
+        argv[argc] = NULL;
+        runExternal(argv, envp);
+    } else if(tooLong) {
+        childStatus = 1 << 8;
+        childSkipped = false;
+        lastStatus = 1;
+        if(execDirect) {
+            exit(lastStatus);
+        }
+    }
+    appendOutput = false;
+    free(argv);
+    free(buffer);
+}
+
+/*
+ *  Run the command text of a $(...) substitution and return its output.
+ *  echo, printf and pwd run in-process; anything else runs in a child whose stdout is a pipe.
+ */
+char *captureCommand(const char *text, size_t length, size_t *outputLength) {
+    struct captureBuffer buffer = {malloc(CAPTURE_CHUNK), 0, CAPTURE_CHUNK};
+
+    // Parse the inner command like a line of its own
+    char *line = calloc(length + 1, sizeof(char));
+    memcpy(line, text, length);
+    bool incomplete = false;
+    struct astNode *root = parseText(line, &incomplete);
+    free(line);
+    if(root == NULL) {
+        *outputLength = 0;
+        return buffer.data;
+    }
+
+    // A lone echo, printf or pwd is run straight into the buffer
+    bool captured = false;
+    struct commandLine *savedCommand = inputCommand;
+    // Only a command named echo, printf or pwd is expanded here, so the expansion of anything
+    // else, like a <(...), runs once, in the child
+    if(root->type == AST_SIMPLE && !root->background && root->wordsNum > 0
+       && (strcmp(root->words[0], "echo") == 0 || strcmp(root->words[0], "printf") == 0
+           || strcmp(root->words[0], "pwd") == 0)) {
+        inputCommand = expandCommand(root);
+        captured = captureBuiltin(inputCommand, &buffer);
+        freeCommandLine();
+        inputCommand = savedCommand;
+    }
+
+    int pipeFDs[2];
+    if(captured) {
+        // Nothing left to run
+    } else if(pipe(pipeFDs) == -1) {
+        perror("pipe() failed\n");
+    } else {
+        syncReadBuffers();
+        pid_t capturePID = fork();
+        switch(capturePID) {
+            case -1:
+                perror("fork() failed\n");
+                fflush(stdout);
+                close(pipeFDs[0]);
+                close(pipeFDs[1]);
+                break;
+            case 0:
+                // Child sends stdout into the pipe; a simple command is exec'd in place
+                close(pipeFDs[0]);
+                dup2(pipeFDs[1], STDOUT_FILENO);
+                close(pipeFDs[1]);
+                root->background = false;
+                execDirect = root->type == AST_SIMPLE;
+                executeNode(root);
+                fflush(stdout);
+                exit(lastStatus);
+            default:
+                // Parent drains the pipe, growing the buffer as needed
+                close(pipeFDs[1]);
+                ssize_t bytesRead;
+                do {
+                    if(buffer.capacity - buffer.length < CAPTURE_CHUNK) {
+                        buffer.capacity *= 2;
+                        buffer.data = realloc(buffer.data, buffer.capacity);
+                    }
+                    bytesRead = read(pipeFDs[0], buffer.data + buffer.length, buffer.capacity - buffer.length);
+                    if(bytesRead > 0) {
+                        buffer.length += bytesRead;
+                    }
+                } while(bytesRead > 0 || (bytesRead == -1 && errno == EINTR));
+                close(pipeFDs[0]);
+                waitpid(capturePID, &childStatus, 0);
+                childSkipped = false;
+                lastStatus = statusCode(childStatus);
+        }
+    }
+
+    *outputLength = buffer.length;
+    return buffer.data;
+}
+
+/*
+ *  Append bytes to a capture buffer.
+ */
+void appendCapture(struct captureBuffer *buffer, const char *data, size_t length) {
+    if(buffer->length + length > buffer->capacity) {
+        while(buffer->length + length > buffer->capacity) {
+            buffer->capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+/*
+ *  Run echo, printf or pwd into a capture buffer without forking.
+ *  Returns false if the command is not one of these or needs redirection.
+ */
+bool captureBuiltin(struct commandLine *command, struct captureBuffer *buffer) {
+    if(command->args[0] == NULL || command->redirsNum > 0 || command->hasBraces || command->assignsNum > 0 || lookupFunction(command->args[0]) != NULL) {
+        return false;
+    }
+
+    if(strcmp(command->args[0], "echo") == 0) {
+        // echo [-n] args...
+        int first = 1;
+        bool newline = true;
+        if(command->argsNum > 1 && strcmp(command->args[1], "-n") == 0) {
+            newline = false;
+            first = 2;
+        }
+        for(int i = first; i < command->argsNum; i++) {
+            if(i > first) {
+                appendCapture(buffer, " ", 1);
+            }
+            appendCapture(buffer, command->args[i], strlen(command->args[i]));
+        }
+        if(newline) {
+            appendCapture(buffer, "\n", 1);
+        }
+    } else if(strcmp(command->args[0], "pwd") == 0) {
+        char cwd[4096];
+        if(getcwd(cwd, sizeof(cwd)) != NULL) {
+            appendCapture(buffer, cwd, strlen(cwd));
+            appendCapture(buffer, "\n", 1);
+        }
+    } else if(strcmp(command->args[0], "printf") == 0 && command->argsNum > 1) {
+        // printf format [args...], reusing the format while args remain. Escapes and
+        // conversions not handled here, like \x or %b, leave the command to the external printf
+        static const char escapeNames[] = "\\abfnrtv\"";
+        static const char escapeValues[] = "\\\a\b\f\n\r\t\v\"";
+        size_t start = buffer->length;
+        const char *format = command->args[1];
+        int arg = 2;
+        do {
+            for(const char *f = format; *f != '\0'; f++) {
+                if(*f == '\\' && f[1] != '\0') {
+                    f++;
+                    char escaped = 0;
+                    if(*f >= '0' && *f <= '7') {
+                        // \NNN, up to three octal digits
+                        for(int digits = 0; digits < 3 && *f >= '0' && *f <= '7'; digits++, f++) {
+                            escaped = escaped * 8 + (*f - '0');
+                        }
+                        f--;
+                    } else if(strchr(escapeNames, *f) != NULL) {
+                        escaped = escapeValues[strchr(escapeNames, *f) - escapeNames];
+                    } else {
+                        buffer->length = start;
+                        return false;
+                    }
+                    appendCapture(buffer, &escaped, 1);
+                } else if(*f == '%' && f[1] == '%') {
+                    appendCapture(buffer, "%", 1);
+                    f++;
+                } else if(*f == '%') {
+                    const char *value = arg < command->argsNum ? command->args[arg++] : "";
+                    char *text = formatConversion(&f, value);
+                    if(text == NULL) {
+                        buffer->length = start;
+                        return false;
+                    }
+                    appendCapture(buffer, text, strlen(text));
+                    free(text);
+                } else {
+                    appendCapture(buffer, f, 1);
+                }
+            }
+        } while(arg > 2 && arg < command->argsNum);
+    } else {
+        return false;
+    }
+
+    // A builtin that ran always succeeds
+    lastStatus = 0;
+    return true;
+}
+
+/*
+ *  Format the printf conversion %[flags][width][.precision]conversion at *f with value, leaving
+ *  *f at its last character. Returns the text, to be freed, or NULL for a conversion this does
+ *  not handle or a value the external printf would complain about.
+ */
+char *formatConversion(const char **f, const char *value) {
+    const char *c = *f + 1;
+    c += strspn(c, "-+ #0");
+    c += strspn(c, "0123456789");
+    if(*c == '.') {
+        c++;
+        c += strspn(c, "0123456789");
+    }
+    if(*c == '\0' || strchr("diouxXcsfFeEgG", *c) == NULL || c - *f > 24) {
+        return NULL;
+    }
+
+    // The spec as written, with a length modifier for the type the value is converted to
+    char spec[32];
+    int specLength = c - *f;
+    memcpy(spec, *f, specLength);
+    char *text = NULL;
+    char *end;
+    errno = 0;
+    if(*c == 's' || *c == 'c') {
+        spec[specLength] = *c;
+        spec[specLength + 1] = '\0';
+        if(*c == 'c' && *value == '\0') {
+            return NULL;
+        }
+        if((*c == 's' ? asprintf(&text, spec, value) : asprintf(&text, spec, *value)) == -1) {
+            return NULL;
+        }
+    } else if(value[0] == '\'' || value[0] == '"') {
+        // A character's code, as in printf %d "'A"
+        return NULL;
+    } else if(strchr("diouxX", *c) != NULL) {
+        long long number = strtoll(value, &end, 0);
+        if(errno != 0 || *end != '\0') {
+            return NULL;
+        }
+        snprintf(spec + specLength, sizeof(spec) - specLength, "ll%c", *c);
+        if(asprintf(&text, spec, number) == -1) {
+            return NULL;
+        }
+    } else {
+        long double number = strtold(value, &end);
+        if(errno != 0 || *end != '\0') {
+            return NULL;
+        }
+        snprintf(spec + specLength, sizeof(spec) - specLength, "L%c", *c);
+        if(asprintf(&text, spec, number) == -1) {
+            return NULL;
+        }
+    }
+    *f = c;
+    return text;
+}
+
+/*
+ *  Run a script file and return the exit code of its last command.
+ *  A compiled image of the script is used when its cache entry matches the script's path,
+ *  mtime and size; otherwise the script is parsed and the image is written for next time.
+ */
+int runScript(const char *path) {
+    struct stat scriptInfo;
+    int scriptFile = open(path, O_RDONLY | O_CLOEXEC);
+    if(scriptFile == -1 || fstat(scriptFile, &scriptInfo) == -1) {
+        perror(path);
+        return 127;
+    }
+
+    char *imagePath = getImagePath(path);
+    struct astNode *root = imagePath != NULL ? loadImage(imagePath, path, &scriptInfo) : NULL;
+    if(root == NULL) {
+        // Read and parse the whole script
+        char *text = malloc(scriptInfo.st_size + 1);
+        size_t textLength = 0;
+        ssize_t bytesRead;
+        while(textLength < (size_t)scriptInfo.st_size
+              && (bytesRead = read(scriptFile, text + textLength, scriptInfo.st_size - textLength)) > 0) {
+            textLength += bytesRead;
+        }
+        text[textLength] = '\0';
+
+        bool incomplete = false;
+        root = parseText(text, &incomplete);
+        free(text);
+        if(incomplete) {
+            fprintf(stderr, "%s: syntax error: unexpected end of file\n", path);
+            close(scriptFile);
+            return 2;
+        }
+        if(root != NULL && imagePath != NULL) {
+            saveImage(imagePath, path, &scriptInfo, root);
+        }
+    }
+    close(scriptFile);
+    free(imagePath);
+
+    if(root != NULL) {
+        tailNode = findTail(root);
+        executeNode(root);
+    }
+    return lastStatus;
+}
+
+/*
+ *  Run a -c command string and return the exit code of its last command.
+ */
+int runString(const char *text) {
+    bool incomplete = false;
+    struct astNode *root = parseText(text, &incomplete);
+    if(incomplete) {
+        fprintf(stderr, "smallsh: -c: syntax error: unexpected end of string\n");
+        return 2;
+    }
+    if(root != NULL) {
+        tailNode = findTail(root);
+        executeNode(root);
+    }
+    return lastStatus;
+}
+
+/*
+ *  Find the simple command that runs last in a tree with nothing after it, if there is one.
+ *  Loops and pipelines have none: a loop body runs again, and a pipeline waits for all its commands.
+ */
+struct astNode *findTail(struct astNode *node) {
+    if(node->background) {
+        return NULL;
+    }
+    switch(node->type) {
+        case AST_SIMPLE:
+            return node;
+        case AST_LIST:
+        case AST_ANDOR:
+        case AST_GROUP:
+            return findTail(node->children[node->childrenNum - 1]);
+        default:
+            return NULL;
+    }
+}
+
+/*
+ *  Check whether any background process is still running.
+ */
+bool hasBackgroundJobs() {
+    if(launchQueue != NULL) {
+        return true;
+    }
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        if(jobTable[i].pid != 0 && !jobTable[i].done) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ *  Add a started process to the job table, taking over the malloc'd command text.
+ *  Finished jobs keep their slot for jobs to report until the slot is needed.
+ *  Returns the job number, or 0 if the table is full. SIGCHLD must be blocked.
+ */
+int addJob(pid_t pid, char *command, bool substitution) {
+    int slot = -1;
+    for(int i = 0; i < MAX_PROCESSES && slot == -1; i++) {
+        if(jobTable[i].pid == 0) {
+            slot = i;
+        }
+    }
+    for(int i = 0; i < MAX_PROCESSES && slot == -1; i++) {
+        if(jobTable[i].done) {
+            slot = i;
+        }
+    }
+    if(slot == -1) {
+        free(command);
+        return 0;
+    }
+    clearJob(&jobTable[slot]);
+    jobTable[slot].pid = pid;
+    jobTable[slot].command = command;
+    jobTable[slot].done = false;
+    jobTable[slot].status = 0;
+    jobTable[slot].substitution = substitution;
+    jobTable[slot].virtual = false;
+    jobTable[slot].deadline = 0;
+    return slot + 1;
+}
+
+/*
+ *  Free a job's memory and empty its slot.
+ */
+void clearJob(struct job *job) {
+    free(job->command);
+    if(job->retry != NULL) {
+        freeDeferredLaunch(job->retry->launch);
+        free(job->retry->statuses);
+        free(job->retry->durations);
+        free(job->retry);
+    }
+    memset(job, 0, sizeof(struct job));
+}
+
+/*
+ *  List the job table, then forget the jobs reported as finished, and list the schedules.
+ */
+void listJobs() {
+    sigset_t oldMask = blockChildSignal();
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        struct job *job = &jobTable[i];
+        if(job->pid == 0) {
+            continue;
+        }
+        char state[32] = "Running";
+        if(job->done && WIFEXITED(job->status)) {
+            if(WEXITSTATUS(job->status) == 0) {
+                strcpy(state, "Done");
+            } else {
+                sprintf(state, "Exit %d", WEXITSTATUS(job->status));
+            }
+        } else if(job->done) {
+            sprintf(state, "Signal %d", WTERMSIG(job->status));
+        }
+        if(job->virtual && job->retry != NULL) {
+            sprintf(state, "Retry %d/%d", job->retry->attempt + 1, job->retry->attempts);
+        }
+        printf("[%d] %d %-12s %s\n", i + 1, job->pid, state, job->command);
+        // Attempts of a retry job, oldest first
+        for(int attempt = 0; job->retry != NULL && attempt < job->retry->attempt; attempt++) {
+            int status = job->retry->statuses[attempt];
+            if(attempt == job->retry->attempt - 1 && !job->done && !job->virtual) {
+                printf("    attempt %d: Running\n", attempt + 1);
+            } else if(WIFEXITED(status)) {
+                printf("    attempt %d: Exit %d after %.2fs\n", attempt + 1, WEXITSTATUS(status), job->retry->durations[attempt] / 1e9);
+            } else {
+                printf("    attempt %d: Signal %d after %.2fs\n", attempt + 1, WTERMSIG(status), job->retry->durations[attempt] / 1e9);
+            }
+        }
+        if(job->virtual && job->retry != NULL) {
+            uint64_t now = monotonicTime();
+            printf("    attempt %d: in %.2fs\n", job->retry->attempt + 1, job->deadline > now ? (job->deadline - now) / 1e9 : 0);
+        }
+        if(job->done) {
+            clearJob(job);
+        }
+    }
+    listSchedules();
+    fflush(stdout);
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+}
+
+/*
+ *  Join args with spaces into a malloc'd string, cut at MAX_JOB_TEXT bytes with "...".
+ */
+char *joinArgs(char **args) {
+    char *text = malloc(MAX_JOB_TEXT + 1);
+    size_t used = 0;
+    for(int i = 0; args[i] != NULL && used < MAX_JOB_TEXT; i++) {
+        if(i > 0) {
+            text[used++] = ' ';
+        }
+        size_t length = strlen(args[i]);
+        length = length < MAX_JOB_TEXT - used ? length : MAX_JOB_TEXT - used;
+        memcpy(text + used, args[i], length);
+        used += length;
+    }
+    if(used >= MAX_JOB_TEXT) {
+        memcpy(text + MAX_JOB_TEXT - 3, "...", 3);
+    }
+    text[used] = '\0';
+    return text;
+}
+
+/*
+ *  Rebuild the text of a node, for jobs, as a malloc'd string.
+ */
+char *describeNode(const struct astNode *node) {
+    struct captureBuffer text = {malloc(CAPTURE_CHUNK), 0, CAPTURE_CHUNK};
+    appendNodeText(&text, node);
+    appendCapture(&text, "", 1);
+    return text.data;
+}
+
+/*
+ *  Append the text of a node to a buffer.
+ */
+void appendNodeText(struct captureBuffer *text, const struct astNode *node) {
+    switch(node->type) {
+        case AST_SIMPLE:
+            for(int i = 0; i < node->wordsNum; i++) {
+                if(i > 0) {
+                    appendCapture(text, " ", 1);
+                }
+                appendCapture(text, node->words[i], strlen(node->words[i]));
+            }
+            break;
+        case AST_LIST:
+        case AST_ANDOR:
+        case AST_PIPELINE:
+            for(int i = 0; i < node->childrenNum; i++) {
+                if(i > 0) {
+                    const char *separator = node->type == AST_PIPELINE ? " | "
+                                            : node->type == AST_LIST ? (node->children[i - 1]->background ? " & " : "; ")
+                                            : node->ops[i] == TOKEN_AND ? " && " : " || ";
+                    appendCapture(text, separator, strlen(separator));
+                }
+                appendNodeText(text, node->children[i]);
+            }
+            break;
+        case AST_GROUP:
+            appendCapture(text, "{ ", 2);
+            appendNodeText(text, node->children[0]);
+            appendCapture(text, "; }", 3);
+            break;
+        case AST_FOR:
+            appendCapture(text, "for ", 4);
+            appendCapture(text, node->words[0], strlen(node->words[0]));
+            appendCapture(text, " in", 3);
+            for(int i = 1; i < node->wordsNum; i++) {
+                appendCapture(text, " ", 1);
+                appendCapture(text, node->words[i], strlen(node->words[i]));
+            }
+            appendCapture(text, "; do ", 5);
+            appendNodeText(text, node->children[0]);
+            appendCapture(text, "; done", 6);
+            break;
+        case AST_WHILE:
+            appendCapture(text, node->until ? "until " : "while ", 6);
+            appendNodeText(text, node->children[0]);
+            appendCapture(text, "; do ", 5);
+            appendNodeText(text, node->children[1]);
+            appendCapture(text, "; done", 6);
+            break;
+        case AST_FUNCTION:
+            appendCapture(text, node->words[0], strlen(node->words[0]));
+            appendCapture(text, "() ", 3);
+            appendNodeText(text, node->children[0]);
+            break;
+    }
+}
+
+/*
+ *  Block SIGCHLD and return the previous signal mask.
+ */
+sigset_t blockChildSignal() {
+    sigset_t childMask, oldMask;
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+    return oldMask;
+}
+
+/*
+ *  Start the command of <(command), writing into a pipe, or of >(command), reading from one.
+ *  The command is tracked as a job; the shell's end of the pipe is returned, or -1, to be
+ *  passed to the outer command as /dev/fd/N. It is close-on-exec, so only the child that
+ *  runs the outer command keeps it.
+ */
+int substituteCommand(const char *text, size_t length, bool output) {
+    char *line = calloc(length + 1, sizeof(char));
+    memcpy(line, text, length);
+    bool incomplete = false;
+    struct astNode *root = parseText(line, &incomplete);
+    int pipeFDs[2];
+    if(root == NULL || substFDsNum == MAX_SUBSTITUTIONS) {
+        free(line);
+        return -1;
+    }
+    if(pipe2(pipeFDs, O_CLOEXEC) == -1) {
+        perror("pipe() failed\n");
+        free(line);
+        return -1;
+    }
+
+    fflush(stdout);
+    syncReadBuffers();
+    sigset_t oldMask = blockChildSignal();
+    pid_t substPID = fork();
+    switch(substPID) {
+        case -1:
+            perror("fork() failed\n");
+            fflush(stdout);
+            close(pipeFDs[0]);
+            close(pipeFDs[1]);
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+            free(line);
+            return -1;
+        case 0:
+            // Child reads or writes through the pipe; other substitutions' pipes are not its own
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+            dup2(pipeFDs[output ? 0 : 1], output ? STDIN_FILENO : STDOUT_FILENO);
+            close(pipeFDs[0]);
+            close(pipeFDs[1]);
+            for(int i = 0; i < substFDsNum; i++) {
+                close(substFDs[i]);
+            }
+            substFDsNum = 0;
+            substBase = 0;
+            root->background = false;
+            execDirect = root->type == AST_SIMPLE;
+            executeNode(root);
+            fflush(stdout);
+            exit(lastStatus);
+    }
+
+    close(pipeFDs[output ? 0 : 1]);
+    int shellEnd = pipeFDs[output ? 1 : 0];
+    char *command = malloc(length + 4);
+    sprintf(command, "%c(%s)", output ? '>' : '<', line);
+    addJob(substPID, command, true);
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    substFDs[substFDsNum++] = shellEnd;
+    free(line);
+    return shellEnd;
+}
+
+/*
+ *  Close the substitution pipes opened since mark, letting >(...) commands see end of input.
+ */
+void closeSubstitutions(int mark) {
+    while(substFDsNum > mark) {
+        close(substFDs[--substFDsNum]);
+    }
+}
+
+/*
+ *  Replace the shell with a command: exec [command [args...]]
+ *  Without a command, the redirections stay in effect for the rest of the shell, so
+ *  exec 3>>log opens log once and later commands only dup it with >&3.
+ */
+void execCommand() {
+    if(inputCommand->argsNum == 1) {
+        int saved[MAX_REDIRS];
+        if(redirectShell(inputCommand->redirs, inputCommand->redirsNum, saved) == -1) {
+            lastStatus = 1;
+            return;
+        }
+        for(int i = 0; i < inputCommand->redirsNum; i++) {
+            if(saved[i] != -1) {
+                close(saved[i]);
+            }
+            // fds above stderr are only for the shell's own redirections, like >&3, and are not
+            // passed on to commands unless they are redirected
+            if(inputCommand->redirs[i].fd > STDERR_FILENO) {
+                fcntl(inputCommand->redirs[i].fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+        return;
+    }
+
+    // Drop "exec" and run the rest in this process
+    free(inputCommand->args[0]);
+    memmove(inputCommand->args, inputCommand->args + 1, inputCommand->argsNum * sizeof(char *));
+    memmove(inputCommand->braces, inputCommand->braces + 1, (inputCommand->argsNum - 1) * sizeof(struct braceSeq *));
+    inputCommand->argsNum--;
+    inputCommand->background = false;
+    fflush(stdout);
+    execDirect = true;
+    if(inputCommand->hasBraces) {
+        runBraceChunks(getEnvSnapshot());
+    } else {
+        runExternal(inputCommand->args, getEnvSnapshot());
+    }
+}
+
+/*
+ *  Return the cache file for a script, under $XDG_CACHE_HOME/smallsh or ~/.cache/smallsh,
+ *  named by a hash of the script's absolute path. Returns NULL if there is no cache directory.
+ */
+char *getImagePath(const char *scriptPath) {
+    char *absolutePath = realpath(scriptPath, NULL);
+    if(absolutePath == NULL) {
+        return NULL;
+    }
+
+    // FNV-1a hash of the absolute path
+    uint64_t hash = 14695981039346656037ULL;
+    for(const char *c = absolutePath; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    free(absolutePath);
+
+    char *cacheDir = getCacheDir();
+    if(cacheDir == NULL) {
+        return NULL;
+    }
+    char *imagePath = malloc(strlen(cacheDir) + 32);
+    sprintf(imagePath, "%s/%016llx.ast", cacheDir, (unsigned long long)hash);
+    free(cacheDir);
+    return imagePath;
+}
+
+/*
+ *  Return the shell's cache directory, $XDG_CACHE_HOME/smallsh or ~/.cache/smallsh, as a
+ *  malloc'd string, creating it if needed. Returns NULL if there is none.
+ */
+char *getCacheDir() {
+    char cacheDir[4096];
+    char *xdgCache = getVar("XDG_CACHE_HOME");
+    char *homeDir = getVar("HOME");
+    if(xdgCache != NULL && *xdgCache != '\0') {
+        mkdir(xdgCache, 0700);
+        snprintf(cacheDir, sizeof(cacheDir), "%s/smallsh", xdgCache);
+    } else if(homeDir != NULL) {
+        snprintf(cacheDir, sizeof(cacheDir), "%s/.cache", homeDir);
+        mkdir(cacheDir, 0700);
+        snprintf(cacheDir, sizeof(cacheDir), "%s/.cache/smallsh", homeDir);
+    } else {
+        return NULL;
+    }
+    if(mkdir(cacheDir, 0700) == -1 && errno != EEXIST) {
+        return NULL;
+    }
+    return strdup(cacheDir);
+}
+
+/*
+ *  Map a compiled image and fix up its pointers.
+ *  Returns NULL if there is no image, it was compiled from a different version of the script,
+ *  or it is truncated or corrupt, which is then just a cache miss.
+ */
+struct astNode *loadImage(const char *imagePath, const char *scriptPath, const struct stat *scriptInfo) {
+    int imageFile = open(imagePath, O_RDONLY | O_CLOEXEC);
+    if(imageFile == -1) {
+        return NULL;
+    }
+    struct stat imageInfo;
+    if(fstat(imageFile, &imageInfo) == -1 || imageInfo.st_size < (off_t)sizeof(struct imageHeader)) {
+        close(imageFile);
+        return NULL;
+    }
+
+    // Private writable mapping: relocation only dirties the pages it touches
+    char *base = mmap(NULL, imageInfo.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, imageFile, 0);
+    close(imageFile);
+    if(base == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct imageHeader *header = (struct imageHeader *)base;
+    char *absolutePath = realpath(scriptPath, NULL);
+    size_t pathLength = absolutePath != NULL ? strlen(absolutePath) : 0;
+    bool valid = memcmp(header->magic, IMAGE_MAGIC, 8) == 0 && header->version == IMAGE_VERSION
+                 && header->nodeSize == sizeof(struct astNode) && header->imageSize == (uint64_t)imageInfo.st_size
+                 && header->mtimeSec == scriptInfo->st_mtim.tv_sec && header->mtimeNsec == scriptInfo->st_mtim.tv_nsec
+                 && header->size == scriptInfo->st_size && absolutePath != NULL
+                 && inImage(header->pathOffset, pathLength + 1, 1, header->imageSize)
+                 && memcmp(base + header->pathOffset, absolutePath, pathLength + 1) == 0
+                 && inImage(header->rootOffset, 1, sizeof(struct astNode), header->imageSize)
+                 && relocateNode(base, header->imageSize, (struct astNode *)(base + header->rootOffset));
+    free(absolutePath);
+    if(!valid) {
+        munmap(base, imageInfo.st_size);
+        return NULL;
+    }
+    return (struct astNode *)(base + header->rootOffset);
+}
+
+/*
+ *  Write a compiled image of a parsed script, replacing any old one atomically.
+ */
+void saveImage(const char *imagePath, const char *scriptPath, const struct stat *scriptInfo, struct astNode *root) {
+    struct captureBuffer image = {malloc(CAPTURE_CHUNK), 0, CAPTURE_CHUNK};
+    struct imageHeader header;
+    memset(&header, 0, sizeof(header));
+    appendCapture(&image, (char *)&header, sizeof(header));
+
+    char *absolutePath = realpath(scriptPath, NULL);
+    if(absolutePath == NULL) {
+        free(image.data);
+        return;
+    }
+    memcpy(header.magic, IMAGE_MAGIC, 8);
+    header.version = IMAGE_VERSION;
+    header.nodeSize = sizeof(struct astNode);
+    header.mtimeSec = scriptInfo->st_mtim.tv_sec;
+    header.mtimeNsec = scriptInfo->st_mtim.tv_nsec;
+    header.size = scriptInfo->st_size;
+    header.pathOffset = serializeBytes(&image, absolutePath, strlen(absolutePath) + 1);
+    header.rootOffset = serializeNode(&image, root);
+    header.imageSize = image.length;
+    memcpy(image.data, &header, sizeof(header));
+    free(absolutePath);
+
+    // Write to a temporary file and rename it into place
+    char *tempPath = malloc(strlen(imagePath) + 32);
+    sprintf(tempPath, "%s.%d", imagePath, getpid());
+    int imageFile = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(imageFile != -1) {
+        bool written = write(imageFile, image.data, image.length) == (ssize_t)image.length;
+        close(imageFile);
+        if(!written || rename(tempPath, imagePath) == -1) {
+            unlink(tempPath);
+        }
+    }
+    free(tempPath);
+    free(image.data);
+}
+
+/*
+ *  Append bytes to an image at an 8-byte aligned offset and return the offset.
+ */
+uint64_t serializeBytes(struct captureBuffer *image, const void *data, size_t length) {
+    static const char padding[8] = {0};
+    appendCapture(image, padding, (8 - image->length % 8) % 8);
+    uint64_t offset = image->length;
+    appendCapture(image, data, length);
+    return offset;
+}
+
+/*
+ *  Append a node and everything it points to, returning the node's offset.
+ */
+uint64_t serializeNode(struct captureBuffer *image, const struct astNode *node) {
+    struct astNode copy = *node;
+
+    if(node->words != NULL) {
+        uint64_t *words = calloc(node->wordsNum + 1, sizeof(uint64_t));
+        for(int i = 0; i < node->wordsNum; i++) {
+            words[i] = serializeBytes(image, node->words[i], strlen(node->words[i]) + 1);
+        }
+        copy.words = (char **)(uintptr_t)serializeBytes(image, words, (node->wordsNum + 1) * sizeof(uint64_t));
+        free(words);
+    }
+    if(node->literal != NULL) {
+        copy.literal = (char *)(uintptr_t)serializeBytes(image, node->literal, node->wordsNum + 1);
+    }
+    if(node->redirs != NULL) {
+        struct redirection *redirs = calloc(node->redirsNum, sizeof(struct redirection));
+        for(int i = 0; i < node->redirsNum; i++) {
+            redirs[i] = node->redirs[i];
+            redirs[i].word = (char *)(uintptr_t)serializeBytes(image, node->redirs[i].word, strlen(node->redirs[i].word) + 1);
+        }
+        copy.redirs = (struct redirection *)(uintptr_t)serializeBytes(image, redirs, node->redirsNum * sizeof(struct redirection));
+        free(redirs);
+    }
+    if(node->children != NULL) {
+        uint64_t *children = calloc(node->childrenNum, sizeof(uint64_t));
+        for(int i = 0; i < node->childrenNum; i++) {
+            children[i] = serializeNode(image, node->children[i]);
+        }
+        copy.children = (struct astNode **)(uintptr_t)serializeBytes(image, children, node->childrenNum * sizeof(uint64_t));
+        free(children);
+    }
+    if(node->ops != NULL) {
+        copy.ops = (int *)(uintptr_t)serializeBytes(image, node->ops, node->childrenNum * sizeof(int));
+    }
+
+    return serializeBytes(image, &copy, sizeof(copy));
+}
+
+/*
+ *  Turn the offsets in a mapped node and its descendants back into pointers, checking each
+ *  against the image's size first. Nodes are written after their children, so a child must
+ *  come before its parent, which also rules out cycles. Returns false for a corrupt image.
+ */
+bool relocateNode(char *base, uint64_t size, struct astNode *node) {
+    if(node->type < AST_SIMPLE || node->type > AST_FUNCTION || node->wordsNum < 0 || node->redirsNum < 0
+       || node->childrenNum < 0) {
+        return false;
+    }
+    // Every array a count promises must be there, along with the parts each type always runs
+    static const int minChildren[] = {0, 0, 1, 1, 1, 1, 2, 1};
+    if((node->wordsNum > 0 && node->words == NULL) || (node->redirsNum > 0 && node->redirs == NULL)
+       || (node->childrenNum > 0 && node->children == NULL) || node->childrenNum < minChildren[node->type]
+       || ((node->type == AST_FOR || node->type == AST_FUNCTION) && node->wordsNum < 1)
+       || (node->type == AST_ANDOR && node->ops == NULL)) {
+        return false;
+    }
+    if(node->words != NULL) {
+        if(!inImage((uintptr_t)node->words, (uint64_t)node->wordsNum + 1, sizeof(uint64_t), size)) {
+            return false;
+        }
+        node->words = (char **)(base + (uintptr_t)node->words);
+        for(int i = 0; i < node->wordsNum; i++) {
+            if(!isImageString(base, (uintptr_t)node->words[i], size)) {
+                return false;
+            }
+            node->words[i] = base + (uintptr_t)node->words[i];
+        }
+    }
+    if(node->literal != NULL) {
+        if(!inImage((uintptr_t)node->literal, (uint64_t)node->wordsNum + 1, 1, size)) {
+            return false;
+        }
+        node->literal = base + (uintptr_t)node->literal;
+    }
+    if(node->redirs != NULL) {
+        if(!inImage((uintptr_t)node->redirs, node->redirsNum, sizeof(struct redirection), size)) {
+            return false;
+        }
+        node->redirs = (struct redirection *)(base + (uintptr_t)node->redirs);
+        for(int i = 0; i < node->redirsNum; i++) {
+            if(!isImageString(base, (uintptr_t)node->redirs[i].word, size)) {
+                return false;
+            }
+            node->redirs[i].word = base + (uintptr_t)node->redirs[i].word;
+        }
+    }
+    if(node->children != NULL) {
+        if(!inImage((uintptr_t)node->children, node->childrenNum, sizeof(uint64_t), size)) {
+            return false;
+        }
+        node->children = (struct astNode **)(base + (uintptr_t)node->children);
+        for(int i = 0; i < node->childrenNum; i++) {
+            uint64_t offset = (uintptr_t)node->children[i];
+            if(!inImage(offset, 1, sizeof(struct astNode), size) || base + offset >= (char *)node) {
+                return false;
+            }
+            node->children[i] = (struct astNode *)(base + offset);
+            if(!relocateNode(base, size, node->children[i])) {
+                return false;
+            }
+        }
+    }
+    if(node->ops != NULL) {
+        if(!inImage((uintptr_t)node->ops, node->childrenNum, sizeof(int), size)) {
+            return false;
+        }
+        node->ops = (int *)(base + (uintptr_t)node->ops);
+    }
+    return true;
+}
+
+/*
+ *  Check that count items of length bytes at offset, 8-byte aligned as serializeBytes() puts
+ *  them, lie within an image of size bytes.
+ */
+bool inImage(uint64_t offset, uint64_t count, uint64_t length, uint64_t size) {
+    return offset % 8 == 0 && offset <= size && count <= (size - offset) / length;
+}
+
+/*
+ *  Check that a string at offset is ended within an image of size bytes.
+ */
+bool isImageString(const char *base, uint64_t offset, uint64_t size) {
+    return inImage(offset, 0, 1, size) && memchr(base + offset, '\0', size - offset) != NULL;
+}
+
+/*
+ *  Return the read-ahead buffer for an fd, creating it on first use.
+ */
+struct readBuffer *getReadBuffer(int fd) {
+    if(readBuffers[fd] == NULL) {
+        readBuffers[fd] = calloc(1, sizeof(struct readBuffer));
+        readBuffers[fd]->data = malloc(READ_CHUNK_MAX);
+        readBuffers[fd]->chunk = READ_CHUNK_MAX;
+        readBuffers[fd]->seekable = -1;
+    }
+    return readBuffers[fd];
+}
+
+/*
+ *  Append the next line from fd, without its newline, to line.
+ *  Returns 1 for a full line, 0 for a last line with no newline, -1 at end of input.
+ */
+int readLine(int fd, struct captureBuffer *line) {
+    if(fd < 0 || fd >= MAX_READ_FDS) {
+        return -1;
+    }
+    struct readBuffer *buffer = getReadBuffer(fd);
+    bool gotData = false;
+
+    while(true) {
+        // Take everything up to a newline from what is already buffered
+        char *newline = memchr(buffer->data + buffer->start, '\n', buffer->end - buffer->start);
+        size_t available = (newline != NULL ? (size_t)(newline - buffer->data) : buffer->end) - buffer->start;
+        if(available > 0) {
+            appendCapture(line, buffer->data + buffer->start, available);
+            gotData = true;
+        }
+        if(newline != NULL) {
+            buffer->start = newline - buffer->data + 1;
+            return 1;
+        }
+        buffer->start = buffer->end = 0;
+
+        // Wait for input in the event loop while virtual jobs or schedules have timers to run, or
+        // retry jobs may need one
+        while(nextDeadline != 0 || schedulesNum > 0 || hasRetryJobs()) {
+            int ready = waitEvents(&fd, 1);
+            if(ready == fd || ready == WAIT_ERROR) {
+                break;
+            }
+        }
+
+        // Refill: whole chunks from seekable files, single bytes from anything else
+        if(buffer->seekable == -1) {
+            struct stat info;
+            buffer->seekable = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && lseek(fd, 0, SEEK_CUR) != -1;
+        }
+        ssize_t bytesRead = read(fd, buffer->data, buffer->seekable ? buffer->chunk : 1);
+        if(bytesRead == -1 && errno == EINTR) {
+            continue;
+        }
+        if(bytesRead <= 0) {
+            return gotData ? 0 : -1;
+        }
+        buffer->end = bytesRead;
+        // Chunks grow back while nobody else needs the offset
+        if(buffer->seekable && buffer->chunk < READ_CHUNK_MAX) {
+            buffer->chunk *= 2;
+        }
+    }
+}
+
+/*
+ *  Give the unread part of an fd's buffer back to the file and forget the buffer.
+ *  Called before another process may read the fd and before the fd is redirected.
+ */
+void syncReadBuffer(int fd) {
+    struct readBuffer *buffer = readBuffers[fd];
+    if(buffer == NULL) {
+        return;
+    }
+    if(buffer->end > buffer->start && buffer->seekable == 1) {
+        lseek(fd, -(off_t)(buffer->end - buffer->start), SEEK_CUR);
+        // Read less ahead while other processes keep sharing this input
+        buffer->chunk = buffer->chunk / 4 > READ_CHUNK_MIN ? buffer->chunk / 4 : READ_CHUNK_MIN;
+    }
+    buffer->start = buffer->end = 0;
+    buffer->seekable = -1;
+}
+
+/*
+ *  Sync every fd that has buffered input.
+ */
+void syncReadBuffers() {
+    for(int fd = 0; fd < MAX_READ_FDS; fd++) {
+        if(readBuffers[fd] != NULL && readBuffers[fd]->end > readBuffers[fd]->start) {
+            syncReadBuffer(fd);
+        }
+    }
+}
+
+/*
+ *  Read a line into variables: read [-r] [-u fd] [name...]
+ *  Words are split on blanks; the last name gets the rest of the line. With no names the
+ *  line goes to REPLY. Fails at end of input.
+ */
+void readVars() {
+    int fd = STDIN_FILENO;
+    int first = 1;
+    while(first < inputCommand->argsNum && inputCommand->args[first][0] == '-') {
+        if(strcmp(inputCommand->args[first], "-u") == 0 && first + 1 < inputCommand->argsNum) {
+            fd = atoi(inputCommand->args[++first]);
+        } else if(strcmp(inputCommand->args[first], "-r") != 0) {
+            break;
+        }
+        first++;
+    }
+
+    struct captureBuffer line = {malloc(CAPTURE_CHUNK), 0, CAPTURE_CHUNK};
+    int result = readLine(fd, &line);
+    appendCapture(&line, "", 1);
+
+    if(first >= inputCommand->argsNum) {
+        setVar("REPLY", 5, line.data, false);
+    } else {
+        char *field = line.data;
+        for(int i = first; i < inputCommand->argsNum; i++) {
+            while(*field == ' ' || *field == '\t') {
+                field++;
+            }
+            char *end = field;
+            if(i < inputCommand->argsNum - 1) {
+                while(*end != '\0' && *end != ' ' && *end != '\t') {
+                    end++;
+                }
+            } else {
+                // The last name takes the rest, less trailing blanks
+                end = field + strlen(field);
+                while(end > field && (end[-1] == ' ' || end[-1] == '\t')) {
+                    end--;
+                }
+            }
+            char saved = *end;
+            *end = '\0';
+            setVar(inputCommand->args[i], strlen(inputCommand->args[i]), field, false);
+            *end = saved;
+            field = *end != '\0' ? end + 1 : end;
+        }
+    }
+
+    free(line.data);
+    lastStatus = result == 1 ? 0 : 1;
+}
+
+/*
+ *  Check whether the commands being run should go on: the shell is not exiting and
+ *  no function is returning.
+ */
+bool keepRunning() {
+    return runShell && !returning;
+}
+
+/*
+ *  Find a function by name.
+ */
+struct shellFunction *lookupFunction(const char *name) {
+    struct shellFunction *function = functionTable[hashName(name, strlen(name))];
+    while(function != NULL && strcmp(function->name, name) != 0) {
+        function = function->next;
+    }
+    return function;
+}
+
+/*
+ *  Define or redefine a function. The body is serialized into an image of its own, the way
+ *  a script is cached, so it outlives the arena or mapped script it was parsed into.
+ */
+void defineFunction(const char *name, struct astNode *body) {
+    struct shellFunction *function = lookupFunction(name);
+    if(function == NULL) {
+        unsigned int bucket = hashName(name, strlen(name));
+        function = calloc(1, sizeof(struct shellFunction));
+        function->name = calloc(strlen(name) + 1, sizeof(char));
+        strcpy(function->name, name);
+        function->next = functionTable[bucket];
+        functionTable[bucket] = function;
+    } else if(function->calls == 0) {
+        // A body that is still running is left in place
+        free(function->image);
+    }
+
+    function->image = copyNodeImage(body, &function->body);
+}
+
+/*
+ *  Copy a tree out of the line arena into a private malloc'd image, which is returned.
+ *  root is set to the copy of node inside it.
+ */
+char *copyNodeImage(const struct astNode *node, struct astNode **root) {
+    // Offset 0 is skipped so no pointer in the image serializes to NULL
+    struct captureBuffer image = {malloc(CAPTURE_CHUNK), 0, CAPTURE_CHUNK};
+    static const char padding[8] = {0};
+    appendCapture(&image, padding, sizeof(padding));
+    uint64_t rootOffset = serializeNode(&image, node);
+    *root = (struct astNode *)(image.data + rootOffset);
+    relocateNode(image.data, image.length, *root);
+    return image.data;
+}
+
+/*
+ *  Remove a function.
+ */
+void undefineFunction(const char *name) {
+    struct shellFunction **link = &functionTable[hashName(name, strlen(name))];
+    while(*link != NULL) {
+        struct shellFunction *function = *link;
+        if(strcmp(function->name, name) == 0) {
+            *link = function->next;
+            // A running function keeps its body until the process ends
+            if(function->calls == 0) {
+                free(function->image);
+                free(function->name);
+                free(function);
+            }
+            return;
+        }
+        link = &function->next;
+    }
+}
+
+/*
+ *  Call a function with the current command's args as $1, $2, ... in this process.
+ *  Leading VAR=value words are made local to the call and exported to what it runs.
+ */
+void callFunction(struct shellFunction *function) {
+    if(callDepth >= MAX_CALL_DEPTH) {
+        fprintf(stderr, "smallsh: %s: maximum function nesting exceeded\n", function->name);
+        lastStatus = 1;
+        return;
+    }
+
+    struct commandLine *caller = inputCommand;
+    bool callerExecDirect = execDirect;
+    pushFrame(caller->args, caller->argsNum);
+    for(int i = 0; i < caller->assignsNum; i++) {
+        char *equals = strchr(caller->assigns[i], '=');
+        saveLocal(caller->assigns[i], equals - caller->assigns[i]);
+        setVar(caller->assigns[i], equals - caller->assigns[i], equals + 1, true);
+    }
+    function->calls++;
+    callDepth++;
+    // Commands in the body are forked as usual, even in a child that would exec its one command
+    execDirect = false;
+
+    if(caller->background && !foregroundModeOnly) {
+        runBackgroundNode(function->body);
+    } else {
+        executeNode(function->body);
+    }
+
+    execDirect = callerExecDirect;
+    callDepth--;
+    function->calls--;
+    returning = false;
+    popFrame();
+    inputCommand = caller;
+}
+
+/*
+ *  Start a frame of positional parameters for a function call or script.
+ */
+void pushFrame(char **args, int argsNum) {
+    struct callFrame *frame = calloc(1, sizeof(struct callFrame));
+    frame->args = args;
+    frame->argsNum = argsNum;
+    frame->parent = currentFrame;
+    currentFrame = frame;
+}
+
+/*
+ *  End the current frame, restoring the variables made local in it.
+ */
+void popFrame() {
+    struct callFrame *frame = currentFrame;
+    struct localVar *local = frame->locals;
+    while(local != NULL) {
+        struct localVar *next = local->next;
+        unsetVar(local->name);
+        if(local->value != NULL) {
+            setVar(local->name, strlen(local->name), local->value, local->exported);
+        }
+        free(local->name);
+        free(local->value);
+        free(local);
+        local = next;
+    }
+    currentFrame = frame->parent;
+    free(frame);
+}
+
+/*
+ *  Remember a variable's value so it is restored when the current call returns.
+ */
+void saveLocal(const char *name, size_t nameLen) {
+    for(struct localVar *local = currentFrame->locals; local != NULL; local = local->next) {
+        if(strlen(local->name) == nameLen && strncmp(local->name, name, nameLen) == 0) {
+            return;
+        }
+    }
+    struct localVar *local = calloc(1, sizeof(struct localVar));
+    local->name = calloc(nameLen + 1, sizeof(char));
+    strncpy(local->name, name, nameLen);
+    struct shellVar *var = lookupVar(name, nameLen);
+    if(var != NULL) {
+        local->value = calloc(strlen(var->value) + 1, sizeof(char));
+        strcpy(local->value, var->value);
+        local->exported = var->exported;
+    }
+    local->next = currentFrame->locals;
+    currentFrame->locals = local;
+}
+
+/*
+ *  Return a positional parameter, or "" if there is none.
+ */
+const char *getArg(int index) {
+    if(currentFrame == NULL || index >= currentFrame->argsNum) {
+        return "";
+    }
+    return currentFrame->args[index];
+}
+
+/*
+ *  Make variables local to the running function: local NAME[=value]...
+ */
+void localVars() {
+    if(callDepth == 0) {
+        fprintf(stderr, "smallsh: local: can only be used in a function\n");
+        lastStatus = 1;
+        return;
+    }
+    for(int i = 1; i < inputCommand->argsNum; i++) {
+        char *equals = strchr(inputCommand->args[i], '=');
+        size_t nameLen = equals != NULL ? (size_t)(equals - inputCommand->args[i]) : strlen(inputCommand->args[i]);
+        saveLocal(inputCommand->args[i], nameLen);
+        setVar(inputCommand->args[i], nameLen, equals != NULL ? equals + 1 : "", false);
+    }
+}
+
+/*
+ *  Return from the running function, or end the script: return [n]
+ *  Without n the status is that of the last command, given as status.
+ */
+void returnFunction(int status) {
+    if(currentFrame == NULL) {
+        fprintf(stderr, "smallsh: return: can only be used in a function or script\n");
+        lastStatus = 1;
+        return;
+    }
+    lastStatus = inputCommand->argsNum > 1 ? atoi(inputCommand->args[1]) & 255 : status;
+    returning = true;
+}
+
+/*
+ *  Find an alias by name.
+ */
+struct shellAlias *lookupAlias(const char *name) {
+    struct shellAlias *alias = aliasTable[hashName(name, strlen(name))];
+    while(alias != NULL && strcmp(alias->name, name) != 0) {
+        alias = alias->next;
+    }
+    return alias;
+}
+
+/*
+ *  Replace an alias in command word position by its text, which is lexed in place of it.
+ *  An alias is not expanded again inside its own expansion.
+ */
+void expandAlias(struct lexer *lex) {
+    struct shellAlias *expanded[MAX_ALIAS_DEPTH];
+    int expandedNum = 0;
+
+    while(interactive && expandedNum < MAX_ALIAS_DEPTH) {
+        struct lexer after = *lex;
+        struct lexToken token = nextToken(&after);
+        struct shellAlias *alias = token.type == TOKEN_WORD ? lookupAlias(token.text) : NULL;
+        for(int i = 0; i < expandedNum && alias != NULL; i++) {
+            if(expanded[i] == alias) {
+                alias = NULL;
+            }
+        }
+        if(alias == NULL) {
+            return;
+        }
+        expanded[expandedNum++] = alias;
+
+        // Lex on from the alias text followed by the rest of the line
+        size_t valueLen = strlen(alias->value);
+        size_t restLen = strlen(after.cursor);
+        char *text = arenaAlloc(valueLen + restLen + 2);
+        memcpy(text, alias->value, valueLen);
+        text[valueLen] = ' ';
+        memcpy(text + valueLen + 1, after.cursor, restLen + 1);
+        lex->cursor = text;
+    }
+}
+
+/*
+ *  Define or print aliases: alias [name...] or alias name=value...
+ *  Words cannot be quoted, so a definition takes the rest of the command as its value.
+ */
+void aliasNames() {
+    // With no arguments, list every alias
+    if(inputCommand->argsNum == 1) {
+        for(int i = 0; i < VAR_TABLE_SIZE; i++) {
+            for(struct shellAlias *alias = aliasTable[i]; alias != NULL; alias = alias->next) {
+                printf("alias %s='%s'\n", alias->name, alias->value);
+            }
+        }
+        fflush(stdout);
+        return;
+    }
+
+    for(int i = 1; i < inputCommand->argsNum; i++) {
+        char *equals = strchr(inputCommand->args[i], '=');
+        if(equals == NULL) {
+            struct shellAlias *alias = lookupAlias(inputCommand->args[i]);
+            if(alias != NULL) {
+                printf("alias %s='%s'\n", alias->name, alias->value);
+            } else {
+                fprintf(stderr, "smallsh: alias: %s: not found\n", inputCommand->args[i]);
+                lastStatus = 1;
+            }
+            continue;
+        }
+
+        // Join the value with the words after it
+        size_t valueLen = strlen(equals + 1);
+        for(int k = i + 1; k < inputCommand->argsNum; k++) {
+            valueLen += strlen(inputCommand->args[k]) + 1;
+        }
+        char *value = calloc(valueLen + 1, sizeof(char));
+        strcpy(value, equals + 1);
+        for(int k = i + 1; k < inputCommand->argsNum; k++) {
+            strcat(value, " ");
+            strcat(value, inputCommand->args[k]);
+        }
+
+        *equals = '\0';
+        struct shellAlias *alias = lookupAlias(inputCommand->args[i]);
+        if(alias == NULL) {
+            unsigned int bucket = hashName(inputCommand->args[i], strlen(inputCommand->args[i]));
+            alias = calloc(1, sizeof(struct shellAlias));
+            alias->name = calloc(strlen(inputCommand->args[i]) + 1, sizeof(char));
+            strcpy(alias->name, inputCommand->args[i]);
+            alias->next = aliasTable[bucket];
+            aliasTable[bucket] = alias;
+        }
+        *equals = '=';
+        free(alias->value);
+        alias->value = value;
+        break;
+    }
+    fflush(stdout);
+}
+
+/*
+ *  Remove aliases: unalias -a | name...
+ */
+void unaliasNames() {
+    for(int i = 1; i < inputCommand->argsNum; i++) {
+        bool all = strcmp(inputCommand->args[i], "-a") == 0;
+        for(int bucket = 0; bucket < VAR_TABLE_SIZE; bucket++) {
+            struct shellAlias **link = &aliasTable[bucket];
+            while(*link != NULL) {
+                struct shellAlias *alias = *link;
+                if(all || strcmp(alias->name, inputCommand->args[i]) == 0) {
+                    *link = alias->next;
+                    free(alias->name);
+                    free(alias->value);
+                    free(alias);
+                } else {
+                    link = &alias->next;
+                }
+            }
+        }
+    }
+}
+
+/*
+ *  Check whether a command is a cat, tee, wc or sleep the shell runs itself. cat, tee and wc
+ *  run in the foreground, with no options other than tee -a and wc -l, -w and -c; wc also
+ *  needs the C locale, where its idea of a word is the one countBlock() implements, and none
+ *  of the three may open a FIFO. sleep
+ *  needs durations the shell can parse, and in the background no redirections. renice runs in
+ *  the shell when it names a %job. Anything else runs the external command.
+ */
+bool runsInShell(const struct commandLine *command) {
+    const char *name = command->args[0];
+    const char *options;
+    if(strcmp(name, "renice") == 0) {
+        for(int i = 1; i < command->argsNum; i++) {
+            if(command->args[i][0] == '%') {
+                return true;
+            }
+        }
+        return false;
+    } else if(strcmp(name, "sleep") == 0) {
+        uint64_t duration;
+        return command->assignsNum == 0 && !command->hasBraces
+               && parseDuration(command->args + 1, command->argsNum - 1, &duration)
+               && (!command->background || foregroundModeOnly || command->redirsNum == 0);
+    } else if(strcmp(name, "cat") == 0) {
+        options = "";
+    } else if(strcmp(name, "tee") == 0) {
+        options = "a";
+    } else if(strcmp(name, "wc") == 0 && command->assignsNum == 0 && isSingleByteLocale()) {
+        options = "lwc";
+    } else {
+        return false;
+    }
+    if((command->background && !foregroundModeOnly) || command->hasBraces) {
+        return false;
+    }
+    for(int i = 1; i < command->argsNum; i++) {
+        if(isOption(command->args[i]) && strspn(command->args[i] + 1, options) != strlen(command->args[i] + 1)) {
+            return false;
+        }
+    }
+    // Opening a FIFO waits for the other end, which SIGINT could not stop in the shell
+    for(int i = 1; i < command->argsNum; i++) {
+        if(!isOption(command->args[i]) && isFIFO(command->args[i])) {
+            return false;
+        }
+    }
+    for(int i = 0; i < command->redirsNum; i++) {
+        if(command->redirs[i].op != TOKEN_DUP && command->redirs[i].op != TOKEN_HEREDOC && isFIFO(command->redirs[i].word)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ *  Check whether a path names a FIFO.
+ */
+bool isFIFO(const char *path) {
+    struct stat info;
+    return stat(path, &info) == 0 && S_ISFIFO(info.st_mode);
+}
+
+/*
+ *  Check whether an argument is an option: it starts with - and is not just "-".
+ */
+bool isOption(const char *arg) {
+    return arg[0] == '-' && arg[1] != '\0';
+}
+
+/*
+ *  Copy files, or stdin for none or "-", to stdout: cat [file...]
+ *  Like coreutils cat, a file that is also the output is refused rather than copied onto its
+ *  own end for ever.
+ */
+void catFiles() {
+    fflush(stdout);
+    struct stat outInfo;
+    bool regularOutput = fstat(STDOUT_FILENO, &outInfo) == 0 && S_ISREG(outInfo.st_mode);
+    for(int i = inputCommand->argsNum == 1 ? 0 : 1; i < inputCommand->argsNum; i++) {
+        const char *name = i == 0 ? "-" : inputCommand->args[i];
+        int in = STDIN_FILENO;
+        if(strcmp(name, "-") != 0 && (in = open(name, O_RDONLY | O_CLOEXEC)) == -1) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            lastStatus = 1;
+            continue;
+        }
+
+        struct stat inInfo;
+        int result = 0;
+        if(regularOutput && fstat(in, &inInfo) == 0 && inInfo.st_dev == outInfo.st_dev && inInfo.st_ino == outInfo.st_ino) {
+            fprintf(stderr, "cat: %s: input file is output file\n", name);
+            lastStatus = 1;
+        } else if((result = copyFD(in, STDOUT_FILENO, "cat")) == -1) {
+            lastStatus = 1;
+        }
+        if(in != STDIN_FILENO) {
+            close(in);
+        }
+        if(result == COPY_INTERRUPTED) {
+            reportInterrupt();
+            return;
+        }
+    }
+}
+
+/*
+ *  Copy stdin to stdout and to each file: tee [-a] [file...]
+ *  When stdin is a pipe, each round duplicates the pipe's data with tee(2) into a private pipe
+ *  per extra output, then splices the data itself to the last output and the private pipes to
+ *  the others, so nothing passes through a userspace buffer.
+ */
+void teeFiles() {
+    int outputs[MAX_TEE_OUTPUTS];
+    int outputsNum = 0;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    for(int i = 1; i < inputCommand->argsNum; i++) {
+        if(isOption(inputCommand->args[i])) {
+            flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        }
+    }
+
+    fflush(stdout);
+    outputs[outputsNum++] = STDOUT_FILENO;
+    for(int i = 1; i < inputCommand->argsNum && outputsNum < MAX_TEE_OUTPUTS; i++) {
+        if(isOption(inputCommand->args[i])) {
+            continue;
+        }
+        int out = open(inputCommand->args[i], flags, 0644);
+        if(out == -1) {
+            fprintf(stderr, "tee: %s: %s\n", inputCommand->args[i], strerror(errno));
+            lastStatus = 1;
+            continue;
+        }
+        outputs[outputsNum++] = out;
+    }
+
+    syncReadBuffer(STDIN_FILENO);
+    struct stat inInfo;
+    bool spliced = fstat(STDIN_FILENO, &inInfo) == 0 && S_ISFIFO(inInfo.st_mode);
+    int privatePipes[MAX_TEE_OUTPUTS][2];
+    int pipesNum = 0;
+    while(spliced && pipesNum < outputsNum - 1) {
+        if(pipe2(privatePipes[pipesNum], O_CLOEXEC) == -1) {
+            spliced = false;
+            break;
+        }
+        pipesNum++;
+    }
+
+    while(spliced) {
+        // Duplicate what is in the pipe for every output but the last one
+        ssize_t length = COPY_CHUNK;
+        for(int i = 0; i < outputsNum - 1; i++) {
+            length = tee(STDIN_FILENO, privatePipes[i][1], length, 0);
+            if(length <= 0) {
+                break;
+            }
+        }
+        if(outputsNum == 1) {
+            length = splice(STDIN_FILENO, NULL, outputs[0], NULL, COPY_CHUNK, SPLICE_F_MOVE);
+            if(length > 0) {
+                continue;
+            }
+        } else if(length > 0) {
+            // The last output consumes the data; the others drain their private pipes
+            if(movePipe(STDIN_FILENO, outputs[outputsNum - 1], length) == -1) {
+                lastStatus = 1;
+                break;
+            }
+            for(int i = 0; i < outputsNum - 1; i++) {
+                if(movePipe(privatePipes[i][0], outputs[i], length) == -1) {
+                    lastStatus = 1;
+                }
+            }
+            continue;
+        }
+        if(length == -1 && errno == EINTR) {
+            continue;
+        }
+        // Fall back to a buffer only if the kernel refused before any data moved
+        if(length == -1 && errno == EINVAL) {
+            spliced = false;
+        }
+        break;
+    }
+
+    if(!spliced) {
+        char *buffer = malloc(COPY_CHUNK);
+        ssize_t bytesRead;
+        while((bytesRead = read(STDIN_FILENO, buffer, COPY_CHUNK)) > 0 || (bytesRead == -1 && errno == EINTR)) {
+            for(int i = 0; i < outputsNum && bytesRead > 0; i++) {
+                if(writeAll(outputs[i], buffer, bytesRead) == -1) {
+                    lastStatus = 1;
+                }
+            }
+        }
+        free(buffer);
+    }
+
+    for(int i = 0; i < pipesNum; i++) {
+        close(privatePipes[i][0]);
+        close(privatePipes[i][1]);
+    }
+    for(int i = 1; i < outputsNum; i++) {
+        close(outputs[i]);
+    }
+}
+
+/*
+ *  Copy everything from in to out, stopping at SIGINT like the external command this replaces.
+ *  Returns 0 when done, -1 on error, reported as coming from name, or COPY_INTERRUPTED.
+ */
+int copyFD(int in, int out, const char *name) {
+    sigset_t oldMask;
+    blockInterrupt(&oldMask);
+    int result = copyData(in, out, name);
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    return result;
+}
+
+/*
+ *  Copy everything from in to out inside the kernel when possible: copy_file_range between
+ *  files, splice when either end is a pipe, sendfile from a file, and a buffer otherwise.
+ *  Each method falls through to the next if the kernel does not support it for these fds.
+ *  SIGINT, blocked by copyFD(), is checked before each chunk, and input that may block is
+ *  waited for in the event loop so the wait can be interrupted.
+ */
+int copyData(int in, int out, const char *name) {
+    struct stat inInfo, outInfo;
+    if(fstat(in, &inInfo) == -1 || fstat(out, &outInfo) == -1) {
+        perror(name);
+        return -1;
+    }
+    if(in < MAX_READ_FDS) {
+        syncReadBuffer(in);
+    }
+    ssize_t copied = 0;
+    bool interrupted = false;
+
+    // Files like those in /proc report no size and read as empty through the kernel paths,
+    // and copy_file_range refuses outputs opened for appending
+    bool regularInput = S_ISREG(inInfo.st_mode) && inInfo.st_size > 0;
+    if(regularInput && S_ISREG(outInfo.st_mode) && !(fcntl(out, F_GETFL) & O_APPEND)) {
+        while(!(interrupted = waitInterrupted(in)) && ((copied = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0 || (copied == -1 && errno == EINTR))) {
+        }
+        if(interrupted) {
+            return COPY_INTERRUPTED;
+        }
+        if(copied == 0) {
+            return 0;
+        }
+    }
+    if(copied == -1 && errno != EINVAL && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP) {
+        perror(name);
+        return -1;
+    }
+
+    if(S_ISFIFO(inInfo.st_mode) || S_ISFIFO(outInfo.st_mode)) {
+        while(!(interrupted = waitInterrupted(in)) && ((copied = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE)) > 0 || (copied == -1 && errno == EINTR))) {
+        }
+        if(interrupted) {
+            return COPY_INTERRUPTED;
+        }
+        if(copied == 0) {
+            return 0;
+        }
+    } else if(regularInput) {
+        while(!(interrupted = waitInterrupted(in)) && ((copied = sendfile(out, in, NULL, COPY_CHUNK)) > 0 || (copied == -1 && errno == EINTR))) {
+        }
+        if(interrupted) {
+            return COPY_INTERRUPTED;
+        }
+        if(copied == 0) {
+            return 0;
+        }
+    }
+    if(copied == -1 && errno != EINVAL && errno != ENOSYS) {
+        perror(name);
+        return -1;
+    }
+
+    char *buffer = malloc(COPY_CHUNK);
+    ssize_t bytesRead = 0;
+    int result = 0;
+    while(!(interrupted = waitInterrupted(in)) && ((bytesRead = read(in, buffer, COPY_CHUNK)) > 0 || (bytesRead == -1 && errno == EINTR))) {
+        if(bytesRead > 0 && writeAll(out, buffer, bytesRead) == -1) {
+            result = -1;
+            break;
+        }
+    }
+    if(interrupted) {
+        result = COPY_INTERRUPTED;
+    } else if(bytesRead == -1) {
+        perror(name);
+        result = -1;
+    }
+    free(buffer);
+    return result;
+}
+
+/*
+ *  Move length bytes from a pipe to fd with splice, or through a buffer if fd does not support it.
+ *  Returns -1 on error.
+ */
+int movePipe(int pipeFD, int fd, size_t length) {
+    while(length > 0) {
+        ssize_t moved = splice(pipeFD, NULL, fd, NULL, length, SPLICE_F_MOVE);
+        if(moved == -1 && errno == EINVAL) {
+            char buffer[65536];
+            moved = read(pipeFD, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+            if(moved > 0 && writeAll(fd, buffer, moved) == -1) {
+                return -1;
+            }
+        }
+        if(moved == -1 && errno == EINTR) {
+            continue;
+        }
+        if(moved <= 0) {
+            perror("tee");
+            return -1;
+        }
+        length -= moved;
+    }
+    return 0;
+}
+
+/*
+ *  Write all of data to fd. Returns -1 on error.
+ */
+int writeAll(int fd, const char *data, size_t length) {
+    while(length > 0) {
+        ssize_t written = write(fd, data, length);
+        if(written == -1 && errno == EINTR) {
+            continue;
+        }
+        if(written == -1) {
+            perror("write");
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/*
+ *  Block SIGINT so it can be read from interruptFD, saving the old mask in oldMask.
+ */
+void blockInterrupt(sigset_t *oldMask) {
+    sigset_t interruptMask;
+    sigemptyset(&interruptMask);
+    sigaddset(&interruptMask, SIGINT);
+    sigprocmask(SIG_BLOCK, &interruptMask, oldMask);
+    if(interruptFD == -1) {
+        interruptFD = shellFD(signalfd(-1, &interruptMask, SFD_NONBLOCK | SFD_CLOEXEC));
+    }
+}
+
+/*
+ *  Wait in the event loop until fd has input, with SIGINT blocked by blockInterrupt().
+ *  Regular files and devices epoll cannot watch are always ready, so for them this only
+ *  checks for a pending SIGINT. Returns true if SIGINT arrived.
+ */
+bool waitInterrupted(int fd) {
+    int fds[2] = {fd, interruptFD};
+    while(waitEvents(fds, 2) == -1) {
+    }
+    return takeInterrupt();
+}
+
+/*
+ *  Report a builtin stopped by SIGINT like the foreground process it replaces: on the shell's
+ *  own stdout after the builtin's redirections, or, in a child that would have died of SIGINT,
+ *  by dying of it.
+ */
+void reportInterrupt() {
+    struct sigaction action;
+    sigaction(SIGINT, NULL, &action);
+    if(action.sa_handler == SIG_DFL) {
+        fflush(stdout);
+        raise(SIGINT);
+    }
+    childStatus = SIGINT;
+    childSkipped = false;
+    lastStatus = statusCode(childStatus);
+    builtinInterrupted = true;
+}
+
+/*
+ *  Check whether commands started now would run in the C locale, going by the exported
+ *  LC_ALL, LC_CTYPE and LANG in that order.
+ */
+bool isSingleByteLocale() {
+    const char *names[] = {"LC_ALL", "LC_CTYPE", "LANG"};
+    for(int i = 0; i < 3; i++) {
+        struct shellVar *var = lookupVar(names[i], strlen(names[i]));
+        if(var != NULL && var->exported && var->value[0] != '\0') {
+            return strcmp(var->value, "C") == 0 || strcmp(var->value, "POSIX") == 0;
+        }
+    }
+    return true;
+}
+
+/*
+ *  Count lines, words and bytes of files, or stdin for none or "-": wc [-lwc] [file...]
+ *  The output matches coreutils wc, including its column widths and the total line.
+ */
+void countFiles() {
+    int counts = 0;
+    int filesNum = 0;
+    for(int i = 1; i < inputCommand->argsNum; i++) {
+        if(!isOption(inputCommand->args[i])) {
+            filesNum++;
+            continue;
+        }
+        for(const char *c = inputCommand->args[i] + 1; *c != '\0'; c++) {
+            counts |= *c == 'l' ? COUNT_LINES : *c == 'w' ? COUNT_WORDS : COUNT_BYTES;
+        }
+    }
+    if(counts == 0) {
+        counts = COUNT_LINES | COUNT_WORDS | COUNT_BYTES;
+    }
+
+    fflush(stdout);
+    int width = countNumberWidth(filesNum, counts);
+    struct wordCount total = {0, 0, 0, false};
+    sigset_t oldMask;
+    blockInterrupt(&oldMask);
+    for(int i = filesNum == 0 ? 0 : 1; i < inputCommand->argsNum; i++) {
+        const char *name = i == 0 ? NULL : inputCommand->args[i];
+        if(name != NULL && isOption(name)) {
+            continue;
+        }
+
+        int fd = STDIN_FILENO;
+        if(name != NULL && strcmp(name, "-") != 0) {
+            fd = open(name, O_RDONLY | O_CLOEXEC);
+            if(fd == -1) {
+                fflush(stdout);
+                fprintf(stderr, "wc: %s: %s\n", name, strerror(errno));
+                lastStatus = 1;
+                continue;
+            }
+        }
+        struct wordCount count = {0, 0, 0, false};
+        int result = countFD(fd, counts, &count);
+        if(result == -1) {
+            fflush(stdout);
+            fprintf(stderr, "wc: %s: %s\n", name != NULL ? name : "'standard input'", strerror(errno));
+            lastStatus = 1;
+        }
+        if(fd != STDIN_FILENO) {
+            close(fd);
+        }
+        if(result == COPY_INTERRUPTED) {
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+            reportInterrupt();
+            return;
+        }
+        printCounts(&count, counts, width, name);
+        total.lines += count.lines;
+        total.words += count.words;
+        total.bytes += count.bytes;
+        if(filesNum == 0) {
+            break;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    if(filesNum > 1) {
+        printCounts(&total, counts, width, "total");
+    }
+    fflush(stdout);
+}
+
+/*
+ *  Count an fd's input from its current offset to the end. Regular files are mapped, or
+ *  only measured when just the byte count is wanted; anything else is read in large chunks.
+ *  SIGINT, blocked by countFiles(), is checked between chunks. Returns -1 with errno set on a
+ *  read error, or COPY_INTERRUPTED.
+ */
+int countFD(int fd, int counts, struct wordCount *total) {
+    if(fd < MAX_READ_FDS) {
+        syncReadBuffer(fd);
+    }
+
+    struct stat info;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && offset >= 0 && offset <= info.st_size) {
+        if(counts == COUNT_BYTES) {
+            total->bytes = info.st_size - offset;
+            lseek(fd, info.st_size, SEEK_SET);
+            return 0;
+        }
+        unsigned char *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED) {
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+            bool interrupted = false;
+            for(off_t start = offset; start < info.st_size && !(interrupted = takeInterrupt()); start += COPY_CHUNK) {
+                countBlock(data + start, info.st_size - start < COPY_CHUNK ? info.st_size - start : COPY_CHUNK, total);
+            }
+            munmap(data, info.st_size);
+            lseek(fd, info.st_size, SEEK_SET);
+            return interrupted ? COPY_INTERRUPTED : 0;
+        }
+    }
+
+    unsigned char *buffer = malloc(COPY_CHUNK);
+    ssize_t bytesRead = 0;
+    bool interrupted = false;
+    while(!(interrupted = waitInterrupted(fd)) && ((bytesRead = read(fd, buffer, COPY_CHUNK)) > 0 || (bytesRead == -1 && errno == EINTR))) {
+        if(bytesRead > 0) {
+            countBlock(buffer, bytesRead, total);
+        }
+    }
+    int readError = errno;
+    free(buffer);
+    errno = readError;
+    return interrupted ? COPY_INTERRUPTED : bytesRead == -1 ? -1 : 0;
+}
+
+/*
+ *  Work out the column width coreutils wc would use: wide enough for the combined size of the
+ *  regular files, and at least 7 if any input is not a regular file. A single count for a
+ *  single input gets no padding.
+ */
+int countNumberWidth(int filesNum, int counts) {
+    int countsNum = ((counts & COUNT_LINES) != 0) + ((counts & COUNT_WORDS) != 0) + ((counts & COUNT_BYTES) != 0);
+    if(filesNum <= 1 && countsNum == 1) {
+        return 1;
+    }
+
+    int minimum = 1;
+    uint64_t regularTotal = 0;
+    for(int i = filesNum == 0 ? 0 : 1; i < inputCommand->argsNum; i++) {
+        const char *name = i == 0 ? "-" : inputCommand->args[i];
+        if(i > 0 && isOption(name)) {
+            continue;
+        }
+        struct stat info;
+        if((strcmp(name, "-") == 0 ? fstat(STDIN_FILENO, &info) : stat(name, &info)) == -1) {
+            continue;
+        }
+        if(S_ISREG(info.st_mode)) {
+            regularTotal += info.st_size;
+        } else {
+            minimum = 7;
+        }
+        if(filesNum == 0) {
+            break;
+        }
+    }
+
+    int width = 1;
+    for(; regularTotal >= 10; regularTotal /= 10) {
+        width++;
+    }
+    return width < minimum ? minimum : width;
+}
+
+/*
+ *  Print one line of wc output, followed by the name unless it is NULL.
+ */
+void printCounts(const struct wordCount *total, int counts, int width, const char *name) {
+    const char *separator = "";
+    if(counts & COUNT_LINES) {
+        printf("%s%*llu", separator, width, (unsigned long long)total->lines);
+        separator = " ";
+    }
+    if(counts & COUNT_WORDS) {
+        printf("%s%*llu", separator, width, (unsigned long long)total->words);
+        separator = " ";
+    }
+    if(counts & COUNT_BYTES) {
+        printf("%s%*llu", separator, width, (unsigned long long)total->bytes);
+    }
+    if(name != NULL) {
+        printf(" %s", name);
+    }
+    printf("\n");
+}
+
+/*
+ *  Count a block of input with the fastest kernel this CPU supports, chosen on first use.
+ */
+void countBlock(const unsigned char *data, size_t length, struct wordCount *total) {
+    if(countKernel == NULL) {
+        countKernel = countScalar;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+            countKernel = countAVX2;
+        } else if(__builtin_cpu_supports("sse2")) {
+            countKernel = countSSE2;
+        }
+#endif
+    }
+    total->bytes += length;
+    countKernel(data, length, total);
+}
+
+/*
+ *  Count lines and words one byte at a time. Spaces end words, printable characters start
+ *  them, and other bytes are skipped, as wc does in the C locale.
+ */
+void countScalar(const unsigned char *data, size_t length, struct wordCount *total) {
+    for(size_t i = 0; i < length; i++) {
+        unsigned char c = data[i];
+        if(c == ' ' || (c >= '\t' && c <= '\r')) {
+            total->lines += c == '\n';
+            total->inWord = false;
+        } else if(c > ' ' && c < 0x7f) {
+            total->words += !total->inWord;
+            total->inWord = true;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ *  Count lines and words 16 bytes at a time. Each block gives a bit mask of spaces and one of
+ *  printable characters; a word starts at each printable byte that follows a space. Blocks
+ *  holding bytes that are neither go to countScalar().
+ */
+__attribute__((target("sse2")))
+void countSSE2(const unsigned char *data, size_t length, struct wordCount *total) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i blank = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i controlSpaces = _mm_set1_epi8('\r' - '\t');
+    const __m128i bang = _mm_set1_epi8('!');
+    const __m128i graphs = _mm_set1_epi8('~' - '!');
+    size_t i = 0;
+    for(; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        // Unsigned range checks: low <= x <= high when min(x - low, high - low) == x - low
+        __m128i control = _mm_sub_epi8(bytes, tab);
+        __m128i graph = _mm_sub_epi8(bytes, bang);
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(bytes, blank),
+                                     _mm_cmpeq_epi8(_mm_min_epu8(control, controlSpaces), control));
+        graph = _mm_cmpeq_epi8(_mm_min_epu8(graph, graphs), graph);
+        uint32_t spaceMask = _mm_movemask_epi8(space);
+        uint32_t graphMask = _mm_movemask_epi8(graph);
+        if((spaceMask | graphMask) != 0xFFFF) {
+            countScalar(data + i, 16, total);
+            continue;
+        }
+        total->lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)));
+        total->words += __builtin_popcount(graphMask & ((spaceMask << 1) | !total->inWord));
+        total->inWord = graphMask >> 15;
+    }
+    countScalar(data + i, length - i, total);
+}
+
+/*
+ *  The same as countSSE2() with 32-byte blocks.
+ */
+__attribute__((target("avx2,popcnt")))
+void countAVX2(const unsigned char *data, size_t length, struct wordCount *total) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i blank = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i controlSpaces = _mm256_set1_epi8('\r' - '\t');
+    const __m256i bang = _mm256_set1_epi8('!');
+    const __m256i graphs = _mm256_set1_epi8('~' - '!');
+    size_t i = 0;
+    for(; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i control = _mm256_sub_epi8(bytes, tab);
+        __m256i graph = _mm256_sub_epi8(bytes, bang);
+        __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, blank),
+                                        _mm256_cmpeq_epi8(_mm256_min_epu8(control, controlSpaces), control));
+        graph = _mm256_cmpeq_epi8(_mm256_min_epu8(graph, graphs), graph);
+        uint32_t spaceMask = _mm256_movemask_epi8(space);
+        uint32_t graphMask = _mm256_movemask_epi8(graph);
+        if((spaceMask | graphMask) != 0xFFFFFFFF) {
+            countScalar(data + i, 32, total);
+            continue;
+        }
+        total->lines += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline)));
+        total->words += __builtin_popcount(graphMask & ((spaceMask << 1) | !total->inWord));
+        total->inWord = graphMask >> 31;
+    }
+    countScalar(data + i, length - i, total);
+}
+#endif
+
+/*
+ *  Return the CLOCK_MONOTONIC time in ns.
+ */
+uint64_t monotonicTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+/*
+ *  Move an fd the shell keeps for itself to 10 or above, as other shells do, clear of the fds
+ *  scripts open and close with exec and numbered redirections. Returns the new fd, or -1.
+ */
+int shellFD(int fd) {
+    if(fd == -1 || fd >= 10) {
+        return fd;
+    }
+    int highFD = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    close(fd);
+    return highFD;
+}
+
+/*
+ *  Return the epoll fd of the event loop, creating it with its job and schedule timers on first
+ *  use. A forked child drops the loop, virtual jobs and schedules it inherited, which are the
+ *  parent's to run.
+ */
+int getEventLoop() {
+    if(eventLoopPID == getpid()) {
+        return eventLoopFD;
+    }
+    if(eventLoopFD != -1) {
+        close(eventLoopFD);
+        close(jobTimerFD);
+        close(scheduleTimerFD);
+        clearSchedules();
+        for(int i = 0; i < MAX_PROCESSES; i++) {
+            if(jobTable[i].virtual) {
+                clearJob(&jobTable[i]);
+            }
+        }
+        clearLaunchQueue();
+        nextDeadline = 0;
+    }
+
+    eventLoopPID = getpid();
+    eventLoopFD = shellFD(epoll_create1(EPOLL_CLOEXEC));
+    jobTimerFD = shellFD(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    struct epoll_event event = {EPOLLIN, {.fd = jobTimerFD}};
+    epoll_ctl(eventLoopFD, EPOLL_CTL_ADD, jobTimerFD, &event);
+    // Schedules have a timer of their own, on a clock that counts time suspended
+    scheduleTimerFD = shellFD(timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC));
+    event.data.fd = scheduleTimerFD;
+    epoll_ctl(eventLoopFD, EPOLL_CTL_ADD, scheduleTimerFD, &event);
+    wheelTick = bootTime() / WHEEL_TICK;
+    return eventLoopFD;
+}
+
+/*
+ *  Arm the job timer for the earliest deadline of a running virtual job, or disarm it.
+ */
+void armJobTimer() {
+    getEventLoop();
+    nextDeadline = 0;
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        struct job *job = &jobTable[i];
+        if(job->virtual && !job->done && job->deadline != 0 && (nextDeadline == 0 || job->deadline < nextDeadline)) {
+            nextDeadline = job->deadline;
+        }
+    }
+    uint64_t launchTime = nextLaunchTime();
+    if(launchTime != 0 && (nextDeadline == 0 || launchTime < nextDeadline)) {
+        nextDeadline = launchTime;
+    }
+    struct itimerspec when = {{0, 0}, {nextDeadline / NS_PER_SECOND, nextDeadline % NS_PER_SECOND}};
+    timerfd_settime(jobTimerFD, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+/*
+ *  Finish the virtual jobs whose deadline has passed, announcing them like background processes,
+ *  and start queued launches that have a token.
+ */
+void runJobTimers() {
+    uint64_t expirations;
+    getEventLoop();
+    read(jobTimerFD, &expirations, sizeof(expirations));
+    uint64_t now = monotonicTime();
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        struct job *job = &jobTable[i];
+        if(!job->virtual || job->done || job->deadline == 0 || job->deadline > now) {
+            continue;
+        }
+        job->deadline = 0;
+        if(job->retry != NULL) {
+            restartRetryJob(i);
+            continue;
+        }
+        job->status = 0;
+        job->done = true;
+        printf("Background child PID %d is done with exit status %d\n", job->pid, WEXITSTATUS(job->status));
+        fflush(stdout);
+    }
+    runLaunchQueue();
+    armJobTimer();
+}
+
+/*
+ *  Wait in the event loop until one of fds is readable, running job timers as they fire.
+ *  Returns the readable fd, or -1 when the wait ended for something else: timers that ran, or
+ *  a signal. An fd epoll cannot watch, like a regular file, is always readable; any other
+ *  failure to watch an fd, like one that was closed, is reported and returns WAIT_ERROR.
+ */
+int waitEvents(const int *fds, int fdsNum) {
+    int loop = getEventLoop();
+    for(int i = 0; i < fdsNum; i++) {
+        struct epoll_event event = {EPOLLIN, {.fd = fds[i]}};
+        if(epoll_ctl(loop, EPOLL_CTL_ADD, fds[i], &event) == -1) {
+            int error = errno;
+            for(int j = 0; j < i; j++) {
+                epoll_ctl(loop, EPOLL_CTL_DEL, fds[j], NULL);
+            }
+            if(error == EPERM) {
+                return fds[i];
+            }
+            fprintf(stderr, "smallsh: cannot wait on fd %d: %s\n", fds[i], strerror(error));
+            return WAIT_ERROR;
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int eventsNum = epoll_wait(loop, events, MAX_EVENTS, -1);
+    int ready = -1;
+    for(int i = 0; i < eventsNum; i++) {
+        if(events[i].data.fd == jobTimerFD) {
+            runJobTimers();
+        } else if(events[i].data.fd == scheduleTimerFD) {
+            runSchedules();
+        } else if(ready == -1) {
+            ready = events[i].data.fd;
+        }
+    }
+
+    for(int i = 0; i < fdsNum; i++) {
+        epoll_ctl(loop, EPOLL_CTL_DEL, fds[i], NULL);
+    }
+    return ready;
+}
+
+/*
+ *  Consume any SIGINT that arrived while blocked. Returns true if there was one.
+ */
+bool takeInterrupt() {
+    struct signalfd_siginfo info;
+    bool interrupted = false;
+    while(read(interruptFD, &info, sizeof(info)) == sizeof(info)) {
+        interrupted = true;
+    }
+    return interrupted;
+}
+
+/*
+ *  Add up sleep durations: numbers, possibly fractional, with an optional s, m, h or d suffix.
+ *  Returns false for anything else, so the external sleep can report it.
+ */
+bool parseDuration(char *const *args, int argsNum, uint64_t *duration) {
+    double seconds = 0;
+    for(int i = 0; i < argsNum; i++) {
+        char *end;
+        double value = strtod(args[i], &end);
+        if(end == args[i] || !(value >= 0)) {
+            return false;
+        }
+        if(*end == 'm') {
+            value *= 60;
+        } else if(*end == 'h') {
+            value *= 60 * 60;
+        } else if(*end == 'd') {
+            value *= 24 * 60 * 60;
+        } else if(*end != 's' && *end != '\0') {
+            return false;
+        }
+        if(*end != '\0' && end[1] != '\0') {
+            return false;
+        }
+        seconds += value;
+    }
+    // Past a century the external sleep, which knows infinity, can take over
+    if(argsNum == 0 || seconds > 100.0 * 365 * 24 * 60 * 60) {
+        return false;
+    }
+    *duration = seconds * NS_PER_SECOND;
+    return true;
+}
+
+/*
+ *  Sleep for the given durations: sleep number[smhd]...
+ *  In the foreground the shell waits on a timerfd, and SIGINT ends the wait as it would end
+ *  the external sleep. In the background the sleep becomes a virtual job.
+ */
+void sleepFor() {
+    uint64_t duration;
+    parseDuration(inputCommand->args + 1, inputCommand->argsNum - 1, &duration);
+    if(inputCommand->background && !foregroundModeOnly) {
+        // A virtual job takes its turn under set launchrate like a process
+        if(!takeLaunchToken(false)) {
+            deferLaunch(inputCommand->args, NULL);
+            return;
+        }
+        startSleepJob(duration);
+        return;
+    }
+
+    // Report the sleep like the foreground process it replaces
+    if(waitFor(duration)) {
+        reportInterrupt();
+        return;
+    }
+    childStatus = 0;
+    childSkipped = false;
+    lastStatus = 0;
+}
+
+/*
+ *  Wait in the event loop for duration ns, on a timerfd. Returns true if SIGINT ended the wait.
+ */
+bool waitFor(uint64_t duration) {
+    // A zero it_value would disarm the timer
+    int sleepFD = shellFD(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    duration = duration > 0 ? duration : 1;
+    struct itimerspec when = {{0, 0}, {duration / NS_PER_SECOND, duration % NS_PER_SECOND}};
+    timerfd_settime(sleepFD, 0, &when, NULL);
+
+    sigset_t interruptMask, oldMask;
+    sigemptyset(&interruptMask);
+    sigaddset(&interruptMask, SIGINT);
+    sigprocmask(SIG_BLOCK, &interruptMask, &oldMask);
+    if(interruptFD == -1) {
+        interruptFD = shellFD(signalfd(-1, &interruptMask, SFD_NONBLOCK | SFD_CLOEXEC));
+    }
+
+    fflush(stdout);
+    int fds[2] = {sleepFD, interruptFD};
+    int ready;
+    while((ready = waitEvents(fds, 2)) != sleepFD && ready != interruptFD && ready != WAIT_ERROR) {
+    }
+    close(sleepFD);
+
+    bool interrupted = takeInterrupt();
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    return interrupted;
+}
+
+/*
+ *  Start sleep & as a virtual job: an entry in the job table with a timer and no process.
+ */
+void startSleepJob(uint64_t duration) {
+    sigset_t oldMask = blockChildSignal();
+    pid_t pid = nextVirtualPID++;
+    int number = addJob(pid, joinArgs(inputCommand->args), false);
+    if(number == 0) {
+        fprintf(stderr, "smallsh: sleep: job table full\n");
+        lastStatus = 1;
+    } else {
+        jobTable[number - 1].virtual = true;
+        jobTable[number - 1].deadline = monotonicTime() + duration;
+        armJobTimer();
+        printf("Background child PID %d is starting\n", pid);
+        fflush(stdout);
+    }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+}
+
+/*
+ *  Find a job by %number or by process id. Returns its slot, or -1.
+ */
+int findJob(const char *spec) {
+    char *end;
+    long number = strtol(spec + (spec[0] == '%'), &end, 10);
+    if(end == spec + (spec[0] == '%') || *end != '\0') {
+        return -1;
+    }
+    if(spec[0] == '%') {
+        return number >= 1 && number <= MAX_PROCESSES && jobTable[number - 1].pid != 0 ? number - 1 : -1;
+    }
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        if(jobTable[i].pid != 0 && jobTable[i].pid == number) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  Wait for jobs to finish: wait [%number|pid...]
+ *  With no arguments, waits for every background job, including launches still queued by
+ *  set launchrate, and succeeds; otherwise the status is that
+ *  of the last job named. Processes are watched through pidfds and virtual jobs through the job
+ *  timer, all in one epoll_wait; SIGCHLD is held so children are collected here as their
+ *  pidfds become readable. SIGINT stops the wait.
+ */
+void waitJobs() {
+    int slots[MAX_PROCESSES];
+    // pidfd and pid each slot is watched with, indexed by slot, since with no arguments queued
+    // launches that start during the wait join it
+    int pidFDs[MAX_PROCESSES];
+    pid_t watched[MAX_PROCESSES] = {0};
+    int slotsNum = 0;
+    int status = 0;
+    bool waitAll = inputCommand->argsNum == 1;
+    for(int i = 1; i < inputCommand->argsNum; i++) {
+        int slot = findJob(inputCommand->args[i]);
+        if(slot == -1) {
+            fprintf(stderr, "smallsh: wait: %s: no such job\n", inputCommand->args[i]);
+            status = 127;
+        } else if(slotsNum < MAX_PROCESSES) {
+            slots[slotsNum++] = slot;
+        }
+    }
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        pidFDs[i] = -1;
+    }
+
+    sigset_t waitMask, oldMask;
+    sigemptyset(&waitMask);
+    sigaddset(&waitMask, SIGINT);
+    sigaddset(&waitMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &waitMask, &oldMask);
+    if(interruptFD == -1) {
+        sigdelset(&waitMask, SIGCHLD);
+        interruptFD = shellFD(signalfd(-1, &waitMask, SFD_NONBLOCK | SFD_CLOEXEC));
+    }
+
+    bool interrupted = false;
+    while(!interrupted) {
+        if(waitAll) {
+            slotsNum = 0;
+            for(int i = 0; i < MAX_PROCESSES; i++) {
+                if(jobTable[i].pid != 0 && !jobTable[i].done && !jobTable[i].substitution) {
+                    slots[slotsNum++] = i;
+                }
+            }
+        }
+
+        // Watch the pidfds of the jobs still running
+        int fds[MAX_PROCESSES + 1];
+        int fdsNum = 0;
+        bool running = waitAll && launchQueue != NULL;
+        fds[fdsNum++] = interruptFD;
+        for(int i = 0; i < slotsNum; i++) {
+            struct job *job = &jobTable[slots[i]];
+            if(watched[slots[i]] != job->pid) {
+                if(pidFDs[slots[i]] != -1) {
+                    close(pidFDs[slots[i]]);
+                }
+                watched[slots[i]] = job->pid;
+                pidFDs[slots[i]] = job->virtual || job->done ? -1 : shellFD(syscall(SYS_pidfd_open, job->pid, 0));
+            }
+            if((job->done || job->virtual) && pidFDs[slots[i]] != -1) {
+                close(pidFDs[slots[i]]);
+                pidFDs[slots[i]] = -1;
+            }
+            running = running || !job->done;
+            if(pidFDs[slots[i]] != -1) {
+                fds[fdsNum++] = pidFDs[slots[i]];
+            }
+        }
+        if(!running) {
+            break;
+        }
+
+        int ready = waitEvents(fds, fdsNum);
+        if(ready == WAIT_ERROR) {
+            status = 1;
+            break;
+        } else if(ready == interruptFD) {
+            interrupted = takeInterrupt();
+        } else if(ready != -1) {
+            SIGCHLDHandler(SIGCHLD);
+        }
+    }
+
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        if(pidFDs[i] != -1) {
+            close(pidFDs[i]);
+        }
+    }
+    takeInterrupt();
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+    if(interrupted) {
+        lastStatus = 128 + SIGINT;
+    } else if(inputCommand->argsNum > 1 && slotsNum > 0 && status == 0) {
+        lastStatus = statusCode(jobTable[slots[slotsNum - 1]].status);
+    } else {
+        lastStatus = status;
+    }
+}
+
+/*
+ *  Parse a CPU list like 0-7,12,14-15 into cpus. Returns false if it is malformed.
+ */
+bool parseCPUList(const char *text, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    while(true) {
+        char *end;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if(end == text || first < 0) {
+            return false;
+        }
+        if(*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if(end == text || last < first) {
+                return false;
+            }
+        }
+        if(last >= CPU_SETSIZE) {
+            return false;
+        }
+        for(long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        if(*end == '\0' || *end == '\n') {
+            return true;
+        }
+        if(*end != ',') {
+            return false;
+        }
+        text = end + 1;
+    }
+}
+
+/*
+ *  Read which NUMA node each CPU is on from sysfs, and the CPUs the shell may run on.
+ *  Without NUMA information every CPU is on node 0.
+ */
+void readTopology() {
+    if(topologyRead) {
+        return;
+    }
+    topologyRead = true;
+    if(sched_getaffinity(0, sizeof(shellCPUs), &shellCPUs) == -1) {
+        CPU_ZERO(&shellCPUs);
+    }
+    memset(cpuNodes, 0, sizeof(cpuNodes));
+
+    DIR *nodes = opendir("/sys/devices/system/node");
+    struct dirent *entry;
+    while(nodes != NULL && (entry = readdir(nodes)) != NULL) {
+        char *end;
+        long node = strtol(entry->d_name + 4, &end, 10);
+        if(strncmp(entry->d_name, "node", 4) != 0 || end == entry->d_name + 4 || *end != '\0' || node >= MAX_NODES) {
+            continue;
+        }
+        char path[300];
+        char list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t length = fd == -1 ? -1 : read(fd, list, sizeof(list) - 1);
+        if(fd != -1) {
+            close(fd);
+        }
+        cpu_set_t cpus;
+        if(length <= 0) {
+            continue;
+        }
+        list[length] = '\0';
+        if(parseCPUList(list, &cpus)) {
+            for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if(CPU_ISSET(cpu, &cpus)) {
+                    cpuNodes[cpu] = node;
+                }
+            }
+        }
+    }
+    if(nodes != NULL) {
+        closedir(nodes);
+    }
+}
+
+/*
+ *  Decide where the next command runs: where pin asked, or for a background job, on a core
+ *  no other running job holds, picked by the jobplacement policy:
+ *  spread takes a core on the node with the most free cores, pack the lowest free core, and
+ *  numa does as spread and also binds the job's memory to that node.
+ *  Returns false to leave the command where the shell runs. SIGCHLD must be blocked.
+ */
+bool choosePlacement(struct placement *placement, bool background) {
+    if(pinRequest != NULL) {
+        *placement = *pinRequest;
+        return true;
+    }
+    if(!background || jobPlacement == PLACE_NONE) {
+        return false;
+    }
+
+    readTopology();
+    cpu_set_t used;
+    CPU_ZERO(&used);
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        if(jobTable[i].placed && !jobTable[i].done) {
+            CPU_OR(&used, &used, &jobTable[i].cpus);
+        }
+    }
+
+    int freeCPUs[MAX_NODES] = {0};
+    int chosen = -1;
+    for(int cpu = 0; cpu < CPU_SETSIZE && chosen == -1; cpu++) {
+        if(CPU_ISSET(cpu, &shellCPUs) && !CPU_ISSET(cpu, &used)) {
+            freeCPUs[cpuNodes[cpu]]++;
+            if(jobPlacement == PLACE_PACK) {
+                chosen = cpu;
+            }
+        }
+    }
+    if(chosen == -1) {
+        int bestNode = 0;
+        for(int node = 1; node < MAX_NODES; node++) {
+            if(freeCPUs[node] > freeCPUs[bestNode]) {
+                bestNode = node;
+            }
+        }
+        for(int cpu = 0; cpu < CPU_SETSIZE && chosen == -1 && freeCPUs[bestNode] > 0; cpu++) {
+            if(CPU_ISSET(cpu, &shellCPUs) && !CPU_ISSET(cpu, &used) && cpuNodes[cpu] == bestNode) {
+                chosen = cpu;
+            }
+        }
+    }
+    // With every core taken, the job shares the shell's CPUs rather than another job's core
+    if(chosen == -1) {
+        return false;
+    }
+
+    CPU_ZERO(&placement->cpus);
+    CPU_SET(chosen, &placement->cpus);
+    placement->node = jobPlacement == PLACE_NUMA ? cpuNodes[chosen] : -1;
+    return true;
+}
+
+/*
+ *  Move the calling process to a placement's CPUs and bind its memory to its node.
+ *  Returns -1 with errno set on failure.
+ */
+int applyPlacement(const struct placement *placement) {
+    if(CPU_COUNT(&placement->cpus) > 0 && sched_setaffinity(0, sizeof(placement->cpus), &placement->cpus) == -1) {
+        return -1;
+    }
+    if(placement->node >= 0) {
+        unsigned long nodeMask = 1UL << placement->node;
+        if(syscall(SYS_set_mempolicy, MPOL_BIND, &nodeMask, sizeof(nodeMask) * 8) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Note the CPUs of a new job, so they are not given to another job while it runs.
+ */
+void recordPlacement(int number, const struct placement *placement) {
+    if(number == 0 || placement == NULL) {
+        return;
+    }
+    jobTable[number - 1].placed = true;
+    jobTable[number - 1].cpus = placement->cpus;
+}
+
+/*
+ *  Run an external command on given CPUs and NUMA node: pin [cpus=list] [node=n] command
+ *  With only a node, the command may use all of that node's CPUs.
+ */
+void pinCommand() {
+    struct placement placement;
+    CPU_ZERO(&placement.cpus);
+    placement.node = -1;
+    int first = 1;
+    for(; first < inputCommand->argsNum; first++) {
+        char *arg = inputCommand->args[first];
+        char *end = NULL;
+        if(strncmp(arg, "cpus=", 5) == 0) {
+            if(!parseCPUList(arg + 5, &placement.cpus)) {
+                fprintf(stderr, "smallsh: pin: %s: bad CPU list\n", arg + 5);
+                lastStatus = 1;
+                return;
+            }
+        } else if(strncmp(arg, "node=", 5) == 0) {
+            placement.node = strtol(arg + 5, &end, 10);
+            if(end == arg + 5 || *end != '\0' || placement.node < 0 || placement.node >= MAX_NODES) {
+                fprintf(stderr, "smallsh: pin: %s: bad node\n", arg + 5);
+                lastStatus = 1;
+                return;
+            }
+        } else {
+            break;
+        }
+    }
+    if(first == inputCommand->argsNum || (CPU_COUNT(&placement.cpus) == 0 && placement.node == -1)) {
+        fprintf(stderr, "smallsh: pin: usage: pin [cpus=list] [node=n] command\n");
+        lastStatus = 2;
+        return;
+    }
+    if(CPU_COUNT(&placement.cpus) == 0) {
+        readTopology();
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if(CPU_ISSET(cpu, &shellCPUs) && cpuNodes[cpu] == placement.node) {
+                CPU_SET(cpu, &placement.cpus);
+            }
+        }
+    }
+
+    // Drop "pin" and its options and run the rest like exec would, but in a child
+    for(int i = 0; i < first; i++) {
+        free(inputCommand->args[i]);
+    }
+    memmove(inputCommand->args, inputCommand->args + first, (inputCommand->argsNum - first + 1) * sizeof(char *));
+    memmove(inputCommand->braces, inputCommand->braces + first, (inputCommand->argsNum - first) * sizeof(struct braceSeq *));
+    inputCommand->argsNum -= first;
+    pinRequest = &placement;
+    if(inputCommand->hasBraces) {
+        runBraceChunks(getEnvSnapshot());
+    } else {
+        runExternal(inputCommand->args, getEnvSnapshot());
+    }
+    pinRequest = NULL;
+}
+
+/*
+ *  Set shell options: set [name=value...]
+ *  With no arguments, prints the options and their values.
+ */
+void setOptions() {
+    if(inputCommand->argsNum == 1) {
+        printOptions();
+        return;
+    }
+    for(int i = 1; i < inputCommand->argsNum; i++) {
+        char *equals = strchr(inputCommand->args[i], '=');
+        // An on/off option can be turned on by its name alone
+        if(equals == NULL && strcmp(inputCommand->args[i], "incremental") == 0) {
+            setOption(inputCommand->args[i], "on");
+            continue;
+        }
+        if(equals == NULL) {
+            fprintf(stderr, "smallsh: set: %s: expected name=value\n", inputCommand->args[i]);
+            lastStatus = 1;
+            continue;
+        }
+        *equals = '\0';
+        if(!setOption(inputCommand->args[i], equals + 1)) {
+            lastStatus = 1;
+        }
+        *equals = '=';
+    }
+}
+
+/*
+ *  Set one shell option. Returns false, after saying why, for an unknown name or a bad value.
+ */
+bool setOption(const char *name, const char *value) {
+    char *end;
+    int number;
+    if(strcmp(name, "jobplacement") == 0) {
+        if((number = lookupName(value, placementNames, PLACE_NUMA + 1)) == -1) {
+            fprintf(stderr, "smallsh: set: %s: expected none, spread, pack or numa\n", value);
+            return false;
+        }
+        jobPlacement = number;
+    } else if(strcmp(name, "jobnice") == 0) {
+        number = strtol(value, &end, 10);
+        if(strcmp(value, "none") == 0) {
+            number = NICE_NONE;
+        } else if(end == value || *end != '\0' || number < -20 || number > 19) {
+            fprintf(stderr, "smallsh: set: %s: expected none or a nice level from -20 to 19\n", value);
+            return false;
+        }
+        jobNice = number;
+    } else if(strcmp(name, "jobioprio") == 0) {
+        // class or class:level, where idle has no levels and none turns it off
+        char className[8] = "";
+        int level = 4;
+        sscanf(value, "%7[a-z]", className);
+        const char *levelText = value + strlen(className);
+        number = lookupName(className, ioClassNames, 4);
+        if(*levelText == ':' && number != 0 && number != 3) {
+            level = strtol(levelText + 1, &end, 10);
+            levelText = end == levelText + 1 || level < 0 || level > 7 ? levelText : end;
+        }
+        if(number == -1 || *levelText != '\0') {
+            fprintf(stderr, "smallsh: set: %s: expected none, idle, be[:0-7] or rt[:0-7]\n", value);
+            return false;
+        }
+        jobIOClass = number;
+        jobIOLevel = number == 3 ? 0 : level;
+    } else if(strcmp(name, "launchrate") == 0) {
+        // n/s, n/m or a plain n per second; none or 0 lifts the limit
+        double rate = strtod(value, &end);
+        if(strcmp(value, "none") == 0) {
+            rate = 0;
+        } else if(end == value || !(rate >= 0) || (*end != '\0' && strcmp(end, "/s") != 0 && strcmp(end, "/m") != 0)) {
+            fprintf(stderr, "smallsh: set: %s: expected none or a rate like 200/s\n", value);
+            return false;
+        } else if(strcmp(end, "/m") == 0) {
+            rate /= 60;
+        }
+        if(launchRate == 0) {
+            launchTokens = launchBurst;
+        }
+        refillLaunchTokens(monotonicTime());
+        launchRate = rate;
+        armJobTimer();
+    } else if(strcmp(name, "burst") == 0) {
+        number = strtol(value, &end, 10);
+        if(end == value || *end != '\0' || number < 1) {
+            fprintf(stderr, "smallsh: set: %s: expected a burst of at least 1\n", value);
+            return false;
+        }
+        // A full bucket stays full, so the burst is there at once
+        refillLaunchTokens(monotonicTime());
+        launchTokens = launchRate == 0 || launchTokens >= launchBurst || launchTokens > number ? number : launchTokens;
+        launchBurst = number;
+    } else if(strcmp(name, "misfire") == 0) {
+        if((number = lookupName(value, misfireNames, 2)) == -1) {
+            fprintf(stderr, "smallsh: set: %s: expected once or skip\n", value);
+            return false;
+        }
+        misfirePolicy = number;
+    } else if(strcmp(name, "incremental") == 0) {
+        if(strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            fprintf(stderr, "smallsh: set: %s: expected on or off\n", value);
+            return false;
+        }
+        incremental = strcmp(value, "on") == 0;
+    } else if(strcmp(name, "cachesize") == 0) {
+        // Bytes, or with a K, M or G suffix
+        double size = strtod(value, &end);
+        int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+        if(end == value || !(size >= 0) || (*end != '\0' && (shift == 0 || end[1] != '\0'))) {
+            fprintf(stderr, "smallsh: set: %s: expected a size like 512M\n", value);
+            return false;
+        }
+        cacheSize = size * (1ULL << shift);
+    } else if(strcmp(name, "jobsched") == 0) {
+        if((number = lookupName(value, schedNames, 3)) == -1) {
+            fprintf(stderr, "smallsh: set: %s: expected other, batch or idle\n", value);
+            return false;
+        }
+        jobSched = number;
+    } else {
+        fprintf(stderr, "smallsh: set: %s: unknown option\n", name);
+        return false;
+    }
+    return true;
+}
+
+/*
+ *  Print the shell options as set would take them.
+ */
+void printOptions() {
+    printf("jobplacement=%s\n", placementNames[jobPlacement]);
+    if(jobNice == NICE_NONE) {
+        printf("jobnice=none\n");
+    } else {
+        printf("jobnice=%d\n", jobNice);
+    }
+    if(jobIOClass == 0 || jobIOClass == 3) {
+        printf("jobioprio=%s\n", ioClassNames[jobIOClass]);
+    } else {
+        printf("jobioprio=%s:%d\n", ioClassNames[jobIOClass], jobIOLevel);
+    }
+    printf("jobsched=%s\n", schedNames[jobSched]);
+    if(launchRate == 0) {
+        printf("launchrate=none\n");
+    } else {
+        printf("launchrate=%g/s\n", launchRate);
+    }
+    printf("burst=%d\n", launchBurst);
+    printf("cachesize=%llu\n", (unsigned long long)cacheSize);
+    printf("incremental=%s\n", incremental ? "on" : "off");
+    printf("misfire=%s\n", misfireNames[misfirePolicy]);
+    fflush(stdout);
+}
+
+/*
+ *  Find value in a list of names. Returns its index, or -1.
+ */
+int lookupName(const char *value, const char *names[], int namesNum) {
+    for(int i = 0; i < namesNum; i++) {
+        if(strcmp(value, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  Open a pipe for a background job to close once it has its priority, if set gives it one,
+ *  so a renice right after the job starts is not undone by the job. Otherwise both ends are -1.
+ */
+void openPrioritySync(int syncPipe[2]) {
+    syncPipe[0] = syncPipe[1] = -1;
+    if((jobNice != NICE_NONE || jobIOClass != 0 || jobSched != 0) && pipe2(syncPipe, O_CLOEXEC) == -1) {
+        syncPipe[0] = syncPipe[1] = -1;
+    }
+}
+
+/*
+ *  Give the calling background job the scheduling policy, nice level and I/O priority set
+ *  with set, then tell the shell by closing the sync pipe. Failures, like raising priority
+ *  without privilege, are reported and the job runs.
+ */
+void applyJobPriority(int syncPipe[2]) {
+    struct sched_param param = {0};
+    if(jobSched != 0 && sched_setscheduler(0, schedPolicies[jobSched], &param) == -1) {
+        perror("jobsched");
+    }
+    if(jobNice != NICE_NONE && setpriority(PRIO_PROCESS, 0, jobNice) == -1) {
+        perror("jobnice");
+    }
+    if(jobIOClass != 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, jobIOClass << IOPRIO_CLASS_SHIFT | jobIOLevel) == -1) {
+        perror("jobioprio");
+    }
+    if(syncPipe[0] != -1) {
+        close(syncPipe[0]);
+        close(syncPipe[1]);
+    }
+}
+
+/*
+ *  Wait until a new background job has closed its sync pipe, or exited.
+ */
+void waitPrioritySync(int syncPipe[2]) {
+    if(syncPipe[0] == -1) {
+        return;
+    }
+    close(syncPipe[1]);
+    char byte;
+    while(read(syncPipe[0], &byte, 1) == -1 && errno == EINTR) {
+    }
+    close(syncPipe[0]);
+}
+
+/*
+ *  Set the nice level of running jobs: renice [-n] level %job|pid...
+ */
+void reniceJobs() {
+    int first = inputCommand->argsNum > 1 && strcmp(inputCommand->args[1], "-n") == 0 ? 2 : 1;
+    char *end = NULL;
+    int level = first < inputCommand->argsNum ? strtol(inputCommand->args[first], &end, 10) : 0;
+    if(end == NULL || end == inputCommand->args[first] || *end != '\0') {
+        fprintf(stderr, "smallsh: renice: usage: renice [-n] level %%job|pid...\n");
+        lastStatus = 2;
+        return;
+    }
+
+    for(int i = first + 1; i < inputCommand->argsNum; i++) {
+        const char *target = inputCommand->args[i];
+        int slot = findJob(target);
+        pid_t pid = 0;
+        if(slot != -1 && !jobTable[slot].done) {
+            pid = jobTable[slot].pid;
+        } else if(target[0] != '%') {
+            pid = strtol(target, &end, 10);
+            pid = end != target && *end == '\0' ? pid : 0;
+        }
+        if(pid <= 0) {
+            fprintf(stderr, "smallsh: renice: %s: no such job\n", target);
+            lastStatus = 1;
+            continue;
+        }
+        if(slot != -1 && jobTable[slot].virtual) {
+            fprintf(stderr, "smallsh: renice: %s: job has no process\n", target);
+            lastStatus = 1;
+            continue;
+        }
+        errno = 0;
+        int oldLevel = getpriority(PRIO_PROCESS, pid);
+        if((oldLevel == -1 && errno != 0) || setpriority(PRIO_PROCESS, pid, level) == -1) {
+            fprintf(stderr, "smallsh: renice: failed to set priority for %d (process ID): %s\n", pid, strerror(errno));
+            lastStatus = 1;
+            continue;
+        }
+        printf("%d (process ID) old priority %d, new priority %d\n", pid, oldLevel, getpriority(PRIO_PROCESS, pid));
+    }
+    fflush(stdout);
+}
+
+/*
+ *  Add the tokens earned since the last refill, up to the burst size.
+ */
+void refillLaunchTokens(uint64_t now) {
+    if(launchRate > 0 && now > launchRefillTime) {
+        launchTokens += (now - launchRefillTime) * launchRate / NS_PER_SECOND;
+        launchTokens = launchTokens < launchBurst ? launchTokens : launchBurst;
+    }
+    launchRefillTime = now;
+}
+
+/*
+ *  Take a token for a background launch. Fails while earlier launches are queued, so launches
+ *  keep their order. A launch that must go now takes its token even if that leaves the bucket
+ *  in debt, which later launches pay off.
+ */
+bool takeLaunchToken(bool mustLaunch) {
+    if(launchingDeferred) {
+        return true;
+    }
+    if(launchRate > 0) {
+        getEventLoop();
+        refillLaunchTokens(monotonicTime());
+        if(!mustLaunch && (launchQueue != NULL || launchTokens < 1)) {
+            return false;
+        }
+        launchTokens -= 1;
+    }
+    recordLaunch();
+    return true;
+}
+
+/*
+ *  Note the time of a background launch.
+ */
+void recordLaunch() {
+    launchTimes[launchesNum % LAUNCH_HISTORY] = monotonicTime();
+    launchesNum++;
+}
+
+/*
+ *  Return when the next queued launch gets its token, or 0 with nothing queued.
+ */
+uint64_t nextLaunchTime() {
+    if(launchQueue == NULL) {
+        return 0;
+    }
+    // With the limit lifted, the queue runs at once
+    if(launchRate == 0 || launchTokens >= 1) {
+        return 1;
+    }
+    return launchRefillTime + (uint64_t)((1 - launchTokens) / launchRate * NS_PER_SECOND) + 1;
+}
+
+/*
+ *  Queue a background launch until it gets a token.
+ */
+void deferLaunch(char **argv, const struct astNode *node) {
+    getEventLoop();
+    struct deferredLaunch *launch = saveLaunch(argv, node);
+    if(launchQueueTail != NULL) {
+        launchQueueTail->next = launch;
+    } else {
+        launchQueue = launch;
+    }
+    launchQueueTail = launch;
+    launchQueueNum++;
+    armJobTimer();
+}
+
+/*
+ *  Save a launch to run later: a simple command's expanded argv, with the current command's
+ *  assignments and redirections, or a copy of node.
+ */
+struct deferredLaunch *saveLaunch(char **argv, const struct astNode *node) {
+    struct deferredLaunch *launch = calloc(1, sizeof(struct deferredLaunch));
+    if(node != NULL) {
+        launch->image = copyNodeImage(node, &launch->node);
+    } else {
+        int argsNum = 0;
+        while(argv[argsNum] != NULL) {
+            argsNum++;
+        }
+        launch->args = calloc(argsNum + 1, sizeof(char *));
+        for(int i = 0; i < argsNum; i++) {
+            launch->args[i] = strdup(argv[i]);
+        }
+        launch->assignsNum = inputCommand->assignsNum;
+        launch->assigns = calloc(inputCommand->assignsNum + 1, sizeof(char *));
+        for(int i = 0; i < inputCommand->assignsNum; i++) {
+            launch->assigns[i] = strdup(inputCommand->assigns[i]);
+        }
+        launch->redirsNum = inputCommand->redirsNum;
+        launch->redirs = calloc(inputCommand->redirsNum + 1, sizeof(struct redirection));
+        for(int i = 0; i < inputCommand->redirsNum; i++) {
+            launch->redirs[i] = inputCommand->redirs[i];
+            launch->redirs[i].word = strdup(inputCommand->redirs[i].word);
+            // A here-document's memory file is closed with the command, so the launch keeps its own
+            if(launch->redirs[i].op == TOKEN_HEREDOC) {
+                char fdText[16];
+                snprintf(fdText, sizeof(fdText), "%d", fcntl(atoi(launch->redirs[i].word), F_DUPFD_CLOEXEC, 10));
+                free(launch->redirs[i].word);
+                launch->redirs[i].word = strdup(fdText);
+            }
+        }
+    }
+    return launch;
+}
+
+/*
+ *  Start queued launches for as long as there are tokens.
+ */
+void runLaunchQueue() {
+    while(launchQueue != NULL) {
+        refillLaunchTokens(monotonicTime());
+        if(launchRate > 0 && launchTokens < 1) {
+            break;
+        }
+        launchTokens -= launchRate > 0 ? 1 : 0;
+        struct deferredLaunch *launch = launchQueue;
+        launchQueue = launch->next;
+        if(launchQueue == NULL) {
+            launchQueueTail = NULL;
+        }
+        launchQueueNum--;
+        recordLaunch();
+        startDeferredLaunch(launch, true);
+        freeDeferredLaunch(launch);
+    }
+}
+
+/*
+ *  Launch a saved job, as a background job. This can happen in the middle of another command,
+ *  so the state a launch reads is swapped out and back. Unless tokenTaken, the launch takes
+ *  its turn under set launchrate like any other.
+ */
+void startDeferredLaunch(struct deferredLaunch *launch, bool tokenTaken) {
+    struct commandLine *savedCommand = inputCommand;
+    bool savedExecDirect = execDirect;
+    int savedSubstBase = substBase;
+    int savedStatus = lastStatus;
+    execDirect = false;
+    substBase = substFDsNum;
+    launchingDeferred = tokenTaken;
+
+    if(launch->node != NULL) {
+        runBackgroundNode(launch->node);
+    } else {
+        struct commandLine *command = calloc(1, sizeof(struct commandLine));
+        while(launch->args[command->argsNum] != NULL) {
+            command->args[command->argsNum] = launch->args[command->argsNum];
+            command->argsNum++;
+        }
+        memcpy(command->assigns, launch->assigns, launch->assignsNum * sizeof(char *));
+        command->assignsNum = launch->assignsNum;
+        memcpy(command->redirs, launch->redirs, launch->redirsNum * sizeof(struct redirection));
+        command->redirsNum = launch->redirsNum;
+        command->background = true;
+        inputCommand = command;
+        // A queued sleep & still becomes a virtual job
+        if(strcmp(command->args[0], "sleep") == 0 && runsInShell(command)) {
+            sleepFor();
+        } else {
+            runExternal(command->args, getEnvSnapshot());
+        }
+        free(command);
+    }
+
+    launchingDeferred = false;
+    inputCommand = savedCommand;
+    execDirect = savedExecDirect;
+    substBase = savedSubstBase;
+    lastStatus = savedStatus;
+}
+
+/*
+ *  Free a queued launch, closing the memory files of its here-documents.
+ */
+void freeDeferredLaunch(struct deferredLaunch *launch) {
+    for(int i = 0; launch->args != NULL && launch->args[i] != NULL; i++) {
+        free(launch->args[i]);
+    }
+    for(int i = 0; i < launch->assignsNum; i++) {
+        free(launch->assigns[i]);
+    }
+    for(int i = 0; i < launch->redirsNum; i++) {
+        if(launch->redirs[i].op == TOKEN_HEREDOC) {
+            close(atoi(launch->redirs[i].word));
+        }
+        free(launch->redirs[i].word);
+    }
+    free(launch->args);
+    free(launch->assigns);
+    free(launch->redirs);
+    free(launch->image);
+    free(launch);
+}
+
+/*
+ *  Drop every queued launch.
+ */
+void clearLaunchQueue() {
+    while(launchQueue != NULL) {
+        struct deferredLaunch *launch = launchQueue;
+        launchQueue = launch->next;
+        freeDeferredLaunch(launch);
+    }
+    launchQueueTail = NULL;
+    launchQueueNum = 0;
+}
+
+/*
+ *  Wait in the event loop until every queued launch has started and every schedule is done,
+ *  before a script's shell exits. A script that sets up an every schedule keeps running it.
+ */
+void drainLaunchQueue() {
+    while(launchQueue != NULL || schedulesNum > 0) {
+        waitEvents(NULL, 0);
+    }
+}
+
+/*
+ *  Print the launch limit, the queue and the rate jobs are launching at: jobs -s
+ *  The rate counts the launches of the last second, or of the last LAUNCH_HISTORY launches if
+ *  those all fall within it.
+ */
+void printLaunchStats() {
+    uint64_t now = monotonicTime();
+    refillLaunchTokens(now);
+    unsigned long recent = 0;
+    uint64_t since = now - NS_PER_SECOND;
+    while(recent < launchesNum && recent < LAUNCH_HISTORY && launchTimes[(launchesNum - recent - 1) % LAUNCH_HISTORY] > since) {
+        recent++;
+    }
+    double rate = recent;
+    if(recent == LAUNCH_HISTORY) {
+        rate = recent * (double)NS_PER_SECOND / (now - launchTimes[launchesNum % LAUNCH_HISTORY]);
+    }
+
+    if(launchRate == 0) {
+        printf("launchrate=none burst=%d", launchBurst);
+    } else {
+        printf("launchrate=%g/s burst=%d tokens=%.1f", launchRate, launchBurst, launchTokens);
+    }
+    printf(" queued=%d rate=%.1f/s launched=%lu\n", launchQueueNum, rate, launchesNum);
+    fflush(stdout);
+}
+
+/*
+ *  Parse a retry delay: a duration as sleep takes it, or a number of milliseconds like 100ms.
+ */
+bool parseDelay(const char *text, uint64_t *delay) {
+    char *end;
+    double milliseconds = strtod(text, &end);
+    if(end != text && strcmp(end, "ms") == 0 && milliseconds >= 0) {
+        *delay = milliseconds * 1000000;
+        return true;
+    }
+    char *args[] = {(char *)text};
+    return parseDuration(args, 1, delay);
+}
+
+/*
+ *  Return a backoff with jitter, picked uniformly between half of delay and delay, so retries
+ *  of jobs that failed together spread out.
+ */
+uint64_t jitterDelay(uint64_t delay) {
+    return delay / 2 + (uint64_t)((double)random() / RAND_MAX * (delay - delay / 2));
+}
+
+/*
+ *  Return the backoff after delay: delay times factor, up to maxDelay, or a day if that is 0.
+ */
+uint64_t nextDelay(uint64_t delay, double factor, uint64_t maxDelay) {
+    double next = delay * factor;
+    double limit = maxDelay != 0 ? maxDelay : 24.0 * 60 * 60 * NS_PER_SECOND;
+    return next < limit ? next : limit;
+}
+
+/*
+ *  Run a command until it succeeds: retry [-n attempts] [-b delay] [-x factor] [-m max] command
+ *  Each failed attempt waits delay (100ms by default) before the next, growing by factor (2)
+ *  up to max, with jitter; a command ended by a signal is not retried. In the foreground the
+ *  shell waits in the event loop and SIGINT gives up. In the background the job waits as a
+ *  virtual job on the job timer, holding no process, and keeps its attempt history for jobs.
+ */
+void retryCommand() {
+    int attempts = 3;
+    uint64_t delay = 100000000;
+    double factor = 2;
+    uint64_t maxDelay = 0;
+    int first = 1;
+    for(; first + 1 < inputCommand->argsNum && inputCommand->args[first][0] == '-'; first += 2) {
+        char *option = inputCommand->args[first];
+        char *value = inputCommand->args[first + 1];
+        char *end;
+        bool valid = option[1] != '\0' && option[2] == '\0';
+        if(valid && option[1] == 'n') {
+            attempts = strtol(value, &end, 10);
+            valid = end != value && *end == '\0' && attempts >= 1;
+        } else if(valid && option[1] == 'b') {
+            valid = parseDelay(value, &delay);
+        } else if(valid && option[1] == 'x') {
+            factor = strtod(value, &end);
+            valid = end != value && *end == '\0' && factor >= 1;
+        } else if(valid && option[1] == 'm') {
+            valid = parseDelay(value, &maxDelay);
+        } else {
+            valid = false;
+        }
+        if(!valid) {
+            fprintf(stderr, "smallsh: retry: %s %s: bad option\n", option, value);
+            lastStatus = 2;
+            return;
+        }
+    }
+    if(first == inputCommand->argsNum || inputCommand->args[first][0] == '-') {
+        fprintf(stderr, "smallsh: retry: usage: retry [-n attempts] [-b delay] [-x factor] [-m max] command\n");
+        lastStatus = 2;
+        return;
+    }
+    if(inputCommand->hasBraces) {
+        fprintf(stderr, "smallsh: retry: brace expansions cannot be retried\n");
+        lastStatus = 2;
+        return;
+    }
+
+    // Drop "retry" and its options, as pin does
+    for(int i = 0; i < first; i++) {
+        free(inputCommand->args[i]);
+    }
+    memmove(inputCommand->args, inputCommand->args + first, (inputCommand->argsNum - first + 1) * sizeof(char *));
+    inputCommand->argsNum -= first;
+
+    if(inputCommand->background && !foregroundModeOnly) {
+        struct retryState *retry = calloc(1, sizeof(struct retryState));
+        retry->launch = saveLaunch(inputCommand->args, NULL);
+        retry->slot = -1;
+        retry->attempts = attempts;
+        retry->attempt = 1;
+        retry->delay = delay;
+        retry->factor = factor;
+        retry->maxDelay = maxDelay;
+        retry->statuses = calloc(attempts, sizeof(int));
+        retry->durations = calloc(attempts, sizeof(uint64_t));
+        retry->started = monotonicTime();
+        retryRequest = retry;
+        runExternal(inputCommand->args, getEnvSnapshot());
+        retryRequest = NULL;
+        // The job table was full or fork failed
+        if(retry->slot == -1) {
+            struct job unused = {.retry = retry};
+            clearJob(&unused);
+        }
+        return;
+    }
+
+    // The command runs in a child every time, even as the last command of a script
+    bool savedExecDirect = execDirect;
+    execDirect = false;
+    for(int attempt = 1; ; attempt++) {
+        runExternal(inputCommand->args, getEnvSnapshot());
+        if(lastStatus == 0 || !WIFEXITED(childStatus) || attempt == attempts) {
+            break;
+        }
+        if(waitFor(jitterDelay(delay))) {
+            lastStatus = 128 + SIGINT;
+            break;
+        }
+        delay = nextDelay(delay, factor, maxDelay);
+    }
+    execDirect = savedExecDirect;
+}
+
+/*
+ *  Add a background child to the job table and return its number. The first attempt of a
+ *  retry job takes the retry state along, and later attempts go back into the job's slot.
+ */
+int addJobAttempt(pid_t pid, char **argv) {
+    if(retryRequest != NULL && retryRequest->slot != -1) {
+        struct job *job = &jobTable[retryRequest->slot];
+        job->pid = pid;
+        job->virtual = false;
+        job->deadline = 0;
+        job->placed = false;
+        retryRequest->started = monotonicTime();
+        return retryRequest->slot + 1;
+    }
+    int number = addJob(pid, joinArgs(argv), false);
+    if(number != 0 && retryRequest != NULL) {
+        jobTable[number - 1].retry = retryRequest;
+        retryRequest->slot = number - 1;
+    }
+    return number;
+}
+
+/*
+ *  Record the end of an attempt of a retry job. If it failed with attempts left, the job turns
+ *  virtual until its backoff is over and true is returned; otherwise the job is done.
+ */
+bool scheduleRetry(struct job *job, int status) {
+    struct retryState *retry = job->retry;
+    uint64_t now = monotonicTime();
+    retry->statuses[retry->attempt - 1] = status;
+    retry->durations[retry->attempt - 1] = now - retry->started;
+    if(!WIFEXITED(status) || WEXITSTATUS(status) == 0 || retry->attempt == retry->attempts) {
+        return false;
+    }
+
+    uint64_t delay = jitterDelay(retry->delay);
+    retry->delay = nextDelay(retry->delay, retry->factor, retry->maxDelay);
+    job->virtual = true;
+    job->deadline = now + (delay > 0 ? delay : 1);
+    armJobTimer();
+    printf("Background child PID %d is done with exit status %d, retrying in %.2fs\n", job->pid, WEXITSTATUS(status), delay / 1e9);
+    fflush(stdout);
+    return true;
+}
+
+/*
+ *  Start the next attempt of a retry job whose backoff is over.
+ */
+void restartRetryJob(int slot) {
+    struct job *job = &jobTable[slot];
+    struct retryState *retry = job->retry;
+    retry->attempt++;
+    // Here-documents are read again from the start
+    for(int i = 0; i < retry->launch->redirsNum; i++) {
+        if(retry->launch->redirs[i].op == TOKEN_HEREDOC) {
+            lseek(atoi(retry->launch->redirs[i].word), 0, SEEK_SET);
+        }
+    }
+    retryRequest = retry;
+    startDeferredLaunch(retry->launch, true);
+    retryRequest = NULL;
+
+    // fork failed, which ends the job as a failed attempt would
+    if(job->virtual) {
+        job->status = 1 << 8;
+        job->done = true;
+        retry->statuses[retry->attempt - 1] = job->status;
+        printf("Background child PID %d is done with exit status %d\n", job->pid, WEXITSTATUS(job->status));
+        fflush(stdout);
+    }
+}
+
+/*
+ *  Return true if a retry job has a process running, whose failure would start a backoff.
+ */
+bool hasRetryJobs() {
+    for(int i = 0; i < MAX_PROCESSES; i++) {
+        if(jobTable[i].retry != NULL && !jobTable[i].done && !jobTable[i].virtual) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ *  Run a dependency graph of commands: dag [-j jobs] file
+ *  Each line of the file is name: deps -> command, with deps a list of names separated by
+ *  blanks; blank lines and # comments are skipped. A command starts once all its deps have
+ *  succeeded, with up to jobs (the number of CPUs by default) running at once, the one with
+ *  the longest chain of commands after it first. A failure cancels everything that depends on
+ *  it, and the rest of the dag goes on. SIGINT stops the dag. At the end the times of the
+ *  critical path, the chain of commands that ran longest, are printed.
+ */
+void runDag() {
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+    if(inputCommand->argsNum > 2 && strcmp(inputCommand->args[1], "-j") == 0) {
+        char *end;
+        jobs = strtol(inputCommand->args[2], &end, 10);
+        if(end == inputCommand->args[2] || *end != '\0' || jobs < 1) {
+            fprintf(stderr, "smallsh: dag: %s: bad job count\n", inputCommand->args[2]);
+            lastStatus = 2;
+            return;
+        }
+        first = 3;
+    }
+    if(first + 1 != inputCommand->argsNum) {
+        fprintf(stderr, "smallsh: dag: usage: dag [-j jobs] file\n");
+        lastStatus = 2;
+        return;
+    }
+    int nodesNum;
+    struct dagNode *nodes = readDag(inputCommand->args[first], &nodesNum);
+    if(nodes == NULL) {
+        lastStatus = 2;
+        return;
+    }
+    int *order = sortDag(nodes, nodesNum);
+    if(order == NULL) {
+        freeDag(nodes, nodesNum);
+        lastStatus = 2;
+        return;
+    }
+
+    // Children are collected here through their pidfds, as wait does
+    sigset_t waitMask, oldMask;
+    sigemptyset(&waitMask);
+    sigaddset(&waitMask, SIGINT);
+    sigaddset(&waitMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &waitMask, &oldMask);
+    if(interruptFD == -1) {
+        sigdelset(&waitMask, SIGCHLD);
+        interruptFD = shellFD(signalfd(-1, &waitMask, SFD_NONBLOCK | SFD_CLOEXEC));
+    }
+    fflush(stdout);
+    syncReadBuffers();
+
+    uint64_t start = monotonicTime();
+    int *running = calloc(jobs, sizeof(int));
+    int runningNum = 0;
+    int *fds = calloc(jobs + 1, sizeof(int));
+    bool interrupted = false;
+    while(true) {
+        // Fill free slots with the ready commands that have the most work after them
+        while(!interrupted && runningNum < jobs) {
+            int next = -1;
+            for(int i = 0; i < nodesNum; i++) {
+                if(nodes[i].state == DAG_WAITING && nodes[i].waiting == 0 && (next == -1 || nodes[i].height > nodes[next].height)) {
+                    next = i;
+                }
+            }
+            if(next == -1) {
+                break;
+            }
+            startDagNode(&nodes[next], &oldMask);
+            if(nodes[next].state == DAG_RUNNING) {
+                running[runningNum++] = next;
+            } else {
+                finishDagNode(nodes, next);
+            }
+        }
+        if(runningNum == 0) {
+            break;
+        }
+
+        fds[0] = interruptFD;
+        for(int i = 0; i < runningNum; i++) {
+            fds[i + 1] = nodes[running[i]].pidFD;
+        }
+        int ready = waitEvents(fds, runningNum + 1);
+        if(ready == WAIT_ERROR) {
+            // Without the event loop, block until the first running command ends
+            siginfo_t info;
+            waitid(P_PID, nodes[running[0]].pid, &info, WEXITED | WNOWAIT);
+            ready = nodes[running[0]].pidFD;
+        }
+        if(ready == interruptFD) {
+            if(takeInterrupt() && !interrupted) {
+                // Stop starting commands and pass the interrupt on to those running
+                interrupted = true;
+                for(int i = 0; i < runningNum; i++) {
+                    kill(nodes[running[i]].pid, SIGINT);
+                }
+            }
+            continue;
+        }
+        for(int i = 0; i < runningNum; i++) {
+            struct dagNode *node = &nodes[running[i]];
+            if(node->pidFD != ready || waitpid(node->pid, &node->status, WNOHANG) != node->pid) {
+                continue;
+            }
+            node->end = monotonicTime();
+            close(node->pidFD);
+            node->state = WIFEXITED(node->status) && WEXITSTATUS(node->status) == 0 ? DAG_DONE : DAG_FAILED;
+            finishDagNode(nodes, running[i]);
+            running[i--] = running[--runningNum];
+        }
+    }
+    takeInterrupt();
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+    printDagReport(nodes, nodesNum, order, start, jobs);
+    lastStatus = 0;
+    for(int i = 0; i < nodesNum; i++) {
+        lastStatus = nodes[i].state != DAG_DONE ? 1 : lastStatus;
+    }
+    lastStatus = interrupted ? 128 + SIGINT : lastStatus;
+    free(running);
+    free(fds);
+    free(order);
+    freeDag(nodes, nodesNum);
+}
+
+/*
+ *  Read and parse a dag file. Returns its commands, or NULL after printing an error.
+ */
+struct dagNode *readDag(const char *path, int *nodesNum) {
+    int dagFile = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if(dagFile == -1 || fstat(dagFile, &info) == -1) {
+        fprintf(stderr, "smallsh: dag: %s: %s\n", path, strerror(errno));
+        if(dagFile != -1) {
+            close(dagFile);
+        }
+        return NULL;
+    }
+    char *text = malloc(info.st_size + 1);
+    ssize_t textLength = 0;
+    ssize_t bytesRead;
+    while(textLength < info.st_size && (bytesRead = read(dagFile, text + textLength, info.st_size - textLength)) > 0) {
+        textLength += bytesRead;
+    }
+    text[textLength] = '\0';
+    close(dagFile);
+
+    // Names and commands first, so deps can name commands further down
+    int size = 16;
+    struct dagNode *nodes = calloc(size, sizeof(struct dagNode));
+    char **depLists = calloc(size, sizeof(char *));
+    *nodesNum = 0;
+    bool failed = false;
+    int lineNum = 0;
+    for(char *line = text, *next; line != NULL && !failed; line = next) {
+        lineNum++;
+        next = strchr(line, '\n');
+        if(next != NULL) {
+            *next++ = '\0';
+        }
+        line += strspn(line, " \t");
+        if(*line == '\0' || *line == '#') {
+            continue;
+        }
+        char *colon = strchr(line, ':');
+        char *arrow = colon != NULL ? strstr(colon, "->") : NULL;
+        size_t nameLength = colon != NULL ? strcspn(line, " \t:") : 0;
+        if(arrow == NULL || nameLength == 0 || line + nameLength + strspn(line + nameLength, " \t") != colon) {
+            fprintf(stderr, "smallsh: dag: %s:%d: expected name: deps -> command\n", path, lineNum);
+            failed = true;
+            break;
+        }
+        if(*nodesNum == size) {
+            size *= 2;
+            nodes = realloc(nodes, size * sizeof(struct dagNode));
+            depLists = realloc(depLists, size * sizeof(char *));
+            memset(nodes + *nodesNum, 0, (size - *nodesNum) * sizeof(struct dagNode));
+        }
+        struct dagNode *node = &nodes[*nodesNum];
+        node->name = strndup(line, nameLength);
+        if(findDagNode(nodes, *nodesNum, node->name) != -1) {
+            fprintf(stderr, "smallsh: dag: %s:%d: %s is defined twice\n", path, lineNum, node->name);
+            free(node->name);
+            failed = true;
+            break;
+        }
+        *arrow = '\0';
+        depLists[*nodesNum] = colon + 1;
+        bool incomplete = false;
+        node->command = parseText(arrow + 2, &incomplete);
+        if(node->command == NULL) {
+            fprintf(stderr, "smallsh: dag: %s:%d: %s has no command\n", path, lineNum, node->name);
+            free(node->name);
+            failed = true;
+            break;
+        }
+        (*nodesNum)++;
+    }
+
+    // Then the edges, both ways
+    for(int i = 0; i < *nodesNum && !failed; i++) {
+        char *save = NULL;
+        for(char *dep = strtok_r(depLists[i], " \t", &save); dep != NULL && !failed; dep = strtok_r(NULL, " \t", &save)) {
+            int index = findDagNode(nodes, *nodesNum, dep);
+            if(index == -1) {
+                fprintf(stderr, "smallsh: dag: %s: %s needs unknown %s\n", path, nodes[i].name, dep);
+                failed = true;
+                break;
+            }
+            nodes[i].deps = realloc(nodes[i].deps, (nodes[i].depsNum + 1) * sizeof(int));
+            nodes[i].deps[nodes[i].depsNum++] = index;
+            nodes[index].dependents = realloc(nodes[index].dependents, (nodes[index].dependentsNum + 1) * sizeof(int));
+            nodes[index].dependents[nodes[index].dependentsNum++] = i;
+        }
+        nodes[i].waiting = nodes[i].depsNum;
+    }
+    free(depLists);
+    free(text);
+    if(failed || *nodesNum == 0) {
+        if(!failed) {
+            fprintf(stderr, "smallsh: dag: %s: no commands\n", path);
+        }
+        freeDag(nodes, *nodesNum);
+        return NULL;
+    }
+    return nodes;
+}
+
+/*
+ *  Return the index of the command called name, or -1.
+ */
+int findDagNode(struct dagNode *nodes, int nodesNum, const char *name) {
+    for(int i = 0; i < nodesNum; i++) {
+        if(strcmp(nodes[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  Put the dag in topological order, which is returned, and find each command's height, the
+ *  length of the longest chain it starts. Returns NULL after printing an error if there is a
+ *  cycle.
+ */
+int *sortDag(struct dagNode *nodes, int nodesNum) {
+    int *order = calloc(nodesNum, sizeof(int));
+    int *waiting = calloc(nodesNum, sizeof(int));
+    int orderNum = 0;
+    for(int i = 0; i < nodesNum; i++) {
+        waiting[i] = nodes[i].depsNum;
+        if(waiting[i] == 0) {
+            order[orderNum++] = i;
+        }
+    }
+    for(int i = 0; i < orderNum; i++) {
+        struct dagNode *node = &nodes[order[i]];
+        for(int j = 0; j < node->dependentsNum; j++) {
+            if(--waiting[node->dependents[j]] == 0) {
+                order[orderNum++] = node->dependents[j];
+            }
+        }
+    }
+
+    bool sorted = orderNum == nodesNum;
+    if(!sorted) {
+        for(int i = 0; i < nodesNum; i++) {
+            if(waiting[i] != 0) {
+                fprintf(stderr, "smallsh: dag: cycle through %s\n", nodes[i].name);
+                break;
+            }
+        }
+    }
+    // Heights, from the end of the order back
+    for(int i = orderNum - 1; i >= 0; i--) {
+        struct dagNode *node = &nodes[order[i]];
+        node->height = 1;
+        for(int j = 0; j < node->dependentsNum; j++) {
+            int height = nodes[node->dependents[j]].height + 1;
+            node->height = height > node->height ? height : node->height;
+        }
+    }
+    free(waiting);
+    if(!sorted) {
+        free(order);
+        return NULL;
+    }
+    return order;
+}
+
+/*
+ *  Fork a command of the dag. It runs like a foreground command, in a child of its own with
+ *  the signal mask childMask.
+ */
+void startDagNode(struct dagNode *node, const sigset_t *childMask) {
+    node->start = monotonicTime();
+    node->pid = fork();
+    switch(node->pid) {
+        case -1:
+            perror("fork() failed\n");
+            node->end = node->start;
+            node->status = 1 << 8;
+            node->state = DAG_FAILED;
+            break;
+        case 0:
+            sigprocmask(SIG_SETMASK, childMask, NULL);
+            SIGINTAction.sa_handler = SIG_DFL;
+            sigaction(SIGINT, &SIGINTAction, NULL);
+            SIGTSTPAction.sa_handler = SIG_IGN;
+            sigaction(SIGTSTP, &SIGTSTPAction, NULL);
+            execDirect = node->command->type == AST_SIMPLE;
+            executeNode(node->command);
+            fflush(stdout);
+            exit(lastStatus);
+        default:
+            node->pidFD = shellFD(syscall(SYS_pidfd_open, node->pid, 0));
+            node->state = DAG_RUNNING;
+    }
+}
+
+/*
+ *  Pass the end of a command on to those that depend on it: one more dependency done, or for
+ *  a failure, cancelled.
+ */
+void finishDagNode(struct dagNode *nodes, int index) {
+    struct dagNode *node = &nodes[index];
+    if(node->state == DAG_FAILED) {
+        if(WIFEXITED(node->status)) {
+            fprintf(stderr, "smallsh: dag: %s: exit status %d\n", node->name, WEXITSTATUS(node->status));
+        } else {
+            fprintf(stderr, "smallsh: dag: %s: terminated by signal %d\n", node->name, WTERMSIG(node->status));
+        }
+    }
+    for(int i = 0; i < node->dependentsNum; i++) {
+        struct dagNode *dependent = &nodes[node->dependents[i]];
+        if(node->state == DAG_FAILED) {
+            cancelDagNode(nodes, node->dependents[i], node->name);
+            continue;
+        }
+        dependent->waiting--;
+    }
+}
+
+/*
+ *  Cancel a waiting command and everything that depends on it, because failed failed.
+ */
+void cancelDagNode(struct dagNode *nodes, int index, const char *failed) {
+    if(nodes[index].state != DAG_WAITING) {
+        return;
+    }
+    nodes[index].state = DAG_CANCELLED;
+    fprintf(stderr, "smallsh: dag: %s: cancelled, %s failed\n", nodes[index].name, failed);
+    for(int i = 0; i < nodes[index].dependentsNum; i++) {
+        cancelDagNode(nodes, nodes[index].dependents[i], failed);
+    }
+}
+
+/*
+ *  Print how the dag went and its critical path: the chain of dependent commands with the
+ *  longest total run time, which no number of jobs could have beaten. Each command on it is
+ *  shown with when it started and how long it ran, so time lost waiting for a free job shows
+ *  as a gap.
+ */
+void printDagReport(struct dagNode *nodes, int nodesNum, const int *order, uint64_t start, int jobs) {
+    int counts[DAG_CANCELLED + 1] = {0};
+    int last = -1;
+    for(int i = 0; i < nodesNum; i++) {
+        struct dagNode *node = &nodes[order[i]];
+        counts[node->state]++;
+        node->critical = -1;
+        node->pathTime = 0;
+        if(node->state != DAG_DONE && node->state != DAG_FAILED) {
+            continue;
+        }
+        // Dependencies come first in the order, so their path times are final
+        for(int j = 0; j < node->depsNum; j++) {
+            if(node->critical == -1 || nodes[node->deps[j]].pathTime > node->pathTime) {
+                node->critical = node->deps[j];
+                node->pathTime = nodes[node->deps[j]].pathTime;
+            }
+        }
+        node->pathTime += node->end - node->start;
+        if(last == -1 || node->pathTime > nodes[last].pathTime) {
+            last = order[i];
+        }
+    }
+    uint64_t elapsed = monotonicTime() - start;
+    printf("dag: %d done, %d failed, %d cancelled, %d not run in %.2fs with %d jobs\n", counts[DAG_DONE],
+           counts[DAG_FAILED], counts[DAG_CANCELLED], counts[DAG_WAITING], elapsed / 1e9, jobs);
+    if(last == -1) {
+        fflush(stdout);
+        return;
+    }
+
+    // Follow the path back, then print it from its start
+    int length = 0;
+    int *path = calloc(nodesNum, sizeof(int));
+    for(int i = last; i != -1; i = nodes[i].critical) {
+        path[length++] = i;
+    }
+    printf("dag: critical path of %d commands, %.2fs:\n", length, nodes[last].pathTime / 1e9);
+    for(int i = length - 1; i >= 0; i--) {
+        struct dagNode *node = &nodes[path[i]];
+        printf("    %8.2fs %8.2fs  %s\n", (node->start - start) / 1e9, (node->end - node->start) / 1e9, node->name);
+    }
+    fflush(stdout);
+    free(path);
+}
+
+/*
+ *  Free a dag. The commands' trees are in the line's arena.
+ */
+void freeDag(struct dagNode *nodes, int nodesNum) {
+    for(int i = 0; i < nodesNum; i++) {
+        free(nodes[i].name);
+        free(nodes[i].deps);
+        free(nodes[i].dependents);
+    }
+    free(nodes);
+}
+
+/*
+ *  Run a command, or restore its output from the store: cached command [args...] [< in] > out
+ *  A command is taken to be a pure function of its words, its locale and time zone variables,
+ *  its executable, the contents of its input files and here-documents, and the contents of
+ *  every argument that names an existing regular file. Their SHA-256 hash is the key; the
+ *  output of a successful run is stored under the hash of its contents, with the key linked
+ *  to it, so identical outputs are kept once. A hit clones or copies the output into place
+ *  instead of running the command. Commands without a > file, that write elsewhere too, or
+ *  with an argument naming a directory or other non-regular file, whose contents are not
+ *  hashed, just run. In the background only hits are taken from the store.
+ *  cached -s prints how the store has done this session.
+ */
+void cachedCommand() {
+    if(inputCommand->argsNum == 2 && strcmp(inputCommand->args[1], "-s") == 0) {
+        printCacheStats();
+        return;
+    }
+    if(inputCommand->argsNum == 1) {
+        fprintf(stderr, "smallsh: cached: usage: cached command [args...] > file\n");
+        lastStatus = 2;
+        return;
+    }
+
+    // Drop "cached", as pin does
+    free(inputCommand->args[0]);
+    memmove(inputCommand->args, inputCommand->args + 1, inputCommand->argsNum * sizeof(char *));
+    memmove(inputCommand->braces, inputCommand->braces + 1, (inputCommand->argsNum - 1) * sizeof(struct braceSeq *));
+    inputCommand->argsNum--;
+
+    uint8_t digest[SHA256_SIZE];
+    char key[2 * SHA256_SIZE + 1];
+    int output = -1;
+    char *store = NULL;
+    if(!inputCommand->hasBraces && substFDsNum == substBase && hashCommand(digest, &output)) {
+        store = getOutputStore();
+    }
+    if(store == NULL) {
+        cacheSkips++;
+        if(inputCommand->hasBraces) {
+            runBraceChunks(getEnvSnapshot());
+        } else {
+            runExternal(inputCommand->args, getEnvSnapshot());
+        }
+        return;
+    }
+
+    hexDigest(digest, key);
+    const char *outputPath = inputCommand->redirs[output].word;
+    if(restoreOutput(store, key, outputPath)) {
+        // Report the hit like the foreground process it replaces
+        cacheHits++;
+        childStatus = 0;
+        childSkipped = false;
+        lastStatus = 0;
+    } else {
+        cacheMisses++;
+        // The output is stored after the run, so the command runs in a child even as the
+        // last command of a script
+        bool background = inputCommand->background && !foregroundModeOnly;
+        bool savedExecDirect = execDirect;
+        execDirect = false;
+        runExternal(inputCommand->args, getEnvSnapshot());
+        execDirect = savedExecDirect;
+        if(!background && WIFEXITED(childStatus) && WEXITSTATUS(childStatus) == 0) {
+            storeOutput(store, key, outputPath);
+        }
+    }
+    free(store);
+}
+
+/*
+ *  Hash what the current command's output depends on into key, and set output to the index
+ *  of its > file redirection. Returns false if the command cannot be cached.
+ */
+bool hashCommand(uint8_t key[SHA256_SIZE], int *output) {
+    struct sha256 hash;
+    sha256Init(&hash);
+    for(int i = 0; i < inputCommand->argsNum; i++) {
+        sha256Update(&hash, inputCommand->args[i], strlen(inputCommand->args[i]) + 1);
+    }
+    sha256Update(&hash, "", 1);
+    for(int i = 0; i < inputCommand->assignsNum; i++) {
+        sha256Update(&hash, inputCommand->assigns[i], strlen(inputCommand->assigns[i]) + 1);
+    }
+    char **envp = getEnvSnapshot();
+    for(int i = 0; envp[i] != NULL; i++) {
+        if(strncmp(envp[i], "LANG", 4) == 0 || strncmp(envp[i], "LC_", 3) == 0 || strncmp(envp[i], "TZ=", 3) == 0) {
+            sha256Update(&hash, envp[i], strlen(envp[i]) + 1);
+        }
+    }
+
+    // The executable by identity: an upgrade or rebuild changes its inode, size or time
+    char *path = findExecutable(inputCommand->args[0]);
+    struct stat info;
+    if(path == NULL || stat(path, &info) == -1) {
+        free(path);
+        return false;
+    }
+    free(path);
+    uint64_t identity[5] = {info.st_dev, info.st_ino, info.st_size, info.st_mtim.tv_sec, info.st_mtim.tv_nsec};
+    sha256Update(&hash, identity, sizeof(identity));
+
+    // Arguments are checked whole: one naming an existing file is an input whose contents count,
+    // and one naming a directory or device, which cannot be hashed, makes the command uncacheable
+    for(int i = 1; i < inputCommand->argsNum; i++) {
+        if(stat(inputCommand->args[i], &info) == -1) {
+            continue;
+        }
+        int input = S_ISREG(info.st_mode) ? open(inputCommand->args[i], O_RDONLY | O_CLOEXEC) : -1;
+        uint64_t header[2] = {i, info.st_size};
+        sha256Update(&hash, header, sizeof(header));
+        bool hashed = input != -1 && hashFD(&hash, input);
+        if(input != -1) {
+            close(input);
+        }
+        if(!hashed) {
+            return false;
+        }
+    }
+
+    *output = -1;
+    for(int i = 0; i < inputCommand->redirsNum; i++) {
+        struct redirection *redir = &inputCommand->redirs[i];
+        int input = -1;
+        if(redir->op == TOKEN_HEREDOC) {
+            input = atoi(redir->word);
+        } else if(redir->op == TOKEN_LESS) {
+            input = open(redir->word, O_RDONLY | O_CLOEXEC);
+        }
+        // Sizes keep the contents of one input from running into the next
+        struct stat inputInfo;
+        uint64_t header[3] = {redir->fd, redir->op, 0};
+        if(input != -1 && fstat(input, &inputInfo) == 0) {
+            header[2] = inputInfo.st_size;
+        }
+        sha256Update(&hash, header, sizeof(header));
+        bool hashed = input != -1 && hashFD(&hash, input);
+        if(redir->op == TOKEN_LESS && input != -1) {
+            close(input);
+        }
+
+        if(redir->op == TOKEN_GREAT && redir->fd == STDOUT_FILENO && *output == -1) {
+            *output = i;
+        } else if(redir->op == TOKEN_DUP) {
+            sha256Update(&hash, redir->word, strlen(redir->word) + 1);
+        } else if(!hashed) {
+            // An input that is not a file, or another file written to, which would not be restored
+            return false;
+        }
+    }
+    sha256Final(&hash, key);
+    return *output != -1;
+}
+
+/*
+ *  Add the contents of a regular file to hash. Returns false for anything else.
+ */
+bool hashFD(struct sha256 *hash, int fd) {
+    struct stat info;
+    if(fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+        return false;
+    }
+    if(info.st_size == 0) {
+        return true;
+    }
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+    sha256Update(hash, data, info.st_size);
+    munmap(data, info.st_size);
+    return true;
+}
+
+/*
+ *  Find the file execvp would run for name, as a malloc'd path, or NULL. Like a shell's hash
+ *  table, a remembered name is not looked up again, even if a new file would now come first.
+ */
+char *findExecutable(const char *name) {
+    if(strchr(name, '/') != NULL) {
+        return strdup(name);
+    }
+    char *pathVar = getVar("PATH");
+    const char *dirs = pathVar != NULL ? pathVar : "/bin:/usr/bin";
+
+    // Names found before are remembered until PATH changes
+    if(pathCacheKey == NULL || strcmp(pathCacheKey, dirs) != 0) {
+        for(int i = 0; i < PATH_CACHE_SIZE; i++) {
+            free(pathCache[i].name);
+            free(pathCache[i].path);
+        }
+        memset(pathCache, 0, sizeof(pathCache));
+        free(pathCacheKey);
+        pathCacheKey = strdup(dirs);
+    }
+    struct cachedPath *entry = &pathCache[hashName(name, strlen(name)) % PATH_CACHE_SIZE];
+    if(entry->name != NULL && strcmp(entry->name, name) == 0) {
+        return strdup(entry->path);
+    }
+
+    while(true) {
+        size_t length = strcspn(dirs, ":");
+        char *path = malloc(length + strlen(name) + 3);
+        sprintf(path, "%.*s/%s", (int)length, length > 0 ? dirs : ".", name);
+        if(access(path, X_OK) == 0) {
+            free(entry->name);
+            free(entry->path);
+            entry->name = strdup(name);
+            entry->path = strdup(path);
+            return path;
+        }
+        free(path);
+        if(dirs[length] == '\0') {
+            return NULL;
+        }
+        dirs += length + 1;
+    }
+}
+
+/*
+ *  Return the output store in the cache directory, creating its objects and keys directories,
+ *  or NULL if there is none.
+ */
+char *getOutputStore() {
+    char *cacheDir = getCacheDir();
+    if(cacheDir == NULL) {
+        return NULL;
+    }
+    char *store = malloc(strlen(cacheDir) + 16);
+    sprintf(store, "%s/outputs", cacheDir);
+    free(cacheDir);
+    char path[4096];
+    mkdir(store, 0700);
+    snprintf(path, sizeof(path), "%s/objects", store);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/keys", store);
+    if(mkdir(path, 0700) == -1 && errno != EEXIST) {
+        free(store);
+        return NULL;
+    }
+    return store;
+}
+
+/*
+ *  Write the output stored under key to outputPath, cloning it where the filesystem can
+ *  share the blocks. Returns false if the key is not in the store.
+ */
+bool restoreOutput(const char *store, const char *key, const char *outputPath) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/keys/%s", store, key);
+    int object = open(path, O_RDONLY | O_CLOEXEC);
+    if(object == -1) {
+        // The object was evicted, so the key goes too
+        if(errno == ENOENT) {
+            unlink(path);
+        }
+        return false;
+    }
+    int output = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(output == -1) {
+        fprintf(stderr, "smallsh: cached: %s: %s\n", outputPath, strerror(errno));
+        close(object);
+        return false;
+    }
+    struct stat info;
+    fstat(object, &info);
+    bool restored = ioctl(output, FICLONE, object) == 0 || copyFD(object, output, "cached") == 0;
+    if(restored) {
+        cacheRestored += info.st_size;
+        // The time of last use orders eviction
+        futimens(object, NULL);
+    }
+    close(output);
+    close(object);
+    return restored;
+}
+
+/*
+ *  Put the output of a successful run in the store under the hash of its contents and link
+ *  key to it, then evict old outputs if the store has grown past cachesize. Both are renamed
+ *  into place, so a concurrent shell sees all of an object or none of it.
+ */
+void storeOutput(const char *store, const char *key, const char *outputPath) {
+    int output = open(outputPath, O_RDONLY | O_CLOEXEC);
+    struct sha256 hash;
+    uint8_t digest[SHA256_SIZE];
+    char name[2 * SHA256_SIZE + 1];
+    sha256Init(&hash);
+    if(output == -1 || !hashFD(&hash, output)) {
+        if(output != -1) {
+            close(output);
+        }
+        return;
+    }
+    sha256Final(&hash, digest);
+    hexDigest(digest, name);
+
+    char path[4096], temporary[4096];
+    snprintf(path, sizeof(path), "%s/objects/%s", store, name);
+    snprintf(temporary, sizeof(temporary), "%s/objects/.%d", store, getpid());
+    int object = open(path, O_RDONLY | O_CLOEXEC);
+    if(object != -1) {
+        futimens(object, NULL);
+    } else if((object = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) != -1) {
+        lseek(output, 0, SEEK_SET);
+        if((ioctl(object, FICLONE, output) == 0 || copyFD(output, object, "cached") == 0) && rename(temporary, path) == 0) {
+            evictOutputs(store);
+        } else {
+            unlink(temporary);
+        }
+    }
+    close(output);
+    if(object == -1) {
+        return;
+    }
+    close(object);
+
+    char target[2 * SHA256_SIZE + 16];
+    snprintf(target, sizeof(target), "../objects/%s", name);
+    snprintf(path, sizeof(path), "%s/keys/%s", store, key);
+    snprintf(temporary, sizeof(temporary), "%s/keys/.%d", store, getpid());
+    unlink(temporary);
+    if(symlink(target, temporary) == -1 || rename(temporary, path) == -1) {
+        unlink(temporary);
+    }
+}
+
+/*
+ *  Sort objects by time of last use, oldest first.
+ */
+int compareObjectTimes(const void *a, const void *b) {
+    const struct storedObject *first = a, *second = b;
+    if(first->used.tv_sec != second->used.tv_sec) {
+        return first->used.tv_sec < second->used.tv_sec ? -1 : 1;
+    }
+    return (first->used.tv_nsec > second->used.tv_nsec) - (first->used.tv_nsec < second->used.tv_nsec);
+}
+
+/*
+ *  Remove the least recently used objects until the store fits in cachesize. Keys linking to
+ *  them are dropped when next looked up.
+ */
+void evictOutputs(const char *store) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/objects", store);
+    DIR *objects = opendir(path);
+    if(objects == NULL) {
+        return;
+    }
+    int size = 64, objectsNum = 0;
+    struct storedObject *stored = malloc(size * sizeof(struct storedObject));
+    uint64_t total = 0;
+    struct dirent *entry;
+    while((entry = readdir(objects)) != NULL) {
+        struct stat info;
+        if(entry->d_name[0] == '.' || fstatat(dirfd(objects), entry->d_name, &info, 0) == -1) {
+            continue;
+        }
+        if(objectsNum == size) {
+            size *= 2;
+            stored = realloc(stored, size * sizeof(struct storedObject));
+        }
+        stored[objectsNum].name = strdup(entry->d_name);
+        stored[objectsNum].size = info.st_size;
+        stored[objectsNum++].used = info.st_mtim;
+        total += info.st_size;
+    }
+    if(total > cacheSize) {
+        qsort(stored, objectsNum, sizeof(struct storedObject), compareObjectTimes);
+        for(int i = 0; i < objectsNum && total > cacheSize; i++) {
+            if(unlinkat(dirfd(objects), stored[i].name, 0) == 0) {
+                total -= stored[i].size;
+                cacheEvictions++;
+            }
+        }
+    }
+    for(int i = 0; i < objectsNum; i++) {
+        free(stored[i].name);
+    }
+    free(stored);
+    closedir(objects);
+}
+
+/*
+ *  Print the hits, misses and commands that could not be cached this session, and the size of
+ *  the store: cached -s
+ */
+void printCacheStats() {
+    char *store = getOutputStore();
+    uint64_t total = 0;
+    int objectsNum = 0;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/objects", store != NULL ? store : "");
+    DIR *objects = store != NULL ? opendir(path) : NULL;
+    struct dirent *entry;
+    while(objects != NULL && (entry = readdir(objects)) != NULL) {
+        struct stat info;
+        if(entry->d_name[0] != '.' && fstatat(dirfd(objects), entry->d_name, &info, 0) == 0) {
+            total += info.st_size;
+            objectsNum++;
+        }
+    }
+    if(objects != NULL) {
+        closedir(objects);
+    }
+    unsigned long lookups = cacheHits + cacheMisses;
+    printf("hits=%lu misses=%lu uncacheable=%lu hitrate=%.1f%% restored=%llu\n", cacheHits, cacheMisses, cacheSkips,
+           lookups > 0 ? 100.0 * cacheHits / lookups : 0.0, (unsigned long long)cacheRestored);
+    printf("store=%s objects=%d size=%llu limit=%llu evicted=%lu\n", store != NULL ? store : "none", objectsNum,
+           (unsigned long long)total, (unsigned long long)cacheSize, cacheEvictions);
+    fflush(stdout);
+    free(store);
+}
+
+/*
+ *  Start a SHA-256 hash.
+ */
+void sha256Init(struct sha256 *hash) {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(hash->state, initial, sizeof(initial));
+    hash->length = 0;
+}
+
+/*
+ *  Add length bytes to a SHA-256 hash. Whole blocks are hashed straight from data.
+ */
+void sha256Update(struct sha256 *hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    size_t used = hash->length % 64;
+    hash->length += length;
+    if(used > 0) {
+        size_t take = length < 64 - used ? length : 64 - used;
+        memcpy(hash->block + used, bytes, take);
+        bytes += take;
+        length -= take;
+        if(used + take < 64) {
+            return;
+        }
+        sha256Block(hash->state, hash->block);
+    }
+    for(; length >= 64; bytes += 64, length -= 64) {
+        sha256Block(hash->state, bytes);
+    }
+    memcpy(hash->block, bytes, length);
+}
+
+/*
+ *  Pad a SHA-256 hash and write its digest.
+ */
+void sha256Final(struct sha256 *hash, uint8_t digest[SHA256_SIZE]) {
+    uint64_t bits = hash->length * 8;
+    uint8_t padding[72] = {0x80};
+    size_t used = hash->length % 64;
+    size_t paddingLength = (used < 56 ? 56 : 120) - used;
+    for(int i = 0; i < 8; i++) {
+        padding[paddingLength + i] = bits >> (56 - 8 * i);
+    }
+    sha256Update(hash, padding, paddingLength + 8);
+    for(int i = 0; i < 8; i++) {
+        digest[4 * i] = hash->state[i] >> 24;
+        digest[4 * i + 1] = hash->state[i] >> 16;
+        digest[4 * i + 2] = hash->state[i] >> 8;
+        digest[4 * i + 3] = hash->state[i];
+    }
+}
+
+/*
+ *  Run the SHA-256 compression function on one 64-byte block.
+ */
+void sha256Block(uint32_t state[8], const uint8_t *block) {
+    static const uint32_t rounds[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    #define ROTATE(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+    uint32_t words[64];
+    for(int i = 0; i < 16; i++) {
+        words[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for(int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTATE(words[i - 15], 7) ^ ROTATE(words[i - 15], 18) ^ (words[i - 15] >> 3);
+        uint32_t s1 = ROTATE(words[i - 2], 17) ^ ROTATE(words[i - 2], 19) ^ (words[i - 2] >> 10);
+        words[i] = words[i - 16] + s0 + words[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for(int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTATE(e, 6) ^ ROTATE(e, 11) ^ ROTATE(e, 25)) + ((e & f) ^ (~e & g)) + rounds[i] + words[i];
+        uint32_t t2 = (ROTATE(a, 2) ^ ROTATE(a, 13) ^ ROTATE(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    #undef ROTATE
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/*
+ *  Write a digest as lowercase hex.
+ */
+void hexDigest(const uint8_t digest[SHA256_SIZE], char hex[2 * SHA256_SIZE + 1]) {
+    for(int i = 0; i < SHA256_SIZE; i++) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+}
+
+/*
+ *  Return true if the current command reads < files and writes a > file that is newer than
+ *  all of them and the executable, so set incremental can skip it. There is one statx per
+ *  file, asking only for the modification time and never for a sync with a network server;
+ *  the output goes first, so a missing output costs one call. Commands that append, read a
+ *  here-document or a <(...) pipe, or write another file always run. argv is NULL for a
+ *  command run in the shell, where only the inputs are compared.
+ */
+bool isUpToDate(char **argv) {
+    const char *outputPath = NULL;
+    int inputsNum = 0;
+    for(int i = 0; i < inputCommand->redirsNum; i++) {
+        struct redirection *redir = &inputCommand->redirs[i];
+        if(redir->op == TOKEN_LESS) {
+            inputsNum++;
+        } else if(redir->op == TOKEN_GREAT && redir->fd == STDOUT_FILENO && outputPath == NULL) {
+            outputPath = redir->word;
+        } else if(redir->op != TOKEN_DUP) {
+            return false;
+        }
+    }
+    if(outputPath == NULL || inputsNum == 0 || substFDsNum > substBase) {
+        return false;
+    }
+
+    struct statx output, info;
+    if(statx(AT_FDCWD, outputPath, AT_STATX_DONT_SYNC, STATX_MTIME, &output) == -1) {
+        return false;
+    }
+    for(int i = 0; i < inputCommand->redirsNum; i++) {
+        struct redirection *redir = &inputCommand->redirs[i];
+        if(redir->op == TOKEN_LESS && (statx(AT_FDCWD, redir->word, AT_STATX_DONT_SYNC, STATX_MTIME, &info) == -1
+                                       || !isNewer(&output.stx_mtime, &info.stx_mtime))) {
+            return false;
+        }
+    }
+    // A command run in the shell has no executable to compare
+    if(argv == NULL) {
+        return true;
+    }
+    char *path = findExecutable(argv[0]);
+    bool upToDate = path != NULL && statx(AT_FDCWD, path, AT_STATX_DONT_SYNC, STATX_MTIME, &info) == 0
+                    && isNewer(&output.stx_mtime, &info.stx_mtime);
+    free(path);
+    return upToDate;
+}
+
+/*
+ *  Return true if time a is later than time b.
+ */
+bool isNewer(const struct statx_timestamp *a, const struct statx_timestamp *b) {
+    return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+/*
+ *  Run a command, and run it again whenever a watched file changes, until SIGINT:
+ *  watch [-d delay] path... -- command [args...]
+ *  Directories are watched with everything below them. The paths are watched with inotify in
+ *  the event loop, so nothing is polled while they are idle. A burst of changes is taken as one
+ *  once delay (100ms by default) passes without another; a run still going when changes come in
+ *  is cancelled, with SIGTERM to its process group, and the command starts again after them.
+ */
+void watchCommand() {
+    uint64_t delay = 100000000;
+    int first = 1;
+    if(inputCommand->argsNum > 2 && strcmp(inputCommand->args[1], "-d") == 0) {
+        if(!parseDelay(inputCommand->args[2], &delay)) {
+            fprintf(stderr, "smallsh: watch: %s: bad delay\n", inputCommand->args[2]);
+            lastStatus = 2;
+            return;
+        }
+        first = 3;
+    }
+    int separator = first;
+    while(separator < inputCommand->argsNum && strcmp(inputCommand->args[separator], "--") != 0) {
+        separator++;
+    }
+    if(separator == first || separator + 1 >= inputCommand->argsNum) {
+        fprintf(stderr, "smallsh: watch: usage: watch [-d delay] path... -- command\n");
+        lastStatus = 2;
+        return;
+    }
+
+    int inotifyFD = shellFD(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    if(inotifyFD == -1) {
+        perror("smallsh: watch");
+        lastStatus = 1;
+        return;
+    }
+    // Path of each watch descriptor, to extend the watch into new directories
+    char **watchPaths = NULL;
+    int watchPathsNum = 0;
+    for(int i = first; i < separator; i++) {
+        if(access(inputCommand->args[i], F_OK) == -1) {
+            fprintf(stderr, "smallsh: watch: %s: %s\n", inputCommand->args[i], strerror(errno));
+        }
+        addWatches(inotifyFD, inputCommand->args[i], &watchPaths, &watchPathsNum);
+    }
+    int debounceFD = shellFD(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+
+    sigset_t interruptMask, oldMask;
+    sigemptyset(&interruptMask);
+    sigaddset(&interruptMask, SIGINT);
+    sigprocmask(SIG_BLOCK, &interruptMask, &oldMask);
+    if(interruptFD == -1) {
+        interruptFD = shellFD(signalfd(-1, &interruptMask, SFD_NONBLOCK | SFD_CLOEXEC));
+    }
+    syncReadBuffers();
+
+    char **argv = inputCommand->args + separator + 1;
+    pid_t runPID = startWatchRun(argv, &oldMask);
+    int runFD = runPID > 0 ? shellFD(syscall(SYS_pidfd_open, runPID, 0)) : -1;
+    bool pending = false;
+    bool interrupted = false;
+    char *events = malloc(64 * 1024);
+    while(!interrupted || runFD != -1) {
+        int fds[4] = {interruptFD, inotifyFD, debounceFD, runFD};
+        int ready = waitEvents(fds, runFD != -1 ? 4 : 3);
+        if(ready == WAIT_ERROR || (ready == interruptFD && takeInterrupt())) {
+            // The run is in a process group of its own, so the interrupt is passed on
+            interrupted = true;
+            if(runFD != -1) {
+                kill(-runPID, SIGINT);
+            }
+            // Without the event loop, wait for the run to end below
+            ready = ready == WAIT_ERROR ? runFD : ready;
+        } else if(ready == inotifyFD) {
+            ssize_t length;
+            bool changed = false;
+            while((length = read(inotifyFD, events, 64 * 1024)) > 0) {
+                for(char *next = events; next < events + length; ) {
+                    struct inotify_event *event = (struct inotify_event *)next;
+                    next += sizeof(struct inotify_event) + event->len;
+                    if(event->wd <= 0 || event->wd >= watchPathsNum || watchPaths[event->wd] == NULL) {
+                        continue;
+                    }
+                    changed = true;
+                    // New directories are watched too, and a replaced file is watched again
+                    char path[4096];
+                    snprintf(path, sizeof(path), "%s/%s", watchPaths[event->wd], event->name);
+                    if((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                        addWatches(inotifyFD, path, &watchPaths, &watchPathsNum);
+                    } else if(event->mask & IN_IGNORED) {
+                        free(watchPaths[event->wd]);
+                        watchPaths[event->wd] = NULL;
+                    }
+                }
+            }
+            if(changed && !pending && runFD != -1) {
+                kill(-runPID, SIGTERM);
+            }
+            if(changed) {
+                // The burst is over once delay passes with nothing new
+                struct itimerspec when = {{0, 0}, {delay / NS_PER_SECOND, delay % NS_PER_SECOND}};
+                when.it_value.tv_nsec += delay == 0 ? 1 : 0;
+                timerfd_settime(debounceFD, 0, &when, NULL);
+                pending = true;
+            }
+        } else if(ready == debounceFD) {
+            uint64_t expirations;
+            read(debounceFD, &expirations, sizeof(expirations));
+            // Files replaced by renaming are watched again under their names
+            for(int i = first; i < separator; i++) {
+                addWatches(inotifyFD, inputCommand->args[i], &watchPaths, &watchPathsNum);
+            }
+        }
+        if(ready == runFD && ready != -1) {
+            int status;
+            waitpid(runPID, &status, 0);
+            close(runFD);
+            runFD = -1;
+            childStatus = status;
+            childSkipped = false;
+            lastStatus = statusCode(status);
+            if(WIFSIGNALED(status) && !pending && !interrupted) {
+                printSignalStatus(status);
+            }
+        }
+
+        // Start again once the burst is over and the cancelled run has ended
+        struct itimerspec left;
+        timerfd_gettime(debounceFD, &left);
+        if(pending && !interrupted && runFD == -1 && left.it_value.tv_sec == 0 && left.it_value.tv_nsec == 0) {
+            pending = false;
+            runPID = startWatchRun(argv, &oldMask);
+            runFD = runPID > 0 ? shellFD(syscall(SYS_pidfd_open, runPID, 0)) : -1;
+        }
+    }
+
+    takeInterrupt();
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    for(int i = 0; i < watchPathsNum; i++) {
+        free(watchPaths[i]);
+    }
+    free(watchPaths);
+    free(events);
+    close(debounceFD);
+    close(inotifyFD);
+    lastStatus = 128 + SIGINT;
+}
+
+/*
+ *  Watch path for changes, and if it is a directory, everything below it. A path already
+ *  watched keeps its watch descriptor.
+ */
+void addWatches(int inotifyFD, const char *path, char ***watchPaths, int *watchPathsNum) {
+    int wd = inotify_add_watch(inotifyFD, path, WATCH_EVENTS);
+    if(wd == -1) {
+        return;
+    }
+    if(wd >= *watchPathsNum) {
+        int size = wd * 2 + 16;
+        *watchPaths = realloc(*watchPaths, size * sizeof(char *));
+        memset(*watchPaths + *watchPathsNum, 0, (size - *watchPathsNum) * sizeof(char *));
+        *watchPathsNum = size;
+    }
+    if((*watchPaths)[wd] != NULL) {
+        return;
+    }
+    (*watchPaths)[wd] = strdup(path);
+
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    while(dir != NULL && (entry = readdir(dir)) != NULL) {
+        if(entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            char subdir[4096];
+            snprintf(subdir, sizeof(subdir), "%s/%s", path, entry->d_name);
+            addWatches(inotifyFD, subdir, watchPaths, watchPathsNum);
+        }
+    }
+    if(dir != NULL) {
+        closedir(dir);
+    }
+}
+
+/*
+ *  Start a run of watch's command in a process group of its own, so cancelling it reaches
+ *  everything it started, with the signal mask childMask. Returns its pid, or -1.
+ */
+pid_t startWatchRun(char **argv, const sigset_t *childMask) {
+    fflush(stdout);
+    char **envp = getEnvSnapshot();
+    pid_t pid = fork();
+    switch(pid) {
+        case -1:
+            perror("fork() failed\n");
+            break;
+        case 0:
+            setpgid(0, 0);
+            sigprocmask(SIG_SETMASK, childMask, NULL);
+            SIGINTAction.sa_handler = SIG_DFL;
+            sigaction(SIGINT, &SIGINTAction, NULL);
+            SIGTSTPAction.sa_handler = SIG_IGN;
+            sigaction(SIGTSTP, &SIGTSTPAction, NULL);
+            // Out of the terminal's foreground group, reading it would stop the command
+            if(isatty(STDIN_FILENO)) {
+                struct redirection nullInput = {STDIN_FILENO, TOKEN_LESS, "/dev/null"};
+                createRedirectFD(&nullInput);
+            }
+            applyEnvOverrides(envp);
+            environ = envp;
+            execvp(argv[0], argv);
+            perror("execvp() failed, command could not be executed\n");
+            fflush(stdout);
+            exit(1);
+        default:
+            // Set here too, so a SIGTERM sent straight away finds the group
+            setpgid(pid, pid);
+    }
+    return pid;
+}
+
+/*
+ *  Return the CLOCK_BOOTTIME time in ns, which unlike CLOCK_MONOTONIC goes on while suspended.
+ */
+uint64_t bootTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    return now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+/*
+ *  Run a command periodically: every interval command [args...]
+ *  The interval is a duration as sleep takes it, or milliseconds like 500ms. Each run is a
+ *  background job; in between, the schedule is an entry in the timer wheel with no process.
+ *  every -r id... removes schedules of every or at.
+ */
+void everyCommand() {
+    uint64_t period;
+    if(inputCommand->argsNum > 1 && strcmp(inputCommand->args[1], "-r") == 0) {
+        removeSchedules(2);
+        return;
+    }
+    if(inputCommand->argsNum < 3) {
+        fprintf(stderr, "smallsh: every: usage: every interval command, or every -r id...\n");
+        lastStatus = 2;
+        return;
+    }
+    if(!parseDelay(inputCommand->args[1], &period) || period == 0) {
+        fprintf(stderr, "smallsh: every: %s: bad interval\n", inputCommand->args[1]);
+        lastStatus = 2;
+        return;
+    }
+    addSchedule(period, bootTime() + period, 2);
+}
+
+/*
+ *  Run a command once at a time of day, today or else tomorrow: at hh:mm[:ss] command [args...]
+ *  The wall clock time is turned into a time on the schedule clock when it is set, so a later
+ *  change of the system clock does not move it. at -r id... removes schedules.
+ */
+void atCommand() {
+    if(inputCommand->argsNum > 1 && strcmp(inputCommand->args[1], "-r") == 0) {
+        removeSchedules(2);
+        return;
+    }
+    int hour, minute, second = 0;
+    char extra;
+    if(inputCommand->argsNum < 3) {
+        fprintf(stderr, "smallsh: at: usage: at hh:mm[:ss] command, or at -r id...\n");
+        lastStatus = 2;
+        return;
+    }
+    int fields = sscanf(inputCommand->args[1], "%d:%d:%d%c", &hour, &minute, &second, &extra);
+    if(fields < 2 || fields > 3 || hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 59
+       || (fields == 2 && strchr(strchr(inputCommand->args[1], ':') + 1, ':') != NULL)) {
+        fprintf(stderr, "smallsh: at: %s: expected a time like 14:00\n", inputCommand->args[1]);
+        lastStatus = 2;
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct tm when;
+    localtime_r(&now.tv_sec, &when);
+    when.tm_hour = hour;
+    when.tm_min = minute;
+    when.tm_sec = second;
+    when.tm_isdst = -1;
+    time_t target = mktime(&when);
+    if(target <= now.tv_sec) {
+        when.tm_mday++;
+        when.tm_hour = hour;
+        when.tm_min = minute;
+        when.tm_sec = second;
+        when.tm_isdst = -1;
+        target = mktime(&when);
+    }
+    uint64_t wait = (target - now.tv_sec) * NS_PER_SECOND - now.tv_nsec;
+    addSchedule(0, bootTime() + wait, 2);
+}
+
+/*
+ *  Add a schedule for the current command's words from first on, with its assignments and
+ *  redirections, and print its id.
+ */
+void addSchedule(uint64_t period, uint64_t due, int first) {
+    getEventLoop();
+    struct schedule *entry = calloc(1, sizeof(struct schedule));
+    entry->id = nextScheduleID++;
+    entry->command = joinArgs(inputCommand->args + first);
+    entry->launch = saveLaunch(inputCommand->args + first, NULL);
+    entry->period = period;
+    entry->due = due;
+    insertSchedule(entry);
+    schedulesNum++;
+    armScheduleTimer();
+    printf("Schedule %d is set\n", entry->id);
+    fflush(stdout);
+}
+
+/*
+ *  Remove the schedules with the ids in the current command's words from first on.
+ */
+void removeSchedules(int first) {
+    for(int i = first; i < inputCommand->argsNum; i++) {
+        char *end;
+        long id = strtol(inputCommand->args[i], &end, 10);
+        bool found = false;
+        for(int slot = 0; slot < WHEEL_SLOTS && !found && *end == '\0'; slot++) {
+            for(struct schedule **link = &wheel[slot]; *link != NULL; link = &(*link)->next) {
+                if((*link)->id == id) {
+                    struct schedule *entry = *link;
+                    *link = entry->next;
+                    freeSchedule(entry);
+                    schedulesNum--;
+                    found = true;
+                    break;
+                }
+            }
+        }
+        if(!found) {
+            fprintf(stderr, "smallsh: %s: %s: no such schedule\n", inputCommand->args[0], inputCommand->args[i]);
+            lastStatus = 1;
+        }
+    }
+    armScheduleTimer();
+}
+
+/*
+ *  Put a schedule in the wheel slot of the second it is due.
+ */
+void insertSchedule(struct schedule *entry) {
+    int slot = entry->due / WHEEL_TICK % WHEEL_SLOTS;
+    entry->next = wheel[slot];
+    wheel[slot] = entry;
+}
+
+/*
+ *  Return when the next schedule is due, or 0 for none. Slots are searched from the current
+ *  tick for one lap, taking only entries due within the lap; beyond that every entry is
+ *  looked at, which only happens when nothing is due for WHEEL_SLOTS seconds.
+ */
+uint64_t nextScheduleTime() {
+    if(schedulesNum == 0) {
+        return 0;
+    }
+    for(uint64_t tick = wheelTick; tick < wheelTick + WHEEL_SLOTS; tick++) {
+        uint64_t due = 0;
+        for(struct schedule *entry = wheel[tick % WHEEL_SLOTS]; entry != NULL; entry = entry->next) {
+            if(entry->due / WHEEL_TICK <= tick && (due == 0 || entry->due < due)) {
+                due = entry->due;
+            }
+        }
+        if(due != 0) {
+            return due;
+        }
+    }
+    uint64_t due = 0;
+    for(int slot = 0; slot < WHEEL_SLOTS; slot++) {
+        for(struct schedule *entry = wheel[slot]; entry != NULL; entry = entry->next) {
+            due = due == 0 || entry->due < due ? entry->due : due;
+        }
+    }
+    return due;
+}
+
+/*
+ *  Arm the schedule timer for the next schedule due, or disarm it.
+ */
+void armScheduleTimer() {
+    getEventLoop();
+    nextScheduleDue = nextScheduleTime();
+    struct itimerspec when = {{0, 0}, {nextScheduleDue / NS_PER_SECOND, nextScheduleDue % NS_PER_SECOND}};
+    timerfd_settime(scheduleTimerFD, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+/*
+ *  Advance the timer wheel to now, firing the schedules that are due. After a suspend or a
+ *  long foreground command more than one slot has passed; a lap or more means every slot.
+ */
+void runSchedules() {
+    uint64_t expirations;
+    getEventLoop();
+    read(scheduleTimerFD, &expirations, sizeof(expirations));
+    uint64_t now = bootTime();
+    uint64_t nowTick = now / WHEEL_TICK;
+    uint64_t steps = nowTick - wheelTick + 1 < WHEEL_SLOTS ? nowTick - wheelTick + 1 : WHEEL_SLOTS;
+
+    // Take the due entries out first, so one put back in a later slot is not fired twice
+    struct schedule *fired = NULL;
+    for(uint64_t i = 0; i < steps; i++) {
+        struct schedule **link = &wheel[(wheelTick + i) % WHEEL_SLOTS];
+        while(*link != NULL) {
+            struct schedule *entry = *link;
+            if(entry->due > now) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            entry->next = fired;
+            fired = entry;
+        }
+    }
+    wheelTick = nowTick;
+
+    while(fired != NULL) {
+        struct schedule *entry = fired;
+        fired = entry->next;
+        fireSchedule(entry, now);
+        if(entry->period == 0) {
+            freeSchedule(entry);
+            schedulesNum--;
+        } else {
+            insertSchedule(entry);
+        }
+    }
+    armScheduleTimer();
+}
+
+/*
+ *  Launch a schedule that is due and work out when it is due next. A firing more than a
+ *  second late was missed: with set misfire=once (the default) it runs, once, however many
+ *  periods passed, and with misfire=skip it does not run. Either way the schedule keeps to
+ *  its period, due next at the first multiple of it after now.
+ */
+void fireSchedule(struct schedule *entry, uint64_t now) {
+    bool late = now - entry->due > NS_PER_SECOND;
+    if(late && misfirePolicy == MISFIRE_SKIP) {
+        entry->missed++;
+    } else {
+        entry->runs++;
+        startDeferredLaunch(entry->launch, false);
+    }
+    if(entry->period != 0) {
+        uint64_t periods = (now - entry->due) / entry->period + 1;
+        entry->missed += periods - 1;
+        entry->due += periods * entry->period;
+    }
+}
+
+/*
+ *  List the schedules with their next wall clock time to fire, for jobs.
+ */
+void listSchedules() {
+    if(schedulesNum == 0) {
+        return;
+    }
+    struct timespec realNow;
+    clock_gettime(CLOCK_REALTIME, &realNow);
+    uint64_t now = bootTime();
+    // By id, which is the order they were set in
+    struct schedule **entries = malloc(schedulesNum * sizeof(struct schedule *));
+    int entriesNum = 0;
+    for(int slot = 0; slot < WHEEL_SLOTS; slot++) {
+        for(struct schedule *entry = wheel[slot]; entry != NULL; entry = entry->next) {
+            int i = entriesNum++;
+            for(; i > 0 && entries[i - 1]->id > entry->id; i--) {
+                entries[i] = entries[i - 1];
+            }
+            entries[i] = entry;
+        }
+    }
+    for(int i = 0; i < entriesNum; i++) {
+        struct schedule *entry = entries[i];
+        uint64_t wait = entry->due > now ? entry->due - now : 0;
+        time_t fire = realNow.tv_sec + (realNow.tv_nsec + wait) / NS_PER_SECOND;
+        struct tm when;
+        char fireText[32], rule[32];
+        localtime_r(&fire, &when);
+        strftime(fireText, sizeof(fireText), "%Y-%m-%d %H:%M:%S", &when);
+        if(entry->period != 0) {
+            snprintf(rule, sizeof(rule), "every %gs", entry->period / 1e9);
+        } else {
+            snprintf(rule, sizeof(rule), "at");
+        }
+        printf("[s%d] %-12s next %s (in %.0fs), %lu runs, %lu missed  %s\n", entry->id, rule, fireText,
+               wait / 1e9, entry->runs, entry->missed, entry->command);
+    }
+    free(entries);
+}
+
+/*
+ *  Free a schedule.
+ */
+void freeSchedule(struct schedule *entry) {
+    free(entry->command);
+    freeDeferredLaunch(entry->launch);
+    free(entry);
+}
+
+/*
+ *  Drop every schedule.
+ */
+void clearSchedules() {
+    for(int slot = 0; slot < WHEEL_SLOTS; slot++) {
+        while(wheel[slot] != NULL) {
+            struct schedule *entry = wheel[slot];
+            wheel[slot] = entry->next;
+            freeSchedule(entry);
+        }
+    }
+    schedulesNum = 0;
+    nextScheduleDue = 0;
+}